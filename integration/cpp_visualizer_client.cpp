@@ -1,185 +1,4049 @@
 #include "cpp_visualizer_client.hpp"
+#include "visualizer_trace.hpp"
 #include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <ctime>
 #include <sstream>
+#include <chrono>
+#include <deque>
+#include <algorithm>
+#include <iterator>
+#include <charconv>
+#include <string_view>
+#include <cmath>
+#include <cctype>
+#include <limits>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#ifdef VISUALIZER_WITH_ZSTD
+#include <zstd.h>
+#endif
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace cpp_visualizer {
 
+namespace {
+
+// curl_global_init is not thread-safe and must only run once per process,
+// so it happens on first client construction and is never undone.
+std::once_flag curl_init_flag;
+
+const char kH2cScheme[] = "h2c://";
+const char kUnixScheme[] = "unix://";
+
+// One batch request owned by the multiplexed sender
+struct MultiRequest {
+    CURL* easy = nullptr;
+    std::string structure_name;
+    std::string endpoint;
+    std::string body;
+    std::string response;
+    const char* encoding = nullptr;   // Content-Encoding header, if compressed
+    std::vector<BatchOp> ops;
+    int mirrored = 0;   // ops already applied to the local mirror
+    std::chrono::steady_clock::time_point started;
+};
+
+// Stats key for a request: the method and the route with names and IDs
+// replaced by placeholders, e.g. "PUT /api/live/structure/:name/node/:id".
+// Written into key, so a caller with a warm buffer does not allocate.
+void endpointKey(const std::string& method, const std::string& endpoint, std::string& key) {
+    key.assign(method).push_back(' ');
+    std::string_view route(endpoint);
+    route = route.substr(0, route.find('?'));
+    std::string_view previous;
+    size_t pos = route.empty() || route[0] != '/' ? 0 : 1;
+    while (pos <= route.size()) {
+        size_t slash = route.find('/', pos);
+        if (slash == std::string_view::npos) {
+            slash = route.size();
+        }
+        std::string_view segment = route.substr(pos, slash - pos);
+        if (!segment.empty() && std::all_of(segment.begin(), segment.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            segment = ":id";
+        } else if (previous == "structure" || previous == "shm") {
+            segment = ":name";
+        } else if (previous == "stage" || previous == "diff") {
+            segment = ":stage";
+        }
+        key.push_back('/');
+        key.append(segment.data(), segment.size());
+        previous = segment;
+        pos = slash + 1;
+    }
+}
+
+// Starting capacity for the per-thread request buffers, so a warm buffer
+// does not have to grow again when IDs and versions gain a digit
+std::string reservedString(size_t capacity) {
+    std::string buffer;
+    buffer.reserve(capacity);
+    return buffer;
+}
+
+// Percent-encodes a path segment; names made only of unreserved characters,
+// the usual case, are appended as they are
+void appendPathSegment(std::string& route, const std::string& segment) {
+    auto unreserved = [](unsigned char c) {
+        return std::isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+    };
+    if (std::all_of(segment.begin(), segment.end(), unreserved)) {
+        route.append(segment);
+        return;
+    }
+    static const char hex[] = "0123456789ABCDEF";
+    for (unsigned char c : segment) {
+        if (unreserved(c)) {
+            route.push_back(static_cast<char>(c));
+        } else {
+            route.push_back('%');
+            route.push_back(hex[c >> 4]);
+            route.push_back(hex[c & 0xF]);
+        }
+    }
+}
+
+// "/api/live/structures/<id>" for a structure whose server ID is known,
+// "/api/live/structure/<escaped name>" otherwise
+void appendStructurePath(std::string& route, int structure_id, const std::string& structure_name) {
+    if (structure_id >= 0) {
+        char digits[16];
+        route.append("/api/live/structures/");
+        route.append(digits, std::to_chars(digits, digits + sizeof digits, structure_id).ptr);
+    } else {
+        route.append("/api/live/structure/");
+        appendPathSegment(route, structure_name);
+    }
+}
+
+// "<structure path>/node[/<id>]<query>" in a buffer reused per thread; a
+// negative node_id leaves the ID off
+const std::string& nodeRoute(int structure_id, const std::string& structure_name, int node_id, const char* query) {
+    thread_local std::string route = reservedString(256);
+    route.clear();
+    appendStructurePath(route, structure_id, structure_name);
+    route.append("/node");
+    if (node_id >= 0) {
+        char digits[16];
+        route.push_back('/');
+        route.append(digits, std::to_chars(digits, digits + sizeof digits, node_id).ptr);
+    }
+    route.append(query);
+    return route;
+}
+
+std::string formatBytes(uint64_t bytes) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    if (bytes >= (1u << 30)) {
+        out << bytes / double(1u << 30) << " GB";
+    } else if (bytes >= (1u << 20)) {
+        out << bytes / double(1u << 20) << " MB";
+    } else if (bytes >= (1u << 10)) {
+        out << bytes / double(1u << 10) << " KB";
+    } else {
+        out << std::setprecision(0) << double(bytes) << " B";
+    }
+    return out.str();
+}
+
+std::string formatLatency(uint64_t ns) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(ns >= 1000000000 ? 2 : 1);
+    if (ns >= 1000000000) {
+        out << ns / 1e9 << "s";
+    } else if (ns >= 1000000) {
+        out << ns / 1e6 << "ms";
+    } else {
+        out << ns / 1e3 << "us";
+    }
+    return out.str();
+}
+
+const char* const kGzipEncoding = "Content-Encoding: gzip";
+const char* const kZstdEncoding = "Content-Encoding: zstd";
+
+// Largest body size the adaptive compression threshold can climb to
+const size_t kMaxCompressionThreshold = 1 << 20;
+
+// The stream is kept per thread and reset between bodies, so deflate's
+// internal state is allocated once
+bool gzipCompress(const std::string& in, std::string& out, int level) {
+    struct Deflater {
+        z_stream stream{};
+        int level = 0;
+        bool ready = false;
+        ~Deflater() {
+            if (ready) {
+                deflateEnd(&stream);
+            }
+        }
+    };
+    thread_local Deflater deflater;
+
+    level = level > 0 ? std::min(level, 9) : 1;
+    if (deflater.ready && deflater.level != level) {
+        deflateEnd(&deflater.stream);
+        deflater.ready = false;
+    }
+    if (!deflater.ready) {
+        deflater.stream = z_stream{};
+        // 15 window bits plus 16 selects the gzip wrapper
+        if (deflateInit2(&deflater.stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        deflater.ready = true;
+        deflater.level = level;
+    } else {
+        deflateReset(&deflater.stream);
+    }
+
+    z_stream& stream = deflater.stream;
+    out.resize(deflateBound(&stream, static_cast<uLong>(in.size())));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    stream.avail_in = static_cast<uInt>(in.size());
+    stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        return false;
+    }
+    out.resize(stream.total_out);
+    return true;
+}
+
+#ifdef VISUALIZER_WITH_ZSTD
+bool zstdCompress(const std::string& in, std::string& out, int level) {
+    thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> context(ZSTD_createCCtx(), ZSTD_freeCCtx);
+    if (!context) {
+        return false;
+    }
+    out.resize(ZSTD_compressBound(in.size()));
+    size_t size = ZSTD_compressCCtx(context.get(), &out[0], out.size(), in.data(), in.size(), level > 0 ? level : 1);
+    if (ZSTD_isError(size)) {
+        return false;
+    }
+    out.resize(size);
+    return true;
+}
+#endif
+
+// Ops waiting for one structure. A lane has at most one request in flight,
+// which is what keeps a structure's ops in order under multiplexing.
+struct Lane {
+    std::deque<BatchOp> pending;
+    size_t singles = 0;     // ops at the front to send one per request
+    bool in_flight = false;
+};
+
+} // namespace
+
+namespace detail {
+
+/**
+ * Client end of the shared-memory op ring. The layout is documented with the
+ * reader in server/shmRing.ts; this side only ever advances write_index and
+ * the server only ever advances read_index.
+ */
+class ShmRing {
+public:
+    static constexpr uint32_t kMagic = 0x31525a56;   // "VZR1"
+    static constexpr uint32_t kLayoutVersion = 1;
+    static constexpr size_t kHeaderSize = 4096;
+    static constexpr size_t kSlotSize = 64;
+    static constexpr size_t kMaxRecordSlots = 1024;
+
+    enum Kind : uint8_t { Define = 1, Add = 2, Remove = 3, Update = 4, Drop = 5 };
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slot_size;
+        uint32_t capacity;
+        alignas(64) std::atomic<uint64_t> write_index;
+        alignas(64) std::atomic<uint64_t> read_index;
+        alignas(64) std::atomic<uint64_t> dropped;
+    };
+
+    struct Record {
+        uint8_t kind;
+        uint8_t flags;
+        uint16_t slots;
+        uint32_t structure;
+        int32_t node_id;
+        int32_t index;
+        uint32_t payload_length;
+        uint32_t reserved;
+        char payload[kSlotSize - 24];
+    };
+
+    static std::unique_ptr<ShmRing> create(const std::string& name, size_t capacity,
+                                           OverflowPolicy overflow, std::string& error) {
+        // Never reuse a live segment: truncating one a reader still has mapped
+        // zeroes its header under it. A leftover name (a crashed process
+        // whose PID came round again) is unlinked, which leaves any reader's
+        // mapping alone, and the segment made afresh.
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            shm_unlink(name.c_str());
+            fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        }
+        if (fd < 0) {
+            error = "shm_open " + name + ": " + std::strerror(errno);
+            return nullptr;
+        }
+        size_t size = kHeaderSize + capacity * kSlotSize;
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            error = "ftruncate " + name + ": " + std::strerror(errno);
+            close(fd);
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+        void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            error = "mmap " + name + ": " + std::strerror(errno);
+            close(fd);
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+
+        std::unique_ptr<ShmRing> ring(new ShmRing(name, fd, base, size, capacity, overflow));
+        // The segment starts zeroed, so only the fixed fields need writing;
+        // the magic goes last so a reader never sees a half-built header
+        Header* header = ring->header_;
+        header->version = kLayoutVersion;
+        header->slot_size = kSlotSize;
+        header->capacity = static_cast<uint32_t>(capacity);
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = kMagic;
+        return ring;
+    }
+
+    ~ShmRing() {
+        munmap(base_, size_);
+        close(fd_);
+        shm_unlink(name_.c_str());
+    }
+
+    const std::string& name() const { return name_; }
+
+    bool drained() const {
+        return header_->read_index.load(std::memory_order_acquire) >= write_index_;
+    }
+
+    /**
+     * Wait until the next `slots` slots are free, or fail at once under
+     * OverflowPolicy::Drop, counting `records` as dropped. The reader only
+     * ever frees slots, so publishes filling that room cannot be dropped.
+     */
+    bool reserve(size_t slots, size_t records) {
+        // Never run over slots the reader has not consumed yet
+        while (slots > capacity_ ||
+               write_index_ + slots - header_->read_index.load(std::memory_order_acquire) > capacity_) {
+            if (overflow_ == OverflowPolicy::Drop || slots > capacity_) {
+                header_->dropped.fetch_add(records, std::memory_order_relaxed);
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    /**
+     * Append one record. Returns false when the op was dropped because the
+     * ring was full (OverflowPolicy::Drop) or the payload is too large.
+     */
+    bool publish(Kind kind, uint32_t structure, int node_id, int index, const char* payload, size_t length) {
+        const size_t first = sizeof(Record::payload);
+        size_t slots = 1 + (length > first ? (length - first + kSlotSize - 1) / kSlotSize : 0);
+        if (slots > max_record_slots_) {
+            header_->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        if (!reserve(slots, 1)) {
+            return false;
+        }
+
+        Record* record = reinterpret_cast<Record*>(slot(write_index_));
+        record->kind = kind;
+        record->flags = index >= 0 ? 1 : 0;
+        record->slots = static_cast<uint16_t>(slots);
+        record->structure = structure;
+        record->node_id = node_id;
+        record->index = index;
+        record->payload_length = static_cast<uint32_t>(length);
+        record->reserved = 0;
+        size_t copied = std::min(length, first);
+        std::memcpy(record->payload, payload, copied);
+        for (size_t i = 1; i < slots; ++i) {
+            size_t chunk = std::min(length - copied, kSlotSize);
+            std::memcpy(slot(write_index_ + i), payload + copied, chunk);
+            copied += chunk;
+        }
+
+        write_index_ += slots;
+        header_->write_index.store(write_index_, std::memory_order_release);
+        return true;
+    }
+
+private:
+    ShmRing(const std::string& name, int fd, void* base, size_t size, size_t capacity, OverflowPolicy overflow)
+        : name_(name), fd_(fd), base_(base), size_(size),
+          header_(static_cast<Header*>(base)),
+          slots_(static_cast<char*>(base) + kHeaderSize),
+          capacity_(capacity), max_record_slots_(std::min(capacity, kMaxRecordSlots)),
+          overflow_(overflow), write_index_(0) {}
+
+    char* slot(uint64_t position) { return slots_ + (position & (capacity_ - 1)) * kSlotSize; }
+
+    std::string name_;
+    int fd_;
+    void* base_;
+    size_t size_;
+    Header* header_;
+    char* slots_;
+    size_t capacity_;
+    size_t max_record_slots_;
+    OverflowPolicy overflow_;
+    uint64_t write_index_;
+};
+
+namespace {
+
+// MessagePack headers for maps and strings, so metadata can be written
+// without first copying it into a json object
+void appendMsgpackLength(std::string& out, size_t n, uint8_t fix, size_t fix_max, uint8_t marker8, uint8_t marker16) {
+    if (n <= fix_max) {
+        out.push_back(static_cast<char>(fix | n));
+    } else if (marker8 && n <= 0xff) {
+        out.push_back(static_cast<char>(marker8));
+        out.push_back(static_cast<char>(n));
+    } else if (n <= 0xffff) {
+        out.push_back(static_cast<char>(marker16));
+        out.push_back(static_cast<char>(n >> 8));
+        out.push_back(static_cast<char>(n));
+    } else {
+        out.push_back(static_cast<char>(marker16 + 1));   // the 32-bit form follows the 16-bit one
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out.push_back(static_cast<char>(n >> shift));
+        }
+    }
+}
+
+void appendBigEndian(std::string& out, uint64_t value, int bytes) {
+    for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+        out.push_back(static_cast<char>(value >> shift));
+    }
+}
+
+void appendCborHead(std::string& out, uint8_t major, uint64_t n) {
+    uint8_t type = static_cast<uint8_t>(major << 5);
+    if (n < 24) {
+        out.push_back(static_cast<char>(type | n));
+    } else if (n <= 0xff) {
+        out.push_back(static_cast<char>(type | 24));
+        appendBigEndian(out, n, 1);
+    } else if (n <= 0xffff) {
+        out.push_back(static_cast<char>(type | 25));
+        appendBigEndian(out, n, 2);
+    } else if (n <= 0xffffffff) {
+        out.push_back(static_cast<char>(type | 26));
+        appendBigEndian(out, n, 4);
+    } else {
+        out.push_back(static_cast<char>(type | 27));
+        appendBigEndian(out, n, 8);
+    }
+}
+
+// The shortest digits that read back as number, laid out as json::dump()
+// lays them out: plain decimals from 1e-4 up to 1e15, a ".0" on whole
+// numbers, and an exponent of at least two digits past that range
+void appendDouble(std::string& out, double number) {
+    char buffer[32];
+    char* end = std::to_chars(buffer, buffer + sizeof buffer, number, std::chars_format::scientific).ptr;
+    char* e = std::find(buffer, end, 'e');
+    int exponent = 0;
+    std::from_chars(e + 1 + (e[1] == '+'), end, exponent);
+
+    char* first = buffer;
+    if (*first == '-') {
+        out.push_back('-');
+        ++first;
+    }
+    char digits[20];
+    int k = 0;
+    for (char* c = first; c != e; ++c) {
+        if (*c != '.') {
+            digits[k++] = *c;
+        }
+    }
+    // The decimal point falls after n digits
+    int n = exponent + 1;
+
+    if (k <= n && n <= 15) {
+        out.append(digits, k);
+        out.append(static_cast<size_t>(n - k), '0');
+        out.append(".0");
+    } else if (0 < n && n <= 15) {
+        out.append(digits, n);
+        out.push_back('.');
+        out.append(digits + n, k - n);
+    } else if (-4 < n && n <= 0) {
+        out.append("0.");
+        out.append(static_cast<size_t>(-n), '0');
+        out.append(digits, k);
+    } else {
+        out.push_back(digits[0]);
+        if (k > 1) {
+            out.push_back('.');
+            out.append(digits + 1, k - 1);
+        }
+        out.append(exponent < 0 ? "e-" : "e+");
+        if (std::abs(exponent) < 10) {
+            out.push_back('0');
+        }
+        char exp[8];
+        out.append(exp, std::to_chars(exp, exp + sizeof exp, std::abs(exponent)).ptr);
+    }
+}
+
+} // namespace
+
+void BodyWriter::beginObject(size_t size) {
+    open(size, '{', 0x80, 0xde, 5);
+}
+
+void BodyWriter::beginArray(size_t size) {
+    open(size, '[', 0x90, 0xdc, 4);
+}
+
+void BodyWriter::endObject() {
+    close('}');
+}
+
+void BodyWriter::endArray() {
+    close(']');
+}
+
+void BodyWriter::key(const char* name, size_t length) {
+    element();
+    string(name, length);
+    if (format_ == WireFormat::Json) {
+        out_.push_back(':');
+    }
+    after_key_ = true;
+}
+
+void BodyWriter::value(const char* text, size_t length) {
+    element();
+    string(text, length);
+}
+
+void BodyWriter::value(bool flag) {
+    element();
+    switch (format_) {
+        case WireFormat::MessagePack: out_.push_back(static_cast<char>(flag ? 0xc3 : 0xc2)); break;
+        case WireFormat::Cbor: out_.push_back(static_cast<char>(flag ? 0xf5 : 0xf4)); break;
+        case WireFormat::Json: out_.append(flag ? "true" : "false"); break;
+    }
+}
+
+void BodyWriter::value(uint64_t number) {
+    element();
+    switch (format_) {
+        case WireFormat::MessagePack:
+            if (number <= 0x7f) {
+                out_.push_back(static_cast<char>(number));
+            } else if (number <= 0xff) {
+                out_.push_back(static_cast<char>(0xcc));
+                appendBigEndian(out_, number, 1);
+            } else if (number <= 0xffff) {
+                out_.push_back(static_cast<char>(0xcd));
+                appendBigEndian(out_, number, 2);
+            } else if (number <= 0xffffffff) {
+                out_.push_back(static_cast<char>(0xce));
+                appendBigEndian(out_, number, 4);
+            } else {
+                out_.push_back(static_cast<char>(0xcf));
+                appendBigEndian(out_, number, 8);
+            }
+            break;
+        case WireFormat::Cbor:
+            appendCborHead(out_, 0, number);
+            break;
+        case WireFormat::Json:
+            appendChars(number);
+            break;
+    }
+}
+
+void BodyWriter::value(int64_t number) {
+    if (number >= 0) {
+        value(static_cast<uint64_t>(number));
+        return;
+    }
+    element();
+    switch (format_) {
+        case WireFormat::MessagePack:
+            if (number >= -32) {
+                out_.push_back(static_cast<char>(number));
+            } else if (number >= std::numeric_limits<int8_t>::min()) {
+                out_.push_back(static_cast<char>(0xd0));
+                appendBigEndian(out_, static_cast<uint64_t>(number), 1);
+            } else if (number >= std::numeric_limits<int16_t>::min()) {
+                out_.push_back(static_cast<char>(0xd1));
+                appendBigEndian(out_, static_cast<uint64_t>(number), 2);
+            } else if (number >= std::numeric_limits<int32_t>::min()) {
+                out_.push_back(static_cast<char>(0xd2));
+                appendBigEndian(out_, static_cast<uint64_t>(number), 4);
+            } else {
+                out_.push_back(static_cast<char>(0xd3));
+                appendBigEndian(out_, static_cast<uint64_t>(number), 8);
+            }
+            break;
+        case WireFormat::Cbor:
+            appendCborHead(out_, 1, static_cast<uint64_t>(-(number + 1)));
+            break;
+        case WireFormat::Json:
+            appendChars(number);
+            break;
+    }
+}
+
+void BodyWriter::value(double number) {
+    element();
+    uint64_t bits;
+    std::memcpy(&bits, &number, sizeof bits);
+    switch (format_) {
+        case WireFormat::MessagePack:
+            out_.push_back(static_cast<char>(0xcb));
+            appendBigEndian(out_, bits, 8);
+            break;
+        case WireFormat::Cbor:
+            out_.push_back(static_cast<char>(0xfb));
+            appendBigEndian(out_, bits, 8);
+            break;
+        case WireFormat::Json:
+            if (!std::isfinite(number)) {
+                // Same as json::dump()
+                out_.append("null");
+            } else {
+                appendDouble(out_, number);
+            }
+            break;
+    }
+}
+
+void BodyWriter::null() {
+    element();
+    switch (format_) {
+        case WireFormat::MessagePack: out_.push_back(static_cast<char>(0xc0)); break;
+        case WireFormat::Cbor: out_.push_back(static_cast<char>(0xf6)); break;
+        case WireFormat::Json: out_.append("null"); break;
+    }
+}
+
+bool BodyWriter::value(const json& node) {
+    switch (node.type()) {
+        case json::value_t::object:
+            beginObject(node.size());
+            if (overflowed_) {
+                return false;
+            }
+            for (auto it = node.begin(); it != node.end(); ++it) {
+                key(it.key());
+                if (!value(it.value())) {
+                    return false;
+                }
+            }
+            endObject();
+            return true;
+        case json::value_t::array:
+            beginArray(node.size());
+            if (overflowed_) {
+                return false;
+            }
+            for (const json& element : node) {
+                if (!value(element)) {
+                    return false;
+                }
+            }
+            endArray();
+            return true;
+        case json::value_t::string:
+            value(node.get_ref<const std::string&>());
+            return true;
+        case json::value_t::boolean:
+            value(node.get<bool>());
+            return true;
+        case json::value_t::number_integer:
+            value(node.get<int64_t>());
+            return true;
+        case json::value_t::number_unsigned:
+            value(node.get<uint64_t>());
+            return true;
+        case json::value_t::number_float:
+            value(node.get<double>());
+            return true;
+        default:
+            // null, and binary values, which have no JSON form either
+            null();
+            return true;
+    }
+}
+
+void BodyWriter::open(size_t size, char bracket, uint8_t msgpack_fix, uint8_t msgpack_marker16, uint8_t cbor_major) {
+    if (depth_ == kMaxDepth) {
+        // first_ has no slot for another level
+        overflowed_ = true;
+        ++skipped_;
+        return;
+    }
+    element();
+    switch (format_) {
+        case WireFormat::MessagePack: appendMsgpackLength(out_, size, msgpack_fix, 15, 0, msgpack_marker16); break;
+        case WireFormat::Cbor: appendCborHead(out_, cbor_major, size); break;
+        case WireFormat::Json: out_.push_back(bracket); break;
+    }
+    first_[depth_++] = true;
+}
+
+void BodyWriter::close(char bracket) {
+    if (skipped_ > 0 || depth_ == 0) {
+        overflowed_ = true;
+        skipped_ -= skipped_ > 0 ? 1 : 0;
+        return;
+    }
+    --depth_;
+    if (format_ == WireFormat::Json) {
+        out_.push_back(bracket);
+    }
+}
+
+// JSON separators: a comma before every element but the first, nothing
+// between a key and its value
+void BodyWriter::element() {
+    if (format_ != WireFormat::Json) {
+        return;
+    }
+    if (after_key_) {
+        after_key_ = false;
+    } else if (depth_ > 0) {
+        if (!first_[depth_ - 1]) {
+            out_.push_back(',');
+        }
+        first_[depth_ - 1] = false;
+    }
+}
+
+template <typename Number>
+void BodyWriter::appendChars(Number number) {
+    char buffer[24];
+    out_.append(buffer, std::to_chars(buffer, buffer + sizeof buffer, number).ptr);
+}
+
+void BodyWriter::string(const char* text, size_t length) {
+    switch (format_) {
+        case WireFormat::MessagePack:
+            appendMsgpackLength(out_, length, 0xa0, 31, 0xd9, 0xda);
+            out_.append(text, length);
+            return;
+        case WireFormat::Cbor:
+            appendCborHead(out_, 3, length);
+            out_.append(text, length);
+            return;
+        case WireFormat::Json:
+            break;
+    }
+    out_.push_back('"');
+    for (const char* end = text + length; text != end; ++text) {
+        char c = *text;
+        if (c == '"' || c == '\\') {
+            out_.push_back('\\');
+            out_.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            static const char hex[] = "0123456789abcdef";
+            out_.append("\\u00");
+            out_.push_back(hex[(c >> 4) & 0xf]);
+            out_.push_back(hex[c & 0xf]);
+        } else {
+            out_.push_back(c);
+        }
+    }
+    out_.push_back('"');
+}
+
+namespace {
+
+template <typename V>
+V loadField(const unsigned char* at) {
+    V value;
+    std::memcpy(&value, at, sizeof value);
+    return value;
+}
+
+// Calls visit with the field widened to bool, int64_t, uint64_t or double
+template <typename Visit>
+void visitField(const LayoutField& field, const unsigned char* record, Visit&& visit) {
+    const unsigned char* at = record + field.offset;
+    switch (field.kind) {
+        case LayoutField::Kind::Bool:
+            visit(loadField<bool>(at));
+            break;
+        case LayoutField::Kind::Float:
+            visit(field.size == sizeof(float) ? static_cast<double>(loadField<float>(at)) : loadField<double>(at));
+            break;
+        case LayoutField::Kind::Signed:
+            switch (field.size) {
+                case 1: visit(static_cast<int64_t>(loadField<int8_t>(at))); break;
+                case 2: visit(static_cast<int64_t>(loadField<int16_t>(at))); break;
+                case 4: visit(static_cast<int64_t>(loadField<int32_t>(at))); break;
+                default: visit(loadField<int64_t>(at)); break;
+            }
+            break;
+        case LayoutField::Kind::Unsigned:
+            switch (field.size) {
+                case 1: visit(static_cast<uint64_t>(loadField<uint8_t>(at))); break;
+                case 2: visit(static_cast<uint64_t>(loadField<uint16_t>(at))); break;
+                case 4: visit(static_cast<uint64_t>(loadField<uint32_t>(at))); break;
+                default: visit(loadField<uint64_t>(at)); break;
+            }
+            break;
+    }
+}
+
+void writeLayoutFields(BodyWriter& writer, const void* record, const void* context, bool metadata) {
+    const auto& fields = *static_cast<const std::vector<LayoutField>*>(context);
+    size_t count = 0;
+    for (const LayoutField& field : fields) {
+        count += field.metadata == metadata ? 1 : 0;
+    }
+    writer.beginObject(count);
+    for (const LayoutField& field : fields) {
+        if (field.metadata == metadata) {
+            writer.key(field.name);
+            visitField(field, static_cast<const unsigned char*>(record), [&](auto value) { writer.value(value); });
+        }
+    }
+    writer.endObject();
+}
+
+void writeLayoutValue(BodyWriter& writer, const void* record, const void* context) {
+    writeLayoutFields(writer, record, context, false);
+}
+
+void writeLayoutMetadata(BodyWriter& writer, const void* record, const void* context) {
+    writeLayoutFields(writer, record, context, true);
+}
+
+// For the paths that carry json values: encode as MessagePack, then decode
+json recordToJson(RecordCodec::WriteFn write, const void* record, const void* context) {
+    thread_local std::string scratch;
+    scratch.clear();
+    BodyWriter writer(scratch, WireFormat::MessagePack);
+    write(writer, record, context);
+    return json::from_msgpack(scratch);
+}
+
+} // namespace
+
+void appendOpPayload(std::string& out, const json& value, const std::map<std::string, json>& metadata) {
+    out.push_back(static_cast<char>(0x92));   // fixarray of 2
+    json::to_msgpack(value, nlohmann::detail::output_adapter<char>(out));
+    appendMsgpackLength(out, metadata.size(), 0x80, 15, 0, 0xde);
+    for (const auto& entry : metadata) {
+        appendMsgpackLength(out, entry.first.size(), 0xa0, 31, 0xd9, 0xda);
+        out.append(entry.first);
+        json::to_msgpack(entry.second, nlohmann::detail::output_adapter<char>(out));
+    }
+}
+
+static_assert(sizeof(ShmRing::Record) == ShmRing::kSlotSize, "op ring records must fill one slot");
+static_assert(offsetof(ShmRing::Header, write_index) == 64, "op ring header layout");
+static_assert(offsetof(ShmRing::Header, read_index) == 128, "op ring header layout");
+static_assert(offsetof(ShmRing::Header, dropped) == 192, "op ring header layout");
+
+/**
+ * Scans a JSON reply for structure objects as it arrives. Each element of a
+ * structure's "nodes" array is cut out and parsed on its own; the other
+ * fields are parsed into a json object per structure. Only the node or
+ * field being read is buffered, however large the structure is, unless
+ * nodes come before the structure's "name": those are held until the name
+ * arrives, since on_node is always given it.
+ */
+class NodeStream {
+public:
+    // structure_depth is 1 for a reply holding one structure, 2 for an array
+    NodeStream(int structure_depth, const NodeCallback& on_node, bool skip_metadata)
+        : structure_depth_(structure_depth), on_node_(on_node), skip_metadata_(skip_metadata) {}
+
+    /**
+     * Feed the next chunk of the reply
+     * @return false to abort the transfer: on_node asked to stop, or a piece
+     *         of the reply did not parse
+     */
+    bool write(const char* data, size_t size);
+
+    bool aborted() const { return stopped_ || !error_.empty(); }
+    const std::string& error() const { return error_; }
+
+    // Structures seen so far, including one cut short by a stop
+    std::vector<json> take() {
+        if (depth_ >= structure_depth_ && structure_.is_object()) {
+            structures_.push_back(std::move(structure_));
+        }
+        return std::move(structures_);
+    }
+
+private:
+    enum class Capture { None, Key, Value, Node };
+
+    bool finishValue();
+    bool finishNode();
+    bool deliver(json& node);
+    bool deliverPending();
+    bool fail(const std::exception& e) {
+        error_ = e.what();
+        return false;
+    }
+
+    const int structure_depth_;
+    const NodeCallback& on_node_;
+    const bool skip_metadata_;
+
+    int depth_ = 0;
+    bool in_string_ = false;
+    bool escaped_ = false;
+    bool scalar_ = false;       // capturing a number or literal, which ends at a delimiter
+    bool expect_key_ = false;
+    bool in_nodes_ = false;     // directly inside the current structure's nodes array
+    Capture capture_ = Capture::None;
+    std::string buffer_;        // the key, field or node being captured
+    std::string key_;
+    std::string name_;
+    bool named_ = false;        // the current structure's name has been read
+    std::vector<json> pending_; // its nodes read before the name
+    json structure_;
+    std::vector<json> structures_;
+    bool stopped_ = false;
+    std::string error_;
+};
+
+bool NodeStream::write(const char* data, size_t size) {
+    for (const char* end = data + size; data != end; ++data) {
+        const char c = *data;
+        if (in_string_) {
+            if (capture_ != Capture::None) {
+                buffer_.push_back(c);
+            }
+            if (escaped_) {
+                escaped_ = false;
+            } else if (c == '\\') {
+                escaped_ = true;
+            } else if (c == '"') {
+                in_string_ = false;
+                if (capture_ == Capture::Key) {
+                    capture_ = Capture::None;
+                    try {
+                        key_ = json::parse(buffer_).get<std::string>();
+                    } catch (const std::exception& e) {
+                        return fail(e);
+                    }
+                } else if (capture_ == Capture::Value && depth_ == structure_depth_ && !finishValue()) {
+                    return false;
+                }
+            }
+            continue;
+        }
+        if (scalar_) {
+            if (c != ',' && c != '}' && c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+                buffer_.push_back(c);
+                continue;
+            }
+            // The delimiter is handled below like any other
+            scalar_ = false;
+            if (!finishValue()) {
+                return false;
+            }
+        }
+
+        const bool at_fields = depth_ == structure_depth_ && capture_ == Capture::None;
+        switch (c) {
+            case '"':
+                in_string_ = true;
+                if (at_fields) {
+                    capture_ = expect_key_ ? Capture::Key : Capture::Value;
+                    buffer_.clear();
+                }
+                if (capture_ != Capture::None) {
+                    buffer_.push_back(c);
+                }
+                break;
+            case '{':
+            case '[':
+                if (depth_ == structure_depth_ - 1 && c == '{') {
+                    structure_ = json::object();
+                    name_.clear();
+                    named_ = false;
+                    pending_.clear();
+                    expect_key_ = true;
+                } else if (at_fields) {
+                    if (c == '[' && key_ == "nodes") {
+                        in_nodes_ = true;
+                    } else {
+                        capture_ = Capture::Value;
+                        buffer_.clear();
+                    }
+                } else if (in_nodes_ && depth_ == structure_depth_ + 1 && capture_ == Capture::None && c == '{') {
+                    capture_ = Capture::Node;
+                    buffer_.clear();
+                }
+                if (capture_ != Capture::None) {
+                    buffer_.push_back(c);
+                }
+                ++depth_;
+                break;
+            case '}':
+            case ']':
+                --depth_;
+                if (capture_ != Capture::None) {
+                    buffer_.push_back(c);
+                }
+                if (capture_ == Capture::Node && depth_ == structure_depth_ + 1) {
+                    if (!finishNode()) {
+                        return false;
+                    }
+                } else if (capture_ == Capture::Value && depth_ == structure_depth_) {
+                    if (!finishValue()) {
+                        return false;
+                    }
+                } else if (in_nodes_ && depth_ == structure_depth_) {
+                    in_nodes_ = false;
+                } else if (depth_ == structure_depth_ - 1 && c == '}') {
+                    structures_.push_back(std::move(structure_));
+                    structure_ = json();
+                    // A structure with no name still hands over its nodes
+                    if (!deliverPending()) {
+                        return false;
+                    }
+                }
+                break;
+            case ':':
+            case ',':
+                if (at_fields) {
+                    expect_key_ = c == ',';
+                } else if (capture_ != Capture::None) {
+                    buffer_.push_back(c);
+                }
+                break;
+            case ' ':
+            case '\n':
+            case '\r':
+            case '\t':
+                break;
+            default:
+                if (capture_ != Capture::None) {
+                    buffer_.push_back(c);
+                } else if (depth_ == structure_depth_ && !expect_key_) {
+                    capture_ = Capture::Value;
+                    scalar_ = true;
+                    buffer_.assign(1, c);
+                }
+                break;
+        }
+    }
+    return true;
+}
+
+bool NodeStream::finishValue() {
+    capture_ = Capture::None;
+    try {
+        json& field = structure_[key_] = json::parse(buffer_);
+        if (key_ == "name" && field.is_string()) {
+            name_ = field.get<std::string>();
+            named_ = true;
+        }
+    } catch (const std::exception& e) {
+        return fail(e);
+    }
+    return named_ ? deliverPending() : true;
+}
+
+bool NodeStream::deliver(json& node) {
+    if (!on_node_(name_, node)) {
+        stopped_ = true;
+        return false;
+    }
+    return true;
+}
+
+bool NodeStream::deliverPending() {
+    for (json& node : pending_) {
+        if (!deliver(node)) {
+            break;
+        }
+    }
+    pending_.clear();
+    return !stopped_;
+}
+
+bool NodeStream::finishNode() {
+    capture_ = Capture::None;
+    json node;
+    try {
+        if (skip_metadata_) {
+            // Dropping the key drops its value unparsed into the DOM
+            node = json::parse(buffer_, [](int depth, json::parse_event_t event, json& parsed) {
+                return depth != 1 || event != json::parse_event_t::key || parsed != "metadata";
+            });
+        } else {
+            node = json::parse(buffer_);
+        }
+    } catch (const std::exception& e) {
+        return fail(e);
+    }
+    if (!named_) {
+        pending_.push_back(std::move(node));
+        return true;
+    }
+    return deliver(node);
+}
+
+} // namespace detail
+
+namespace {
+
+// Where a streamed reply goes: a 2xx body to the stream, anything else to
+// the reply buffer for the error message
+struct StreamTarget {
+    detail::NodeStream* stream;
+    CURL* curl;
+    std::string* reply;
+    size_t received;
+};
+
+size_t streamCallback(char* data, size_t size, size_t nmemb, void* userdata) {
+    auto* target = static_cast<StreamTarget*>(userdata);
+    size_t total = size * nmemb;
+    target->received += total;
+    long status = 0;
+    curl_easy_getinfo(target->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status < 200 || status >= 300) {
+        target->reply->append(data, total);
+        return total;
+    }
+    return target->stream->write(data, total) ? total : 0;
+}
+
+// Picks the ETag out of the response headers, for conditional fetches
+size_t etagCallback(char* data, size_t size, size_t nmemb, void* userdata) {
+    size_t total = size * nmemb;
+    static const char name[] = "etag:";
+    const size_t name_length = sizeof(name) - 1;
+    if (total > name_length && std::equal(name, name + name_length, data, [](char a, char b) {
+            return a == std::tolower(static_cast<unsigned char>(b));
+        })) {
+        std::string_view value(data + name_length, total - name_length);
+        while (!value.empty() && std::isspace(static_cast<unsigned char>(value.front()))) value.remove_prefix(1);
+        while (!value.empty() && std::isspace(static_cast<unsigned char>(value.back()))) value.remove_suffix(1);
+        static_cast<std::string*>(userdata)->assign(value);
+    }
+    return total;
+}
+
+} // namespace
+
 VisualizerClient::VisualizerClient(const std::string& base_url) 
-    : base_url_(base_url), curl_(nullptr), verbose_(false) {
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl_ = curl_easy_init();
+    : base_url_(base_url), http2_prior_knowledge_(false), verbose_(false),
+      wire_format_(WireFormat::Json), minimal_responses_(true), structure_cache_enabled_(false),
+      mirror_running_(false), mirror_connected_(false),
+      compression_enabled_(false), compression_(Compression::Gzip), compression_level_(0),
+      compression_min_bytes_(0), compression_threshold_(0), open_batches_(0),
+      id_block_size_(1024), sender_running_(false), sender_sleeping_(false),
+      enqueued_ops_(0), sent_ops_(0), dropped_ops_(0),
+      coalescing_(false), coalesce_pending_(0), coalesced_ops_(0),
+      breaker_stopping_(false), breaker_enabled_(true), breaker_open_(false), consecutive_failures_(0),
+      short_circuited_(0), stats_dump_running_(false) {
+    std::call_once(curl_init_flag, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+    for (WireFormat format : {WireFormat::Json, WireFormat::MessagePack, WireFormat::Cbor}) {
+        struct curl_slist** lists = request_headers_[static_cast<int>(format)];
+        lists[0] = formatHeaders(format);
+        lists[1] = curl_slist_append(formatHeaders(format), kGzipEncoding);
+        lists[2] = curl_slist_append(formatHeaders(format), kZstdEncoding);
+    }
+
+    if (base_url_.compare(0, sizeof(kH2cScheme) - 1, kH2cScheme) == 0) {
+        base_url_ = "http://" + base_url_.substr(sizeof(kH2cScheme) - 1);
+        http2_prior_knowledge_ = true;
+    } else if (base_url_.compare(0, sizeof(kUnixScheme) - 1, kUnixScheme) == 0) {
+        // The socket path replaces host and port; curl still needs an HTTP
+        // URL for the request line and Host header
+        unix_socket_path_ = base_url_.substr(sizeof(kUnixScheme) - 1);
+        base_url_ = "http://localhost";
+    }
+}
+
+VisualizerClient::~VisualizerClient() {
+    {
+        std::lock_guard<std::mutex> lock(breaker_mutex_);
+        breaker_stopping_ = true;
+    }
+    breaker_wakeup_.notify_all();
+    if (breaker_prober_.joinable()) {
+        breaker_prober_.join();
+    }
+    disableStatsDump();
+    disableMirror();
+    disableCoalescing();
+    stopRecording();
+    disableSharedMemory();
+    disableAsync();
+    for (CURL* handle : idle_handles_) {
+        curl_easy_cleanup(handle);
+    }
+    for (auto& lists : request_headers_) {
+        for (struct curl_slist* headers : lists) {
+            curl_slist_free_all(headers);
+        }
+    }
+}
+
+StructureHandle VisualizerClient::createStructure(const std::string& name, 
+                                      const std::string& type,
+                                      int depth, 
+                                      int initial_size) {
+    json data = {
+        {"name", name},
+        {"type", type},
+        {"depth", depth},
+        {"initialSize", initial_size}
+    };
+    
+    // Queued and held ops belong to the structure being replaced, so they
+    // must reach the server before it does
+    flush();
+
+    // A recreated structure starts its IDs over
+    forgetStructure(name);
+    {
+        std::lock_guard<std::mutex> lock(id_mutex_);
+        id_ranges_.erase(name);
+        if (recorder_) {
+            // Same numbering the server would use: pre-filled nodes first
+            id_ranges_[name] = {std::max(initial_size, 0), std::numeric_limits<int>::max()};
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(structure_ids_mutex_);
+        structure_ids_.erase(name);
+    }
+    if (recorder_) {
+        recorder_->create(name, type, depth, initial_size);
+        return {-1, name};
+    }
+    HttpResponse response = makeRequest("POST", "/api/live/structure", data);
+    if (!response.ok()) {
+        logFailure("createStructure " + name, response);
+        return {};
+    }
+
+    StructureHandle handle{-1, name};
+    try {
+        handle.id = parseBody(response.body).at("id").get<int>();
+        std::lock_guard<std::mutex> lock(structure_ids_mutex_);
+        structure_ids_[name] = handle.id;
+        structure_names_[handle.id] = name;
+    } catch (const std::exception& e) {
+        // Still usable by name
+        logError("Failed to parse createStructure response: " + std::string(e.what()));
+    }
+    return handle;
+}
+
+int VisualizerClient::structureId(const std::string& structure_name) {
+    std::lock_guard<std::mutex> lock(structure_ids_mutex_);
+    auto found = structure_ids_.find(structure_name);
+    return found == structure_ids_.end() ? -1 : found->second;
+}
+
+// Another client recreating a structure gives it a new ID, so a cached or
+// handed out one can go stale. For an endpoint under such an ID, forget it
+// and give the same route addressed by name.
+bool VisualizerClient::routeByName(const std::string& endpoint, std::string& route) {
+    static const char prefix[] = "/api/live/structures/";
+    const size_t prefix_length = sizeof(prefix) - 1;
+    if (endpoint.compare(0, prefix_length, prefix) != 0) {
+        return false;
+    }
+    int structure_id = -1;
+    auto parsed = std::from_chars(endpoint.data() + prefix_length, endpoint.data() + endpoint.size(), structure_id);
+    if (parsed.ec != std::errc()) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(structure_ids_mutex_);
+    auto named = structure_names_.find(structure_id);
+    if (named == structure_names_.end()) {
+        return false;
+    }
+    auto cached = structure_ids_.find(named->second);
+    if (cached != structure_ids_.end() && cached->second == structure_id) {
+        structure_ids_.erase(cached);
+    }
+    route.clear();
+    appendStructurePath(route, -1, named->second);
+    route.append(parsed.ptr, endpoint.data() + endpoint.size());
+    return true;
+}
+
+std::string VisualizerClient::structurePath(const std::string& structure_name) {
+    return structurePath(structureId(structure_name), structure_name);
+}
+
+std::string VisualizerClient::structurePath(int structure_id, const std::string& structure_name) {
+    std::string path;
+    appendStructurePath(path, structure_id, structure_name);
+    return path;
+}
+
+int VisualizerClient::addNode(const std::string& structure_name, 
+                             const json& value, 
+                             int index,
+                             const std::map<std::string, json>& metadata) {
+    return addNode(structureId(structure_name), structure_name, value, index, metadata);
+}
+
+int VisualizerClient::addNode(const StructureHandle& structure, const json& value, int index,
+                              const std::map<std::string, json>& metadata) {
+    return addNode(structure.id, structure.name, value, index, metadata);
+}
+
+int VisualizerClient::addNode(int structure_id, const std::string& structure_name, const json& value, int index,
+                              const std::map<std::string, json>& metadata) {
+    int node_id = allocateNodeId(structure_name);
+    if (node_id < 0) {
+        return -1;
+    }
+    if (coalesce_pending_.load() != 0) {
+        flushCoalesced(&structure_name, true);
+    }
+    const bool mirrored = mirrorWrite(BatchOp::Kind::Add, structure_name, node_id, index, value, metadata);
+
+    // Checked before the op is built, which copies the value and metadata
+    if (open_batches_.load() != 0 &&
+        queueBatchOp({BatchOp::Kind::Add, structure_name, node_id, index, value, metadata, mirrored})) {
+        return node_id;
+    }
+    if (recorder_) {
+        recorder_->add(structure_name, node_id, index, value, metadata);
+        return node_id;
+    }
+    if (shm_ring_) {
+        return shmWrite(BatchOp::Kind::Add, structure_name, node_id, index, value, metadata) ? node_id : -1;
+    }
+    if (async_queue_) {
+        return enqueue({BatchOp::Kind::Add, structure_name, node_id, index, value, metadata, mirrored}) ? node_id : -1;
+    }
+
+    if (shortCircuit()) {
+        if (mirrored) {
+            mirrorAck(structure_name, 1, -1);
+        }
+        return -1;
+    }
+    // Reused per thread, so a warm buffer does not allocate
+    thread_local std::string body = reservedString(256);
+    const WireFormat format = wire_format_.load();
+    writeNodeBody(body, format, node_id, index, value, metadata);
+
+    // The server keeps the ID we reserved, so there is nothing to read back
+    const std::string& endpoint = nodeRoute(structure_id, structure_name, -1, mutationQuery());
+    return sendMutation("POST", endpoint, body, format, "addNode", structure_name, mirrored) ? node_id : -1;
+}
+
+int VisualizerClient::allocateNodeId(const std::string& structure_name) {
+    // Held across the reservation request so two threads that exhaust the
+    // same range do not both reserve a new block
+    std::lock_guard<std::mutex> lock(id_mutex_);
+    IdRange& range = id_ranges_[structure_name];
+    if (range.next < range.end) {
+        return range.next++;
+    }
+    if (recorder_) {
+        // Offline: nobody else hands out IDs for this structure
+        range.end = std::numeric_limits<int>::max();
+        return range.next++;
+    }
+    if (shortCircuit()) {
+        return -1;
+    }
+
+    std::string endpoint = structurePath(structure_name) + "/ids";
+    HttpResponse response = makeRequest("POST", endpoint, json{{"count", id_block_size_.load()}});
+    if (!response.ok()) {
+        logFailure("Reserving node IDs for " + structure_name, response);
+        return -1;
+    }
+
+    try {
+        json result = parseBody(response.body);
+        range.next = result.at("start");
+        range.end = range.next + result.at("count").get<int>();
+        return range.next++;
+    } catch (const std::exception& e) {
+        logError("Failed to parse ID reservation response: " + std::string(e.what()));
+    }
+
+    return -1;
+}
+
+// Called when the server refused adds naming IDs from our range. A 400 or
+// 409 means it no longer honours the range (it restarted, or the structure
+// was recreated elsewhere), so reserve a fresh one for the next add.
+void VisualizerClient::refusedNodeIds(const std::string& structure_name, long status) {
+    if (status != 400 && status != 409) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(id_mutex_);
+    id_ranges_.erase(structure_name);
+}
+
+bool VisualizerClient::addsWithIds(const BatchOp* ops, size_t count) {
+    return std::any_of(ops, ops + count, [](const BatchOp& op) {
+        return op.kind == BatchOp::Kind::Add && op.node_id >= 0;
+    });
+}
+
+bool VisualizerClient::removeNode(const std::string& structure_name, int node_id) {
+    return removeNode(structureId(structure_name), structure_name, node_id);
+}
+
+bool VisualizerClient::removeNode(const StructureHandle& structure, int node_id) {
+    return removeNode(structure.id, structure.name, node_id);
+}
+
+bool VisualizerClient::removeNode(int structure_id, const std::string& structure_name, int node_id) {
+    if (coalesce_pending_.load() != 0) {
+        flushCoalesced(&structure_name, true);
+    }
+    const bool mirrored = mirrorWrite(BatchOp::Kind::Remove, structure_name, node_id, -1, json{}, {});
+    if (open_batches_.load() != 0 &&
+        queueBatchOp({BatchOp::Kind::Remove, structure_name, node_id, -1, json{}, {}, mirrored})) {
+        return true;
+    }
+    if (recorder_) {
+        recorder_->remove(structure_name, node_id);
+        return true;
+    }
+    if (shm_ring_) {
+        return shmWrite(BatchOp::Kind::Remove, structure_name, node_id, -1, json{}, {});
+    }
+    if (async_queue_) {
+        return enqueue({BatchOp::Kind::Remove, structure_name, node_id, -1, json{}, {}, mirrored});
+    }
+
+    if (shortCircuit()) {
+        if (mirrored) {
+            mirrorAck(structure_name, 1, -1);
+        }
+        return false;
+    }
+    static const std::string no_body;
+    const std::string& endpoint = nodeRoute(structure_id, structure_name, node_id, mutationQuery());
+    return sendMutation("DELETE", endpoint, no_body, wire_format_.load(), "removeNode", structure_name, mirrored);
+}
+
+int VisualizerClient::applyDropMask(const std::string& structure_name, const uint8_t* bits, size_t bit_count,
+                                    int first_id) {
+    return applyDropMask(structureId(structure_name), structure_name, bits, bit_count, first_id);
+}
+
+int VisualizerClient::applyDropMask(const StructureHandle& structure, const uint8_t* bits, size_t bit_count,
+                                    int first_id) {
+    return applyDropMask(structure.id, structure.name, bits, bit_count, first_id);
+}
+
+int VisualizerClient::applyDropMask(int structure_id, const std::string& structure_name, const uint8_t* bits,
+                                    size_t bit_count, int first_id) {
+    if (coalesce_pending_.load() != 0) {
+        flushCoalesced(&structure_name, true);
+    }
+
+    if (inBatch() || recorder_ || shm_ring_ || async_queue_) {
+        // Buffered modes have no mask op; each set bit goes as a drop op,
+        // built first and queued as one unit so a full queue never takes a prefix
+        std::vector<BatchOp> ops;
+        for (size_t i = 0; i < bit_count; ++i) {
+            if ((bits[i / 8] & (1u << (i % 8))) != 0) {
+                const int node_id = first_id + static_cast<int>(i);
+                const bool mirrored = mirrorWrite(BatchOp::Kind::Drop, structure_name, node_id, -1, json{}, {});
+                ops.push_back({BatchOp::Kind::Drop, structure_name, node_id, -1, json{}, {}, mirrored});
+            }
+        }
+        const int dropped = static_cast<int>(ops.size());
+        return queueAll(ops) ? dropped : -1;
+    }
+
+    std::string body(reinterpret_cast<const char*>(bits), (bit_count + 7) / 8);
+    if (bit_count % 8 != 0) {
+        // Bits past the end of the mask must not select anything
+        body.back() = static_cast<char>(static_cast<uint8_t>(body.back()) & ((1u << (bit_count % 8)) - 1));
+    }
+
+    std::string endpoint = structurePath(structure_id, structure_name) + "/drop?first=" + std::to_string(first_id);
+    HttpResponse response = performRequest("POST", endpoint, body, wire_format_.load(),
+                                           "Content-Type: application/octet-stream");
+    if (!response.ok()) {
+        logFailure("applyDropMask on " + structure_name, response);
+        return -1;
+    }
+    try {
+        return parseBody(response.body).value("count", 0);
+    } catch (const std::exception& e) {
+        logError("Failed to parse drop response: " + std::string(e.what()));
+        return -1;
+    }
+}
+
+int VisualizerClient::applyDropMask(const std::string& structure_name, const std::vector<bool>& mask, int first_id) {
+    std::vector<uint8_t> bits = detail::packMask(mask);
+    return applyDropMask(structure_name, bits.data(), mask.size(), first_id);
+}
+
+int VisualizerClient::applyDropMask(const StructureHandle& structure, const std::vector<bool>& mask, int first_id) {
+    std::vector<uint8_t> bits = detail::packMask(mask);
+    return applyDropMask(structure, bits.data(), mask.size(), first_id);
+}
+
+bool VisualizerClient::markStage(const std::string& structure_name, const std::string& stage) {
+    return markStage(structureId(structure_name), structure_name, stage);
+}
+
+bool VisualizerClient::markStage(const StructureHandle& structure, const std::string& stage) {
+    return markStage(structure.id, structure.name, stage);
+}
+
+bool VisualizerClient::markStage(int structure_id, const std::string& structure_name, const std::string& stage) {
+    if (inBatch()) {
+        logError("markStage is not available inside a batch; commit it first");
+        return false;
+    }
+    flush();
+    if (recorder_) {
+        recorder_->stage(structure_name, stage);
+        return true;
+    }
+
+    std::string endpoint = structurePath(structure_id, structure_name) + "/stage";
+    HttpResponse response = makeRequest("POST", endpoint, {{"stage", stage}});
+    if (!response.ok()) {
+        logFailure("markStage " + stage + " on " + structure_name, response);
+        return false;
+    }
+    return true;
+}
+
+std::vector<int> VisualizerClient::getStageNodes(const std::string& structure_name, const std::string& stage) {
+    return getStageNodes(structureId(structure_name), structure_name, stage);
+}
+
+std::vector<int> VisualizerClient::getStageNodes(const StructureHandle& structure, const std::string& stage) {
+    return getStageNodes(structure.id, structure.name, stage);
+}
+
+std::vector<int> VisualizerClient::getStageNodes(int structure_id, const std::string& structure_name,
+                                                 const std::string& stage) {
+    if (recorder_) {
+        logError("getStageNodes is not available while recording");
+        return {};
+    }
+    std::string endpoint = structurePath(structure_id, structure_name) + "/stage/";
+    appendPathSegment(endpoint, stage);
+    HttpResponse response = makeRequest("GET", endpoint);
+    if (!response.ok()) {
+        logFailure("getStageNodes " + stage + " on " + structure_name, response);
+        return {};
+    }
+
+    try {
+        return parseBody(response.body).at("ids").get<std::vector<int>>();
+    } catch (const std::exception& e) {
+        logError("Failed to parse stage response: " + std::string(e.what()));
+        return {};
+    }
+}
+
+StageDiff VisualizerClient::diffStages(const std::string& structure_name, const std::string& from,
+                                       const std::string& to) {
+    return diffStages(structureId(structure_name), structure_name, from, to);
+}
+
+StageDiff VisualizerClient::diffStages(const StructureHandle& structure, const std::string& from,
+                                       const std::string& to) {
+    return diffStages(structure.id, structure.name, from, to);
+}
+
+StageDiff VisualizerClient::diffStages(int structure_id, const std::string& structure_name, const std::string& from,
+                                       const std::string& to) {
+    if (recorder_) {
+        logError("diffStages is not available while recording");
+        return {};
+    }
+    std::string endpoint = structurePath(structure_id, structure_name) + "/stage/";
+    appendPathSegment(endpoint, from);
+    endpoint += "/diff/";
+    appendPathSegment(endpoint, to);
+    HttpResponse response = makeRequest("GET", endpoint);
+    if (!response.ok()) {
+        logFailure("diffStages " + from + ".." + to + " on " + structure_name, response);
+        return {};
+    }
+
+    try {
+        json body = parseBody(response.body);
+        return {body.at("dropped").get<std::vector<int>>(), body.at("added").get<std::vector<int>>()};
+    } catch (const std::exception& e) {
+        logError("Failed to parse stage diff response: " + std::string(e.what()));
+        return {};
+    }
+}
+
+bool VisualizerClient::updateNode(const std::string& structure_name, 
+                                 int node_id, 
+                                 const json& value,
+                                 const std::map<std::string, json>& metadata) {
+    return updateNode(structureId(structure_name), structure_name, node_id, value, metadata);
+}
+
+bool VisualizerClient::updateNode(const StructureHandle& structure, int node_id, const json& value,
+                                  const std::map<std::string, json>& metadata) {
+    return updateNode(structure.id, structure.name, node_id, value, metadata);
+}
+
+bool VisualizerClient::updateNode(int structure_id, const std::string& structure_name, int node_id, const json& value,
+                                  const std::map<std::string, json>& metadata) {
+    const bool mirrored = mirrorWrite(BatchOp::Kind::Update, structure_name, node_id, -1, value, metadata);
+    if (open_batches_.load() != 0 &&
+        queueBatchOp({BatchOp::Kind::Update, structure_name, node_id, -1, value, metadata, mirrored})) {
+        return true;
+    }
+    if (coalescing_.load(std::memory_order_relaxed)) {
+        coalesceUpdate({BatchOp::Kind::Update, structure_name, node_id, -1, value, metadata, mirrored});
+        return true;
+    }
+    if (recorder_) {
+        recorder_->update(structure_name, node_id, value, metadata);
+        return true;
+    }
+    if (shm_ring_) {
+        return shmWrite(BatchOp::Kind::Update, structure_name, node_id, -1, value, metadata);
+    }
+    if (async_queue_) {
+        return enqueue({BatchOp::Kind::Update, structure_name, node_id, -1, value, metadata, mirrored});
+    }
+
+    if (shortCircuit()) {
+        if (mirrored) {
+            mirrorAck(structure_name, 1, -1);
+        }
+        return false;
+    }
+    thread_local std::string body = reservedString(256);
+    const WireFormat format = wire_format_.load();
+    writeNodeBody(body, format, -1, -1, value, metadata);
+
+    const std::string& endpoint = nodeRoute(structure_id, structure_name, node_id, mutationQuery());
+    return sendMutation("PUT", endpoint, body, format, "updateNode", structure_name, mirrored);
+}
+
+json VisualizerClient::getStructure(const std::string& structure_name) {
+    // Copied outside the cache lock
+    std::shared_ptr<const json> structure = getStructureSnapshot(structure_name);
+    return structure ? *structure : json{};
+}
+
+json VisualizerClient::getStructure(const StructureHandle& structure) {
+    std::shared_ptr<const json> snapshot = getStructureSnapshot(structure);
+    return snapshot ? *snapshot : json{};
+}
+
+std::shared_ptr<const json> VisualizerClient::getStructureSnapshot(const std::string& structure_name) {
+    return getStructureSnapshot(structureId(structure_name), structure_name);
+}
+
+std::shared_ptr<const json> VisualizerClient::getStructureSnapshot(const StructureHandle& structure) {
+    return getStructureSnapshot(structure.id, structure.name);
+}
+
+std::shared_ptr<const json> VisualizerClient::getStructureSnapshot(int structure_id,
+                                                                   const std::string& structure_name) {
+    if (recorder_) {
+        logError("getStructure is not available while recording");
+        return nullptr;
+    }
+    if (mirror_connected_.load()) {
+        // The mirror already shows this client's writes, so no flush
+        std::lock_guard<std::mutex> lock(structure_cache_mutex_);
+        auto cached = structure_cache_.find(structure_name);
+        if (cached != structure_cache_.end() && !cached->second.stale) {
+            return cached->second.structure;
+        }
+    }
+    flush();
+    if (structure_cache_enabled_.load()) {
+        return getCachedStructure(structure_id, structure_name);
+    }
+    std::string endpoint = structurePath(structure_id, structure_name);
+    HttpResponse response = makeRequest("GET", endpoint);
+    if (!response.ok()) {
+        logFailure("getStructure " + structure_name, response);
+        return nullptr;
+    }
+    
+    try {
+        return std::make_shared<const json>(parseBody(response.body));
+    } catch (const std::exception& e) {
+        logError("Failed to parse getStructure response: " + std::string(e.what()));
+        return nullptr;
+    }
+}
+
+std::shared_ptr<const json> VisualizerClient::getCachedStructure(int structure_id,
+                                                                 const std::string& structure_name) {
+    // Ask for the changes since the cached version; If-None-Match turns an
+    // unchanged structure into a bodiless 304
+    std::string endpoint = structurePath(structure_id, structure_name);
+    std::string condition;
+    {
+        std::lock_guard<std::mutex> lock(structure_cache_mutex_);
+        auto cached = structure_cache_.find(structure_name);
+        if (cached != structure_cache_.end()) {
+            endpoint += "?since=" + std::to_string(cached->second.version);
+            if (!cached->second.etag.empty()) {
+                condition = "If-None-Match: " + cached->second.etag;
+            }
+        }
+    }
+
+    static const std::string no_body;
+    const WireFormat format = wire_format_.load();
+    std::string reply;
+    std::string etag;
+    long status = sendRequest("GET", endpoint, no_body, format, nullptr, reply, nullptr,
+                              condition.empty() ? nullptr : condition.c_str(), &etag);
+
+    std::unique_lock<std::mutex> lock(structure_cache_mutex_);
+    auto cached = structure_cache_.find(structure_name);
+    if (status == 304 && cached != structure_cache_.end()) {
+        return cached->second.structure;
+    }
+    if (status < 200 || status >= 300) {
+        if (status == 404 && cached != structure_cache_.end()) {
+            structure_cache_.erase(cached);
+        }
+        logFailure("getStructure " + structure_name, HttpResponse{status, reply});
+        return nullptr;
+    }
+
+    json structure;
+    try {
+        structure = parseBody(reply);
+    } catch (const std::exception& e) {
+        logError("Failed to parse getStructure response: " + std::string(e.what()));
+        return nullptr;
+    }
+
+    if (structure.value("delta", false) &&
+        (cached == structure_cache_.end() || cached->second.id != structure.value("id", -1LL))) {
+        // The copy the delta was asked against is gone; fetch it whole
+        if (cached != structure_cache_.end()) {
+            structure_cache_.erase(cached);
+        }
+        lock.unlock();
+        return getCachedStructure(structure_id, structure_name);
+    }
+    CachedStructure& entry = structure_cache_[structure_name];
+    mergeStructure(entry, std::move(structure), std::move(etag));
+    return entry.structure;
+}
+
+namespace {
+
+// Point each node (each active one for a removal) at the one after it, as
+// the server's relink does; calls touched with the row of each node whose
+// next changed
+template <typename Touched>
+void relinkMirrored(json& nodes, bool active_only, Touched touched) {
+    size_t previous = nodes.size();
+    auto link = [&](size_t row, const json& next) {
+        if (nodes[row]["next"] != next) {
+            nodes[row]["next"] = next;
+            touched(row);
+        }
+    };
+    for (size_t row = 0; row < nodes.size(); ++row) {
+        if (active_only && !nodes[row].value("active", false)) {
+            continue;
+        }
+        if (previous < nodes.size()) {
+            link(previous, nodes[row]["id"]);
+        }
+        previous = row;
+    }
+    if (previous < nodes.size()) {
+        link(previous, nullptr);
+    }
+}
+
+} // namespace
+
+void VisualizerClient::mergeStructure(CachedStructure& entry, json&& structure, std::string etag) {
+    // Nodes this client wrote keep the local copy until the server has
+    // confirmed the writes; the server's copy waits in shadow meanwhile
+    json& incoming = structure["nodes"];
+    if (!incoming.is_array()) {
+        incoming = json::array();
+    }
+
+    if (structure.value("delta", false)) {
+        json& cached = writableStructure(entry);
+        json& nodes = cached["nodes"];
+        for (json& node : incoming) {
+            const int node_id = node.value("id", -1);
+            if (entry.local.count(node_id) != 0) {
+                entry.shadow[node_id] = std::move(node);
+                continue;
+            }
+            // Changed nodes replace their cached copy, new ones are appended
+            // in the order the server sent them
+            auto row = entry.rows.find(node_id);
+            if (row != entry.rows.end()) {
+                nodes[row->second] = std::move(node);
+            } else {
+                entry.rows.emplace(node_id, nodes.size());
+                nodes.push_back(std::move(node));
+            }
+        }
+        // Every other field is current
+        for (auto field = structure.begin(); field != structure.end(); ++field) {
+            if (field.key() != "nodes" && field.key() != "delta" && field.key() != "since") {
+                cached[field.key()] = std::move(field.value());
+            }
+        }
+    } else {
+        if (entry.pending == 0) {
+            // Nothing in flight, so a whole structure is the last word
+            entry.local.clear();
+            entry.shadow.clear();
+        }
+        entry.rows.clear();
+        for (size_t row = 0; row < incoming.size(); ++row) {
+            const int node_id = incoming[row].value("id", -1);
+            entry.rows.emplace(node_id, row);
+            auto local = entry.local.find(node_id);
+            if (local != entry.local.end()) {
+                entry.shadow[node_id] = std::move(incoming[row]);
+                incoming[row] = local->second;
+            }
+        }
+        // Nodes added here that the server has not applied yet
+        for (const auto& local : entry.local) {
+            if (entry.rows.count(local.first) == 0) {
+                entry.rows.emplace(local.first, incoming.size());
+                incoming.push_back(local.second);
+            }
+        }
+        entry.structure = std::make_shared<json>(std::move(structure));
+        entry.id = entry.structure->value("id", -1LL);
+    }
+
+    entry.etag = std::move(etag);
+    entry.version = entry.structure->value("version", -1LL);
+    entry.stale = false;
+    settleMirrored(entry);
+}
+
+void VisualizerClient::settleMirrored(CachedStructure& entry) {
+    // Once every write is answered and the copy has caught up with the
+    // version the last one was applied at, the server's nodes are the
+    // authoritative ones
+    if (entry.pending != 0 || entry.version < entry.confirmed || entry.local.empty()) {
+        return;
+    }
+    json& nodes = writableStructure(entry)["nodes"];
+    for (auto& shadow : entry.shadow) {
+        auto row = entry.rows.find(shadow.first);
+        if (row != entry.rows.end()) {
+            nodes[row->second] = std::move(shadow.second);
+        }
+    }
+    entry.local.clear();
+    entry.shadow.clear();
+}
+
+json& VisualizerClient::writableStructure(CachedStructure& entry) {
+    // Caller holds structure_cache_mutex_, which every new reference is
+    // taken under, so a count of one cannot grow behind our back
+    if (!entry.structure) {
+        entry.structure = std::make_shared<json>(json::object());
+    } else if (entry.structure.use_count() > 1) {
+        entry.structure = std::make_shared<json>(*entry.structure);
+    }
+    return *entry.structure;
+}
+
+void VisualizerClient::forgetStructure(const std::string& structure_name) {
+    std::lock_guard<std::mutex> lock(structure_cache_mutex_);
+    structure_cache_.erase(structure_name);
+}
+
+void VisualizerClient::disableStructureCache() {
+    structure_cache_enabled_.store(false);
+    std::lock_guard<std::mutex> lock(structure_cache_mutex_);
+    structure_cache_.clear();
+}
+
+bool VisualizerClient::mirrorWrite(BatchOp::Kind kind, const std::string& structure_name, int node_id, int index,
+                                   const json& value, const std::map<std::string, json>& metadata) {
+    // Writes that skip HTTP are never answered, so they reach the mirror
+    // through the stream instead
+    if (!mirror_running_.load(std::memory_order_relaxed) || recorder_ || shm_ring_) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(structure_cache_mutex_);
+    auto cached = structure_cache_.find(structure_name);
+    if (cached == structure_cache_.end()) {
+        return false;
+    }
+    CachedStructure& entry = cached->second;
+    const json* current = entry.structure.get();
+    if (current == nullptr || !current->contains("nodes") || !(*current)["nodes"].is_array()) {
+        return false;
+    }
+    if (kind != BatchOp::Kind::Add && entry.rows.count(node_id) == 0) {
+        return false;
+    }
+    const bool linked = current->value("type", "") == "linked_list";
+    json& nodes = writableStructure(entry)["nodes"];
+    auto touched = [&](size_t row) { entry.local[nodes[row].value("id", -1)] = nodes[row]; };
+
+    switch (kind) {
+        case BatchOp::Kind::Add: {
+            json node = {{"id", node_id}, {"value", value}, {"active", true}, {"next", nullptr}, {"metadata", metadata}};
+            if (index >= 0 && static_cast<size_t>(index) <= nodes.size()) {
+                nodes.insert(nodes.begin() + index, std::move(node));
+                entry.rows.clear();
+                for (size_t row = 0; row < nodes.size(); ++row) {
+                    entry.rows.emplace(nodes[row].value("id", -1), row);
+                }
+                if (linked) {
+                    relinkMirrored(nodes, false, touched);
+                }
+                touched(index);
+            } else {
+                entry.rows[node_id] = nodes.size();
+                nodes.push_back(std::move(node));
+                if (linked && nodes.size() > 1) {
+                    nodes[nodes.size() - 2]["next"] = node_id;
+                    touched(nodes.size() - 2);
+                }
+                touched(nodes.size() - 1);
+            }
+            break;
+        }
+        case BatchOp::Kind::Remove:
+        case BatchOp::Kind::Drop: {
+            auto row = entry.rows.find(node_id);
+            if (row == entry.rows.end()) {
+                return false;
+            }
+            nodes[row->second]["active"] = false;
+            touched(row->second);
+            if (linked) {
+                relinkMirrored(nodes, true, touched);
+            }
+            break;
+        }
+        case BatchOp::Kind::Update: {
+            auto row = entry.rows.find(node_id);
+            if (row == entry.rows.end()) {
+                return false;
+            }
+            json& node = nodes[row->second];
+            node["value"] = value;
+            for (const auto& field : metadata) {
+                node["metadata"][field.first] = field.second;
+            }
+            touched(row->second);
+            break;
+        }
+    }
+    ++entry.pending;
+    return true;
+}
+
+void VisualizerClient::mirrorAck(const std::string& structure_name, int count, long long version) {
+    if (count == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(structure_cache_mutex_);
+    auto cached = structure_cache_.find(structure_name);
+    if (cached == structure_cache_.end()) {
+        return;
+    }
+    if (version < 0) {
+        // Refused or never sent: the copy is wrong somewhere, so drop it and
+        // let the next read fetch it whole
+        structure_cache_.erase(cached);
+        return;
+    }
+    CachedStructure& entry = cached->second;
+    entry.pending = std::max(0, entry.pending - count);
+    entry.confirmed = std::max(entry.confirmed, version);
+    // The stream may have got there first
+    settleMirrored(entry);
+}
+
+void VisualizerClient::enableMirror() {
+    if (mirror_running_.exchange(true)) {
+        return;
+    }
+    enableStructureCache();
+    markMirrorStale();
+    mirror_thread_ = std::thread(&VisualizerClient::mirrorLoop, this);
+}
+
+void VisualizerClient::disableMirror() {
+    {
+        std::lock_guard<std::mutex> lock(mirror_mutex_);
+        if (!mirror_running_.exchange(false)) {
+            return;
+        }
+    }
+    mirror_wakeup_.notify_all();
+    if (mirror_thread_.joinable()) {
+        mirror_thread_.join();
+    }
+    disableStructureCache();
+}
+
+void VisualizerClient::markMirrorStale() {
+    std::lock_guard<std::mutex> lock(structure_cache_mutex_);
+    for (auto& cached : structure_cache_) {
+        cached.second.stale = true;
+    }
+}
+
+void VisualizerClient::mirrorLoop() {
+    // Server-sent events: "field: value" lines, a blank line ends an event
+    // and lines starting with ':' are comments
+    struct EventReader {
+        VisualizerClient* client;
+        std::string line;
+        std::string event;
+        std::string data;
+    };
+    auto on_data = +[](char* data, size_t size, size_t nmemb, void* userdata) -> size_t {
+        auto* reader = static_cast<EventReader*>(userdata);
+        VisualizerClient* client = reader->client;
+        const size_t total = size * nmemb;
+        for (size_t i = 0; i < total; ++i) {
+            if (data[i] != '\n') {
+                reader->line.push_back(data[i]);
+                continue;
+            }
+            std::string line = std::move(reader->line);
+            reader->line.clear();
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.empty()) {
+                if (!reader->data.empty()) {
+                    client->applyMirrorEvent(reader->event, reader->data);
+                }
+                reader->event.clear();
+                reader->data.clear();
+            } else if (line[0] == ':') {
+                if (line == ": connected") {
+                    // Whatever changed before now came in while we were not
+                    // listening
+                    client->markMirrorStale();
+                    client->mirror_connected_.store(true);
+                }
+            } else {
+                size_t colon = line.find(':');
+                std::string field = line.substr(0, colon);
+                std::string value = colon == std::string::npos ? "" : line.substr(colon + 1);
+                if (!value.empty() && value[0] == ' ') {
+                    value.erase(0, 1);
+                }
+                if (field == "event") {
+                    reader->event = std::move(value);
+                } else if (field == "data") {
+                    if (!reader->data.empty()) {
+                        reader->data.push_back('\n');
+                    }
+                    reader->data += value;
+                }
+            }
+        }
+        return total;
+    };
+    // Polled about once a second, which is how a stop interrupts an idle stream
+    auto on_progress = +[](void* userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t) -> int {
+        return static_cast<VisualizerClient*>(userdata)->mirror_running_.load() ? 0 : 1;
+    };
+
+    CURL* curl = curl_easy_init();
+    if (!curl) {
+        logError("curl_easy_init failed, mirror stopped");
+        return;
+    }
+    configureHandle(curl);
+    std::string url = base_url_ + "/api/live/changes";
+    struct curl_slist* headers = curl_slist_append(nullptr, "Accept: text/event-stream");
+    EventReader reader{this, "", "", ""};
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 0L);   // the stream stays open
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_data);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &reader);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, on_progress);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+
+    while (mirror_running_.load()) {
+        CURLcode res = curl_easy_perform(curl);
+        mirror_connected_.store(false);
+        reader.line.clear();
+        reader.event.clear();
+        reader.data.clear();
+        if (!mirror_running_.load()) {
+            break;
+        }
+        logError("Change stream closed (" + std::string(curl_easy_strerror(res)) + "), reconnecting");
+
+        // Reads fall back to fetches until the stream is back
+        std::unique_lock<std::mutex> lock(mirror_mutex_);
+        mirror_wakeup_.wait_for(lock, std::chrono::seconds(1), [this] { return !mirror_running_.load(); });
+    }
+
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+}
+
+void VisualizerClient::applyMirrorEvent(const std::string& event, const std::string& data) {
+    json body;
+    try {
+        body = json::parse(data);
+    } catch (const std::exception& e) {
+        logError("Failed to parse change event: " + std::string(e.what()));
+        return;
+    }
+    const std::string name = body.value("name", "");
+
+    // Only structures this client has read are mirrored
+    std::lock_guard<std::mutex> lock(structure_cache_mutex_);
+    auto cached = structure_cache_.find(name);
+    if (cached == structure_cache_.end()) {
+        return;
+    }
+    CachedStructure& entry = cached->second;
+    if (event == "deleted") {
+        structure_cache_.erase(cached);
+    } else if (event == "snapshot") {
+        mergeStructure(entry, std::move(body), "");
+    } else if (event == "delta") {
+        if (body.value("id", -1LL) != entry.id || body.value("since", 0LL) > entry.version) {
+            // Recreated, or changes were missed: fetch before serving again
+            entry.stale = true;
+        } else if (body.value("version", 0LL) > entry.version) {
+            mergeStructure(entry, std::move(body), "");
+        }
+    }
+}
+
+std::vector<json> VisualizerClient::getAllStructures() {
+    if (recorder_) {
+        logError("getAllStructures is not available while recording");
+        return {};
+    }
+    HttpResponse response = makeRequest("GET", "/api/live/structures");
+    if (!response.ok()) {
+        logFailure("getAllStructures", response);
+        return {};
+    }
     
-    if (curl_) {
-        curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, WriteCallback);
-        curl_easy_setopt(curl_, CURLOPT_TIMEOUT, 10L);
-        curl_easy_setopt(curl_, CURLOPT_CONNECTTIMEOUT, 5L);
+    try {
+        json result = parseBody(response.body);
+        if (result.is_array()) {
+            return result;
+        }
+    } catch (const std::exception& e) {
+        logError("Failed to parse getAllStructures response: " + std::string(e.what()));
+    }
+    
+    return {};
+}
+
+json VisualizerClient::streamStructure(const std::string& structure_name, const NodeCallback& on_node,
+                                       const StreamOptions& options) {
+    return streamStructure(structureId(structure_name), structure_name, on_node, options);
+}
+
+json VisualizerClient::streamStructure(const StructureHandle& structure, const NodeCallback& on_node,
+                                       const StreamOptions& options) {
+    return streamStructure(structure.id, structure.name, on_node, options);
+}
+
+json VisualizerClient::streamStructure(int structure_id, const std::string& structure_name,
+                                       const NodeCallback& on_node, const StreamOptions& options) {
+    if (recorder_) {
+        logError("streamStructure is not available while recording");
+        return json{};
+    }
+    flush();
+    detail::NodeStream stream(1, on_node, options.skip_metadata);
+    if (!streamRequest(structurePath(structure_id, structure_name), stream, "streamStructure " + structure_name)) {
+        return json{};
+    }
+    std::vector<json> structures = stream.take();
+    return structures.empty() ? json{} : std::move(structures.front());
+}
+
+std::vector<json> VisualizerClient::streamAllStructures(const NodeCallback& on_node, const StreamOptions& options) {
+    if (recorder_) {
+        logError("streamAllStructures is not available while recording");
+        return {};
+    }
+    detail::NodeStream stream(2, on_node, options.skip_metadata);
+    if (!streamRequest("/api/live/structures", stream, "streamAllStructures")) {
+        return {};
+    }
+    return stream.take();
+}
+
+bool VisualizerClient::streamRequest(const std::string& endpoint, detail::NodeStream& stream, const std::string& what) {
+    // Always JSON, which can be cut into nodes as it arrives
+    static const std::string no_body;
+    std::string reply;
+    long status = sendRequest("GET", endpoint, no_body, WireFormat::Json, nullptr, reply, &stream);
+    if (status < 200 || status >= 300) {
+        logFailure(what, HttpResponse{status, reply});
+        return false;
+    }
+    if (!stream.error().empty()) {
+        logError("Failed to parse " + what + " response: " + stream.error());
+        return false;
+    }
+    return true;
+}
+
+json VisualizerClient::getMatrix() {
+    if (recorder_) {
+        logError("getMatrix is not available while recording");
+        return json{};
+    }
+    HttpResponse response = makeRequest("GET", "/api/live/matrix");
+    if (!response.ok()) {
+        logFailure("getMatrix", response);
+        return json{};
+    }
+    
+    try {
+        return parseBody(response.body);
+    } catch (const std::exception& e) {
+        logError("Failed to parse getMatrix response: " + std::string(e.what()));
+        return json{};
+    }
+}
+
+bool VisualizerClient::deleteStructure(const std::string& structure_name) {
+    return deleteStructure(structureId(structure_name), structure_name);
+}
+
+bool VisualizerClient::deleteStructure(const StructureHandle& structure) {
+    return deleteStructure(structure.id, structure.name);
+}
+
+bool VisualizerClient::deleteStructure(int structure_id, const std::string& structure_name) {
+    flush();
+    forgetStructure(structure_name);
+    {
+        std::lock_guard<std::mutex> lock(id_mutex_);
+        id_ranges_.erase(structure_name);
+    }
+    if (recorder_) {
+        recorder_->destroy(structure_name);
+        return true;
+    }
+    std::string endpoint = structurePath(structure_id, structure_name);
+    {
+        std::lock_guard<std::mutex> lock(structure_ids_mutex_);
+        structure_ids_.erase(structure_name);
+        structure_names_.erase(structure_id);
+    }
+    HttpResponse response = makeRequest("DELETE", endpoint);
+    if (!response.ok()) {
+        logFailure("deleteStructure " + structure_name, response);
+        return false;
+    }
+    return true;
+}
+
+void VisualizerClient::beginBatch() {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    if (batches_.emplace(std::this_thread::get_id(), std::vector<BatchOp>{}).second) {
+        open_batches_.fetch_add(1);
+    }
+}
+
+std::vector<int> VisualizerClient::commitBatch() {
+    std::vector<BatchOp> ops;
+    {
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        auto it = batches_.find(std::this_thread::get_id());
+        if (it == batches_.end()) {
+            return {};
+        }
+        ops.swap(it->second);
+        batches_.erase(it);
+        open_batches_.fetch_sub(1);
+    }
+
+    // Updates held before the batch was opened go first
+    flushCoalesced(nullptr, true);
+    return dispatchOps(ops, false);
+}
+
+void VisualizerClient::discardBatch() {
+    std::vector<BatchOp> ops;
+    {
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        auto it = batches_.find(std::this_thread::get_id());
+        if (it == batches_.end()) {
+            return;
+        }
+        ops = std::move(it->second);
+        batches_.erase(it);
+        open_batches_.fetch_sub(1);
+    }
+    // The mirror already shows these ops; it has to be fetched again
+    for (const BatchOp& op : ops) {
+        if (op.mirrored) {
+            mirrorAck(op.structure_name, 1, -1);
+        }
+    }
+}
+
+bool VisualizerClient::inBatch() {
+    if (open_batches_.load() == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    return batches_.count(std::this_thread::get_id()) > 0;
+}
+
+bool VisualizerClient::queueBatchOp(BatchOp&& op) {
+    // Fast path: no thread has a batch open
+    if (open_batches_.load() == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    auto it = batches_.find(std::this_thread::get_id());
+    if (it == batches_.end()) {
+        return false;
+    }
+    it->second.push_back(std::move(op));
+    return true;
+}
+
+bool VisualizerClient::queueAll(std::vector<BatchOp>& ops) {
+    if (open_batches_.load() != 0) {
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        auto it = batches_.find(std::this_thread::get_id());
+        if (it != batches_.end()) {
+            std::move(ops.begin(), ops.end(), std::back_inserter(it->second));
+            return true;
+        }
+    }
+    if (recorder_) {
+        dispatchOps(ops, false);
+        return true;
+    }
+    if (shm_ring_) {
+        bool written = shmWriteAll(ops);
+        for (const BatchOp& op : ops) {
+            if (op.mirrored) {
+                mirrorAck(op.structure_name, 1, written ? 0 : -1);
+            }
+        }
+        return written;
+    }
+    return enqueueAll(ops);
+}
+
+std::vector<int> VisualizerClient::dispatchOps(const std::vector<BatchOp>& ops, bool allow_async) {
+    if (recorder_) {
+        std::vector<int> ids;
+        ids.reserve(ops.size());
+        for (const BatchOp& op : ops) {
+            switch (op.kind) {
+                case BatchOp::Kind::Add:
+                    recorder_->add(op.structure_name, op.node_id, op.index, op.value, op.metadata);
+                    break;
+                case BatchOp::Kind::Remove:
+                    recorder_->remove(op.structure_name, op.node_id);
+                    break;
+                case BatchOp::Kind::Update:
+                    recorder_->update(op.structure_name, op.node_id, op.value, op.metadata);
+                    break;
+                case BatchOp::Kind::Drop:
+                    recorder_->drop(op.structure_name, op.node_id);
+                    break;
+            }
+            ids.push_back(op.node_id);
+        }
+        return ids;
+    }
+    if (shm_ring_) {
+        std::vector<int> ids;
+        ids.reserve(ops.size());
+        for (const BatchOp& op : ops) {
+            bool written = shmWrite(op.kind, op.structure_name, op.node_id, op.index, op.value, op.metadata);
+            ids.push_back(written ? op.node_id : -1);
+            if (op.mirrored) {
+                mirrorAck(op.structure_name, 1, written ? 0 : -1);
+            }
+        }
+        return ids;
+    }
+    if (allow_async && async_queue_) {
+        std::vector<int> ids;
+        ids.reserve(ops.size());
+        for (const BatchOp& op : ops) {
+            BatchOp copy = op;
+            ids.push_back(enqueue(std::move(copy)) ? op.node_id : -1);
+        }
+        return ids;
+    }
+    return sendOps(ops);
+}
+
+json VisualizerClient::batchPayload(const BatchOp* ops, size_t count) {
+    json payload = json::array();
+    for (size_t i = 0; i < count; ++i) {
+        const BatchOp& op = ops[i];
+        json entry;
+        switch (op.kind) {
+            case BatchOp::Kind::Add:
+                entry = {{"op", "add"}, {"value", op.value}, {"metadata", op.metadata}};
+                if (op.node_id >= 0) {
+                    entry["id"] = op.node_id;
+                }
+                if (op.index >= 0) {
+                    entry["index"] = op.index;
+                }
+                break;
+            case BatchOp::Kind::Remove:
+                entry = {{"op", "remove"}, {"id", op.node_id}};
+                break;
+            case BatchOp::Kind::Update:
+                entry = {{"op", "update"}, {"id", op.node_id}, {"value", op.value}, {"metadata", op.metadata}};
+                break;
+            case BatchOp::Kind::Drop:
+                entry = {{"op", "drop"}, {"id", op.node_id}};
+                break;
+        }
+        payload.push_back(std::move(entry));
+    }
+    return json{{"ops", std::move(payload)}};
+}
+
+std::vector<int> VisualizerClient::sendOps(const std::vector<BatchOp>& ops, bool atomic) {
+    std::vector<int> ids(ops.size(), -1);
+    size_t start = 0;
+    while (start < ops.size()) {
+        // Group the run of consecutive ops that target the same structure
+        const std::string& structure_name = ops[start].structure_name;
+        size_t end = start;
+        while (end < ops.size() && ops[end].structure_name == structure_name) {
+            ++end;
+        }
+
+        const int mirrored = static_cast<int>(std::count_if(ops.begin() + start, ops.begin() + end,
+                                                            [](const BatchOp& op) { return op.mirrored; }));
+        std::string endpoint = structurePath(structure_name) + "/batch";
+        HttpResponse response = makeRequest("POST", endpoint, batchPayload(&ops[start], end - start));
+        if (!atomic && end - start > 1 && response.status >= 400 && response.status < 500) {
+            // The server refuses a batch as a whole, so one stale op would
+            // take the unrelated ops merged in with it down too: send each alone
+            for (size_t i = start; i < end; ++i) {
+                ids[i] = sendOps(std::vector<BatchOp>(1, ops[i]))[0];
+            }
+            start = end;
+            continue;
+        }
+        if (!response.ok()) {
+            mirrorAck(structure_name, mirrored, -1);
+            if (addsWithIds(&ops[start], end - start)) {
+                refusedNodeIds(structure_name, response.status);
+            }
+            logFailure("Batch for " + structure_name, response);
+            start = end;
+            continue;
+        }
+
+        try {
+            json result = parseBody(response.body);
+            const json& batch_ids = result.at("ids");
+            for (size_t i = start; i < end && i - start < batch_ids.size(); ++i) {
+                ids[i] = batch_ids[i - start];
+            }
+            mirrorAck(structure_name, mirrored, result.value("version", 0LL));
+        } catch (const std::exception& e) {
+            mirrorAck(structure_name, mirrored, 0);
+            logError("Failed to parse batch response: " + std::string(e.what()));
+        }
+
+        start = end;
+    }
+
+    return ids;
+}
+
+void VisualizerClient::enableAsync(const AsyncOptions& options) {
+    if (async_queue_) {
+        return;
+    }
+
+    async_options_ = options;
+    if (async_options_.max_ops_per_request == 0) {
+        async_options_.max_ops_per_request = 1;
+    }
+    async_queue_.reset(new detail::BoundedQueue<BatchOp>(options.queue_capacity));
+    sender_running_.store(true);
+    sender_ = std::thread(&VisualizerClient::senderLoop, this);
+}
+
+void VisualizerClient::disableAsync() {
+    if (!async_queue_) {
+        return;
+    }
+
+    flush();
+    sender_running_.store(false);
+    {
+        std::lock_guard<std::mutex> lock(sender_mutex_);
+        sender_wakeup_.notify_one();
+    }
+    if (sender_.joinable()) {
+        sender_.join();
+    }
+
+    async_queue_.reset();
+}
+
+void VisualizerClient::flush() {
+    if (coalesce_pending_.load() != 0) {
+        flushCoalesced(nullptr, true);
+    }
+
+    if (async_queue_) {
+        uint64_t target = enqueued_ops_.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(sender_mutex_);
+        sender_wakeup_.notify_one();
+        sent_cv_.wait(lock, [&] {
+            return sent_ops_.load(std::memory_order_acquire) >= target;
+        });
+    }
+
+    if (shm_ring_) {
+        // Only the server moves the read index, so poll it. Give up after
+        // the same 10s a request would, in case the reader has gone away.
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        std::unique_lock<std::mutex> lock(shm_mutex_);
+        while (!shm_ring_->drained()) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                logError("Timed out waiting for the visualizer to drain " + shm_ring_->name());
+                break;
+            }
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            lock.lock();
+        }
+    }
+}
+
+bool VisualizerClient::enqueue(BatchOp&& op) {
+    while (!async_queue_->tryPush(std::move(op))) {
+        if (async_options_.overflow == OverflowPolicy::Drop) {
+            dropped_ops_.fetch_add(1, std::memory_order_relaxed);
+            if (op.mirrored) {
+                mirrorAck(op.structure_name, 1, -1);
+            }
+            return false;
+        }
+        if (sender_sleeping_.load()) {
+            sender_wakeup_.notify_one();
+        }
+        std::this_thread::yield();
+    }
+
+    enqueued_ops_.fetch_add(1, std::memory_order_release);
+    // Only pay for a notify when the sender has actually gone to sleep
+    if (sender_sleeping_.load()) {
+        sender_wakeup_.notify_one();
+    }
+    return true;
+}
+
+bool VisualizerClient::enqueueAll(std::vector<BatchOp>& ops) {
+    while (!async_queue_->tryPushAll(ops)) {
+        // A run longer than the queue would never fit
+        if (async_options_.overflow == OverflowPolicy::Drop || ops.size() > async_queue_->capacity()) {
+            dropped_ops_.fetch_add(ops.size(), std::memory_order_relaxed);
+            for (const BatchOp& op : ops) {
+                if (op.mirrored) {
+                    mirrorAck(op.structure_name, 1, -1);
+                }
+            }
+            return false;
+        }
+        if (sender_sleeping_.load()) {
+            sender_wakeup_.notify_one();
+        }
+        std::this_thread::yield();
+    }
+
+    enqueued_ops_.fetch_add(ops.size(), std::memory_order_release);
+    if (sender_sleeping_.load()) {
+        sender_wakeup_.notify_one();
+    }
+    return true;
+}
+
+void VisualizerClient::markSent(size_t count) {
+    std::lock_guard<std::mutex> lock(sender_mutex_);
+    sent_ops_.fetch_add(count, std::memory_order_release);
+    sent_cv_.notify_all();
+}
+
+void VisualizerClient::senderLoop() {
+    if (async_options_.transport == SenderTransport::Multiplexed && multiplexedSenderLoop()) {
+        return;
+    }
+
+    std::vector<BatchOp> ops;
+    ops.reserve(async_options_.max_ops_per_request);
+
+    for (;;) {
+        BatchOp op;
+        while (ops.size() < async_options_.max_ops_per_request && async_queue_->tryPop(op)) {
+            ops.push_back(std::move(op));
+        }
+
+        if (!ops.empty()) {
+            // Only the order within a structure matters, so group each
+            // structure's ops together to send one request per structure
+            std::stable_sort(ops.begin(), ops.end(), [](const BatchOp& a, const BatchOp& b) {
+                return a.structure_name < b.structure_name;
+            });
+            sendOps(ops, false);
+            markSent(ops.size());
+            ops.clear();
+            continue;
+        }
+
+        if (!sender_running_.load()) {
+            return;
+        }
+
+        // Nothing queued: sleep until a producer or flush() wakes us. The
+        // timeout bounds the latency of a wakeup that raced with going to sleep.
+        std::unique_lock<std::mutex> lock(sender_mutex_);
+        sender_sleeping_.store(true);
+        if (enqueued_ops_.load() == sent_ops_.load() && sender_running_.load()) {
+            sender_wakeup_.wait_for(lock, std::chrono::milliseconds(5));
+        }
+        sender_sleeping_.store(false);
+    }
+}
+
+// Returns false, having sent nothing, if it cannot run; the caller then
+// sends sequentially
+bool VisualizerClient::multiplexedSenderLoop() {
+    CURLM* multi = curl_multi_init();
+    if (!multi) {
+        logError("curl_multi_init failed, sending sequentially");
+        return false;
+    }
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, async_options_.max_connections);
+
+    // The format is fixed for the sender's lifetime so every request in
+    // flight shares the client's header lists for it
+    const WireFormat format = wire_format_.load();
+    struct curl_slist* const* headers = request_headers_[static_cast<int>(format)];
+    std::string compressed;
+    std::unordered_map<std::string, Lane> lanes;
+    std::vector<std::unique_ptr<MultiRequest>> requests;
+    std::vector<MultiRequest*> idle_requests;
+    const size_t max_in_flight = std::max<size_t>(1, async_options_.max_in_flight);
+    const size_t max_pending = async_queue_->capacity();
+    size_t in_flight = 0;
+    size_t pending = 0;
+    size_t first_lane = 0;
+
+    for (;;) {
+        // Sort newly queued ops into their structure's lane
+        BatchOp op;
+        while (pending < max_pending && async_queue_->tryPop(op)) {
+            lanes[op.structure_name].pending.push_back(std::move(op));
+            ++pending;
+        }
+
+        // Start a request on every lane that has nothing in flight. Each pass
+        // starts one lane further on, so when max_in_flight caps the pass
+        // the lanes at the front of the map cannot keep the rest waiting.
+        const size_t lane_count = lanes.size();
+        auto next_lane = lanes.begin();
+        if (lane_count > 0) {
+            std::advance(next_lane, first_lane++ % lane_count);
+        }
+        for (size_t visited = 0; visited < lane_count; ++visited, ++next_lane) {
+            if (next_lane == lanes.end()) {
+                next_lane = lanes.begin();
+            }
+            if (in_flight >= max_in_flight) {
+                break;
+            }
+            auto& entry = *next_lane;
+            Lane& lane = entry.second;
+            if (lane.in_flight || lane.pending.empty()) {
+                continue;
+            }
+            if (shortCircuit()) {
+                // Nobody to send to; treat the ops as sent so flush() returns
+                mirrorAck(entry.first, static_cast<int>(std::count_if(lane.pending.begin(), lane.pending.end(),
+                                                                      [](const BatchOp& op) { return op.mirrored; })),
+                          -1);
+                pending -= lane.pending.size();
+                markSent(lane.pending.size());
+                lane.pending.clear();
+                lane.singles = 0;
+                continue;
+            }
+
+            MultiRequest* request = nullptr;
+            if (!idle_requests.empty()) {
+                request = idle_requests.back();
+                idle_requests.pop_back();
+            } else {
+                requests.emplace_back(new MultiRequest());
+                request = requests.back().get();
+                request->easy = curl_easy_init();
+                configureHandle(request->easy);
+            }
+
+            size_t count = lane.singles > 0 ? 1 : std::min(lane.pending.size(), async_options_.max_ops_per_request);
+            lane.singles -= std::min(lane.singles, count);
+            std::vector<BatchOp>& ops = request->ops;
+            ops.assign(std::make_move_iterator(lane.pending.begin()),
+                       std::make_move_iterator(lane.pending.begin() + count));
+            lane.pending.erase(lane.pending.begin(), lane.pending.begin() + count);
+
+            request->structure_name = entry.first;
+            request->body = encodeBody(batchPayload(ops.data(), ops.size()), format);
+            request->response.clear();
+            request->mirrored = static_cast<int>(
+                std::count_if(ops.begin(), ops.end(), [](const BatchOp& op) { return op.mirrored; }));
+
+            struct curl_slist* request_headers = headers[0];
+            const bool compress = compression_enabled_.load(std::memory_order_relaxed);
+            request->encoding = nullptr;
+            if (compress && request->body.size() >= compression_threshold_.load(std::memory_order_relaxed)) {
+                if (const char* encoding = compressBody(request->body, compressed)) {
+                    request->body.swap(compressed);
+                    request->encoding = encoding;
+                    request_headers = headers[encoding == kZstdEncoding ? 2 : 1];
+                }
+            }
+
+            request->endpoint = structurePath(entry.first) + "/batch";
+            std::string url = base_url_ + request->endpoint;
+            curl_easy_setopt(request->easy, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(request->easy, CURLOPT_POSTFIELDS, request->body.data());
+            curl_easy_setopt(request->easy, CURLOPT_POSTFIELDSIZE, static_cast<long>(request->body.size()));
+            curl_easy_setopt(request->easy, CURLOPT_HTTPHEADER, request_headers);
+            curl_easy_setopt(request->easy, CURLOPT_ACCEPT_ENCODING, compress ? "" : nullptr);
+            curl_easy_setopt(request->easy, CURLOPT_WRITEDATA, &request->response);
+            curl_easy_setopt(request->easy, CURLOPT_PRIVATE, request);
+            request->started = std::chrono::steady_clock::now();
+            curl_multi_add_handle(multi, request->easy);
+
+            lane.in_flight = true;
+            ++in_flight;
+            pending -= count;
+        }
+
+        if (in_flight > 0) {
+            int running = 0;
+            curl_multi_perform(multi, &running);
+
+            int remaining = 0;
+            while (CURLMsg* msg = curl_multi_info_read(multi, &remaining)) {
+                if (msg->msg != CURLMSG_DONE) {
+                    continue;
+                }
+
+                MultiRequest* request = nullptr;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &request);
+                HttpResponse response;
+                recordTransportResult(msg->data.result == CURLE_OK);
+                if (msg->data.result != CURLE_OK) {
+                    logError("CURL request failed: " + std::string(curl_easy_strerror(msg->data.result)));
+                } else {
+                    curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &response.status);
+                }
+                recordRequest("POST", request->endpoint, response.ok(),
+                              request->body.size(), request->response.size(),
+                              std::chrono::steady_clock::now() - request->started);
+                curl_multi_remove_handle(multi, msg->easy_handle);
+                auto lane = lanes.find(request->structure_name);
+                lane->second.in_flight = false;
+                --in_flight;
+
+                std::vector<BatchOp>& ops = request->ops;
+                const bool refused_encoding = request->encoding && response.status == 415;
+                if (refused_encoding) {
+                    refuseEncoding(request->encoding);
+                }
+                std::string by_name;
+                const bool stale_id = response.status == 404 &&
+                                      request->response.find("Structure not found") != std::string::npos &&
+                                      routeByName(request->endpoint, by_name);
+                const bool resend = refused_encoding || stale_id;
+                if (resend || (ops.size() > 1 && response.status >= 400 && response.status < 500)) {
+                    // Put the ops back at the front of the lane: to go again
+                    // as sendRequest would, in a plainer encoding or by name
+                    // for a stale ID, or else one per request since the
+                    // server refused them as a whole
+                    lane->second.pending.insert(lane->second.pending.begin(),
+                                                std::make_move_iterator(ops.begin()),
+                                                std::make_move_iterator(ops.end()));
+                    lane->second.singles += resend ? 0 : ops.size();
+                    pending += ops.size();
+                    ops.clear();
+                    idle_requests.push_back(request);
+                    continue;
+                }
+
+                if (response.status != 0 && !response.ok()) {
+                    if (addsWithIds(ops.data(), ops.size())) {
+                        refusedNodeIds(request->structure_name, response.status);
+                    }
+                    response.body = std::move(request->response);
+                    logFailure("Batch for " + request->structure_name, response);
+                }
+                mirrorAck(request->structure_name, request->mirrored,
+                          response.ok() ? replyVersion(request->response) : -1);
+                if (lane->second.pending.empty()) {
+                    lanes.erase(lane);
+                }
+                markSent(ops.size());
+                ops.clear();
+                idle_requests.push_back(request);
+            }
+
+            // Short timeout so newly queued ops are picked up promptly
+            curl_multi_poll(multi, nullptr, 0, 1, nullptr);
+            continue;
+        }
+
+        if (pending > 0) {
+            continue;
+        }
+        if (!sender_running_.load()) {
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(sender_mutex_);
+        sender_sleeping_.store(true);
+        if (enqueued_ops_.load() == sent_ops_.load() && sender_running_.load()) {
+            sender_wakeup_.wait_for(lock, std::chrono::milliseconds(5));
+        }
+        sender_sleeping_.store(false);
+    }
+
+    for (auto& request : requests) {
+        curl_easy_cleanup(request->easy);
+    }
+    curl_multi_cleanup(multi);
+    return true;
+}
+
+bool VisualizerClient::enableSharedMemory(const SharedMemoryOptions& options) {
+    if (shm_ring_) {
+        return true;
+    }
+
+    // Ops already queued for the async sender must land first
+    flush();
+
+    // Numbered per ring as well as per process, so two clients in one
+    // process never share a segment
+    static std::atomic<unsigned> rings_created{0};
+    std::string name = options.name.empty()
+                           ? "/cpp-visualizer-" + std::to_string(getpid()) + "-" + std::to_string(rings_created++)
+                           : options.name;
+    if (name[0] != '/') {
+        name = "/" + name;
+    }
+    size_t capacity = 64;
+    while (capacity < options.capacity) {
+        capacity <<= 1;
+    }
+
+    std::string error;
+    std::unique_ptr<detail::ShmRing> ring = detail::ShmRing::create(name, capacity, options.overflow, error);
+    if (!ring) {
+        logError("Failed to create shared memory ring: " + error);
+        return false;
+    }
+
+    // The server sees the segment under /dev/shm without the leading slash
+    HttpResponse response = makeRequest("POST", "/api/live/shm", json{{"name", name.substr(1)}});
+    if (!response.ok()) {
+        logFailure("Attaching shared memory ring " + name, response);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(shm_mutex_);
+    shm_structures_.clear();
+    shm_ring_ = std::move(ring);
+    return true;
+}
+
+void VisualizerClient::disableSharedMemory() {
+    if (!shm_ring_) {
+        return;
+    }
+
+    flush();
+    HttpResponse response = makeRequest("DELETE", "/api/live/shm/" + shm_ring_->name().substr(1));
+    if (!response.ok()) {
+        logFailure("Detaching shared memory ring " + shm_ring_->name(), response);
+    }
+
+    std::lock_guard<std::mutex> lock(shm_mutex_);
+    shm_ring_.reset();
+    shm_structures_.clear();
+}
+
+bool VisualizerClient::shmWrite(BatchOp::Kind kind, const std::string& structure_name, int node_id, int index,
+                                const json& value, const std::map<std::string, json>& metadata) {
+    std::lock_guard<std::mutex> lock(shm_mutex_);
+    uint32_t number;
+    if (!shmStructure(structure_name, number)) {
+        return false;
+    }
+
+    bool written = false;
+    if (kind == BatchOp::Kind::Remove || kind == BatchOp::Kind::Drop) {
+        written = shm_ring_->publish(kind == BatchOp::Kind::Drop ? detail::ShmRing::Drop : detail::ShmRing::Remove,
+                                     number, node_id, -1, "", 0);
+    } else {
+        // Encoded into a buffer that is reused across ops
+        shm_scratch_.clear();
+        detail::appendOpPayload(shm_scratch_, value, metadata);
+        detail::ShmRing::Kind record_kind =
+            kind == BatchOp::Kind::Add ? detail::ShmRing::Add : detail::ShmRing::Update;
+        written = shm_ring_->publish(record_kind, number, node_id, index,
+                                     shm_scratch_.data(), shm_scratch_.size());
+    }
+
+    if (!written) {
+        dropped_ops_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return written;
+}
+
+bool VisualizerClient::shmWriteRecord(BatchOp::Kind kind, const std::string& structure_name, int node_id, int index,
+                                      const detail::RecordCodec& codec, const void* record) {
+    std::lock_guard<std::mutex> lock(shm_mutex_);
+    uint32_t number;
+    if (!shmStructure(structure_name, number)) {
+        return false;
+    }
+
+    // The same [value, metadata] payload as appendOpPayload(), written
+    // straight from the record
+    shm_scratch_.clear();
+    shm_scratch_.push_back(static_cast<char>(0x92));   // fixarray of 2
+    detail::BodyWriter writer(shm_scratch_, WireFormat::MessagePack);
+    codec.value(writer, record, codec.context);
+    if (codec.metadata) {
+        codec.metadata(writer, record, codec.context);
+    } else {
+        shm_scratch_.push_back(static_cast<char>(0x80));   // empty fixmap
+    }
+
+    detail::ShmRing::Kind record_kind =
+        kind == BatchOp::Kind::Add ? detail::ShmRing::Add : detail::ShmRing::Update;
+    if (!shm_ring_->publish(record_kind, number, node_id, index, shm_scratch_.data(), shm_scratch_.size())) {
+        dropped_ops_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool VisualizerClient::shmWriteAll(const std::vector<BatchOp>& ops) {
+    // Only drops come through here, one slot each, all on one structure
+    std::lock_guard<std::mutex> lock(shm_mutex_);
+    uint32_t number;
+    if (ops.empty() || !shmStructure(ops.front().structure_name, number)) {
+        return ops.empty();
+    }
+    if (!shm_ring_->reserve(ops.size(), ops.size())) {
+        dropped_ops_.fetch_add(ops.size(), std::memory_order_relaxed);
+        return false;
+    }
+    for (const BatchOp& op : ops) {
+        shm_ring_->publish(detail::ShmRing::Drop, number, op.node_id, -1, "", 0);
+    }
+    return true;
+}
+
+bool VisualizerClient::shmStructure(const std::string& structure_name, uint32_t& number) {
+    // Caller holds shm_mutex_
+    auto structure = shm_structures_.find(structure_name);
+    if (structure == shm_structures_.end()) {
+        number = static_cast<uint32_t>(shm_structures_.size());
+        if (!shm_ring_->publish(detail::ShmRing::Define, number, -1, -1, structure_name.data(), structure_name.size())) {
+            dropped_ops_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        shm_structures_.emplace(structure_name, number);
+        return true;
+    }
+    number = structure->second;
+    return true;
+}
+
+void VisualizerClient::enableCoalescing(const CoalesceOptions& options) {
+    if (coalescing_.load()) {
+        return;
+    }
+
+    coalesce_options_ = options;
+    if (coalesce_options_.window.count() < 0) {
+        coalesce_options_.window = std::chrono::milliseconds(0);
+    }
+    if (coalesce_options_.burst <= 0) {
+        coalesce_options_.burst = std::max(1.0, coalesce_options_.max_ops_per_second);
+    }
+    coalescing_.store(true);
+    coalescer_ = std::thread(&VisualizerClient::coalescerLoop, this);
+}
+
+void VisualizerClient::disableCoalescing() {
+    if (!coalescing_.load()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(coalesce_mutex_);
+        coalescing_.store(false);
+        coalesce_wakeup_.notify_one();
+    }
+    if (coalescer_.joinable()) {
+        coalescer_.join();
+    }
+    flushCoalesced(nullptr, true);
+}
+
+void VisualizerClient::coalesceUpdate(BatchOp&& op) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(coalesce_mutex_);
+    CoalesceLane& lane = coalesce_lanes_[op.structure_name];
+    if (lane.refilled == std::chrono::steady_clock::time_point{}) {
+        lane.tokens = coalesce_options_.burst;
+        lane.refilled = now;
+    }
+
+    auto held = lane.pending.find(op.node_id);
+    if (held == lane.pending.end()) {
+        int node_id = op.node_id;
+        lane.pending.emplace(node_id, HeldUpdate{std::move(op), now + coalesce_options_.window});
+        coalesce_pending_.fetch_add(1);
+        return;
+    }
+
+    // Same result as applying both in turn: the later value wins and the
+    // metadata maps merge, later keys overwriting earlier ones
+    held->second.op.value = std::move(op.value);
+    for (auto& entry : op.metadata) {
+        held->second.op.metadata[entry.first] = std::move(entry.second);
+    }
+    if (op.mirrored && held->second.op.mirrored) {
+        // Two mirrored writes, one request: the held op answers for both
+        mirrorAck(op.structure_name, 1, 0);
+    }
+    held->second.op.mirrored = held->second.op.mirrored || op.mirrored;
+    coalesced_ops_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void VisualizerClient::flushCoalesced(const std::string* structure_name, bool force) {
+    // Held so a forced flush cannot overtake updates the coalescer thread
+    // has taken out but not sent yet
+    std::lock_guard<std::mutex> send_lock(coalesce_send_mutex_);
+
+    std::vector<BatchOp> ops;
+    {
+        std::lock_guard<std::mutex> lock(coalesce_mutex_);
+        auto now = std::chrono::steady_clock::now();
+        const double rate = coalesce_options_.max_ops_per_second;
+
+        for (auto& entry : coalesce_lanes_) {
+            if (structure_name && entry.first != *structure_name) {
+                continue;
+            }
+            CoalesceLane& lane = entry.second;
+            if (rate > 0) {
+                double elapsed = std::chrono::duration<double>(now - lane.refilled).count();
+                lane.tokens = std::min(coalesce_options_.burst, lane.tokens + rate * elapsed);
+                lane.refilled = now;
+            }
+
+            for (auto held = lane.pending.begin(); held != lane.pending.end();) {
+                if (!force && held->second.due > now) {
+                    ++held;
+                    continue;
+                }
+                // Out of tokens: leave the rest held, where they keep
+                // absorbing later updates. Forced flushes go into debt.
+                if (!force && rate > 0 && lane.tokens < 1) {
+                    break;
+                }
+                if (rate > 0) {
+                    lane.tokens -= 1;
+                }
+                ops.push_back(std::move(held->second.op));
+                held = lane.pending.erase(held);
+            }
+        }
+        coalesce_pending_.fetch_sub(ops.size());
+    }
+
+    // Ops are grouped by structure, so each structure goes out as one batch
+    if (!ops.empty()) {
+        dispatchOps(ops, true);
+    }
+}
+
+void VisualizerClient::coalescerLoop() {
+    auto tick = std::max(std::chrono::milliseconds(1), coalesce_options_.window / 2);
+    while (coalescing_.load()) {
+        {
+            std::unique_lock<std::mutex> lock(coalesce_mutex_);
+            coalesce_wakeup_.wait_for(lock, tick, [&] { return !coalescing_.load(); });
+        }
+        if (coalesce_pending_.load() != 0) {
+            flushCoalesced(nullptr, false);
+        }
     }
 }
 
-VisualizerClient::~VisualizerClient() {
-    if (curl_) {
-        curl_easy_cleanup(curl_);
+bool VisualizerClient::startRecording(const std::string& path) {
+    if (recorder_) {
+        return true;
+    }
+
+    // Whatever is already queued still goes to the server
+    flush();
+
+    std::string error;
+    recorder_ = TraceWriter::open(path, error);
+    if (!recorder_) {
+        logError("Failed to start recording: " + error);
+        return false;
     }
-    curl_global_cleanup();
+    return true;
 }
 
-bool VisualizerClient::createStructure(const std::string& name, 
-                                      const std::string& type,
-                                      int depth, 
-                                      int initial_size) {
-    json data = {
-        {"name", name},
-        {"type", type},
-        {"depth", depth},
-        {"initialSize", initial_size}
-    };
-    
-    std::string response = makeRequest("POST", "/api/live/structure", data);
-    return !response.empty() && response.find("\"id\"") != std::string::npos;
+bool VisualizerClient::stopRecording() {
+    if (!recorder_) {
+        return true;
+    }
+
+    bool ok = recorder_->close();
+    if (!ok) {
+        logError("Failed to write trace file");
+    }
+    recorder_.reset();
+
+    // Locally allocated ranges mean nothing to the server
+    std::lock_guard<std::mutex> lock(id_mutex_);
+    id_ranges_.clear();
+    return ok;
 }
 
-int VisualizerClient::addNode(const std::string& structure_name, 
-                             const json& value, 
-                             int index,
-                             const std::map<std::string, json>& metadata) {
-    json data = {
-        {"value", value},
-        {"metadata", metadata}
-    };
-    
-    if (index >= 0) {
-        data["index"] = index;
+std::vector<int> VisualizerClient::applyOps(const std::vector<BatchOp>& ops) {
+    flush();
+
+    // One request per structure: order is only kept within a structure
+    std::vector<size_t> order(ops.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
     }
-    
-    std::string endpoint = "/api/live/structure/" + structure_name + "/node";
-    std::string response = makeRequest("POST", endpoint, data);
-    
-    try {
-        json result = json::parse(response);
-        if (result.contains("node") && result["node"].contains("id")) {
-            return result["node"]["id"];
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return ops[a].structure_name < ops[b].structure_name;
+    });
+    std::vector<BatchOp> grouped;
+    grouped.reserve(ops.size());
+    for (size_t i : order) {
+        grouped.push_back(ops[i]);
+    }
+
+    std::vector<int> grouped_ids = sendOps(grouped);
+    std::vector<int> ids(ops.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        ids[order[i]] = grouped_ids[i];
+    }
+    return ids;
+}
+
+std::vector<int> VisualizerClient::addRecords(const std::string& structure_name,
+                                              const std::vector<detail::LayoutField>& fields,
+                                              const void* records, size_t stride, size_t count) {
+    if (fields.empty()) {
+        logError("addNodes on " + structure_name + ": no layout registered for this record type");
+        return std::vector<int>(count, -1);
+    }
+    bool has_metadata = std::any_of(fields.begin(), fields.end(),
+                                    [](const detail::LayoutField& field) { return field.metadata; });
+    detail::RecordCodec codec{&detail::writeLayoutValue, has_metadata ? &detail::writeLayoutMetadata : nullptr, &fields};
+    return addEncodedRecords(structure_name, codec, records, stride, count);
+}
+
+std::vector<int> VisualizerClient::addEncodedRecords(const std::string& structure_name,
+                                                     const detail::RecordCodec& codec,
+                                                     const void* records, size_t stride, size_t count) {
+    std::vector<int> ids(count, -1);
+    if (count == 0) {
+        return ids;
+    }
+    if (coalesce_pending_.load() != 0) {
+        flushCoalesced(&structure_name, true);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        ids[i] = allocateNodeId(structure_name);
+        if (ids[i] < 0) {
+            return std::vector<int>(count, -1);
         }
-    } catch (const std::exception& e) {
-        logError("Failed to parse addNode response: " + std::string(e.what()));
     }
-    
-    return -1;
+
+    const unsigned char* base = static_cast<const unsigned char*>(records);
+    const bool batching = inBatch();
+    if (batching || recorder_ || shm_ring_ || async_queue_ || mirror_running_.load(std::memory_order_relaxed)) {
+        // These paths carry ops rather than request bodies, and the mirror
+        // needs each record as a json value anyway
+        std::vector<BatchOp> ops;
+        ops.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            const void* record = base + i * stride;
+            BatchOp op{BatchOp::Kind::Add, structure_name, ids[i], -1,
+                       detail::recordToJson(codec.value, record, codec.context), {}};
+            if (codec.metadata) {
+                op.metadata = detail::recordToJson(codec.metadata, record, codec.context)
+                                  .get<std::map<std::string, json>>();
+            }
+            op.mirrored = mirrorWrite(BatchOp::Kind::Add, structure_name, op.node_id, -1, op.value, op.metadata);
+            if (batching) {
+                queueBatchOp(std::move(op));
+            } else {
+                ops.push_back(std::move(op));
+            }
+        }
+        return batching ? ids : dispatchOps(ops, true);
+    }
+
+    // Same shape as batchPayload(), written in one pass over the records
+    const WireFormat format = wire_format_.load();
+    std::string body;
+    body.reserve(32 + count * 128);
+    detail::BodyWriter writer(body, format);
+    writer.beginObject(1);
+    writer.key("ops", 3);
+    writer.beginArray(count);
+    for (size_t i = 0; i < count; ++i) {
+        const void* record = base + i * stride;
+        writer.beginObject(4);
+        writer.key("op", 2);
+        writer.value("add", 3);
+        writer.key("id", 2);
+        writer.value(static_cast<int64_t>(ids[i]));
+        writer.key("value", 5);
+        codec.value(writer, record, codec.context);
+        writer.key("metadata", 8);
+        if (codec.metadata) {
+            codec.metadata(writer, record, codec.context);
+        } else {
+            writer.beginObject(0);
+            writer.endObject();
+        }
+        writer.endObject();
+    }
+    writer.endArray();
+    writer.endObject();
+
+    // The server keeps the IDs we reserved, so there is nothing to read back
+    HttpResponse response = performRequest("POST", structurePath(structure_name) + "/batch", body, format);
+    if (!response.ok()) {
+        refusedNodeIds(structure_name, response.status);
+        logFailure("addNodes on " + structure_name, response);
+        return std::vector<int>(count, -1);
+    }
+    return ids;
 }
 
-bool VisualizerClient::removeNode(const std::string& structure_name, int node_id) {
-    std::string endpoint = "/api/live/structure/" + structure_name + "/node/" + std::to_string(node_id);
-    std::string response = makeRequest("DELETE", endpoint);
-    return !response.empty() && response.find("error") == std::string::npos;
+int VisualizerClient::writeRecordNode(BatchOp::Kind kind, const std::string& structure_name, int node_id, int index,
+                                      const detail::RecordCodec& codec, const void* record) {
+    const bool add = kind == BatchOp::Kind::Add;
+    if (inBatch() || recorder_ || async_queue_ || (!add && coalescing_.load(std::memory_order_relaxed)) ||
+        mirror_running_.load(std::memory_order_relaxed)) {
+        // These paths, and the mirror, hold json values
+        json value = detail::recordToJson(codec.value, record, codec.context);
+        if (add) {
+            return addNode(structure_name, value, index);
+        }
+        return updateNode(structure_name, node_id, value) ? node_id : -1;
+    }
+
+    if (add) {
+        node_id = allocateNodeId(structure_name);
+        if (node_id < 0) {
+            return -1;
+        }
+        if (coalesce_pending_.load() != 0) {
+            flushCoalesced(&structure_name, true);
+        }
+    }
+    if (shm_ring_) {
+        return shmWriteRecord(kind, structure_name, node_id, index, codec, record) ? node_id : -1;
+    }
+
+    // Reused per thread, so a warm buffer does not allocate
+    thread_local std::string body = reservedString(256);
+    body.clear();
+    const WireFormat format = wire_format_.load();
+    detail::BodyWriter writer(body, format);
+    writer.beginObject(add ? (index >= 0 ? 4 : 3) : 2);
+    if (add) {
+        writer.key("id", 2);
+        writer.value(static_cast<int64_t>(node_id));
+    }
+    writer.key("value", 5);
+    codec.value(writer, record, codec.context);
+    writer.key("metadata", 8);
+    writer.beginObject(0);
+    writer.endObject();
+    if (add && index >= 0) {
+        writer.key("index", 5);
+        writer.value(static_cast<int64_t>(index));
+    }
+    writer.endObject();
+
+    const std::string& endpoint = nodeRoute(structureId(structure_name), structure_name, add ? -1 : node_id, mutationQuery());
+    return sendMutation(add ? "POST" : "PUT", endpoint, body, format, add ? "addNode" : "updateNode",
+                        structure_name) ? node_id : -1;
 }
 
-bool VisualizerClient::updateNode(const std::string& structure_name, 
-                                 int node_id, 
-                                 const json& value,
-                                 const std::map<std::string, json>& metadata) {
-    json data = {
-        {"value", value},
-        {"metadata", metadata}
-    };
-    
-    std::string endpoint = "/api/live/structure/" + structure_name + "/node/" + std::to_string(node_id);
-    std::string response = makeRequest("PUT", endpoint, data);
-    return !response.empty() && response.find("error") == std::string::npos;
+bool VisualizerClient::isConnected() {
+    if (!probeHealth()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(breaker_mutex_);
+    closeBreaker();
+    return true;
 }
 
-json VisualizerClient::getStructure(const std::string& structure_name) {
-    std::string endpoint = "/api/live/structure/" + structure_name;
-    std::string response = makeRequest("GET", endpoint);
-    
-    try {
-        return json::parse(response);
-    } catch (const std::exception& e) {
-        logError("Failed to parse getStructure response: " + std::string(e.what()));
-        return json{};
+void VisualizerClient::setCircuitBreaker(const CircuitBreakerOptions& options) {
+    std::lock_guard<std::mutex> lock(breaker_mutex_);
+    breaker_options_ = options;
+    breaker_options_.failure_threshold = std::max(options.failure_threshold, 1);
+    breaker_enabled_.store(options.enabled);
+    if (!options.enabled) {
+        closeBreaker();
     }
+    breaker_wakeup_.notify_all();
 }
 
-std::vector<json> VisualizerClient::getAllStructures() {
-    std::string response = makeRequest("GET", "/api/live/structures");
-    
-    try {
-        json result = json::parse(response);
-        if (result.is_array()) {
-            return result;
+void VisualizerClient::recordTransportResult(bool reached_server) {
+    if (reached_server) {
+        if (consecutive_failures_.load(std::memory_order_relaxed) != 0) {
+            consecutive_failures_.store(0, std::memory_order_relaxed);
         }
-    } catch (const std::exception& e) {
-        logError("Failed to parse getAllStructures response: " + std::string(e.what()));
+        return;
+    }
+    if (!breaker_enabled_.load(std::memory_order_relaxed)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(breaker_mutex_);
+    if (consecutive_failures_.fetch_add(1) + 1 >= breaker_options_.failure_threshold) {
+        openBreaker();
     }
-    
-    return {};
 }
 
-json VisualizerClient::getMatrix() {
-    std::string response = makeRequest("GET", "/api/live/matrix");
-    
-    try {
-        return json::parse(response);
-    } catch (const std::exception& e) {
-        logError("Failed to parse getMatrix response: " + std::string(e.what()));
-        return json{};
+// Both run with breaker_mutex_ held
+void VisualizerClient::openBreaker() {
+    if (breaker_open_.exchange(true)) {
+        return;
+    }
+    logError("Visualizer at " + base_url_ + " is unreachable; failing calls fast until /api/live/health answers");
+    if (!breaker_prober_.joinable()) {
+        breaker_prober_ = std::thread(&VisualizerClient::breakerProbeLoop, this);
     }
+    breaker_wakeup_.notify_all();
 }
 
-bool VisualizerClient::deleteStructure(const std::string& structure_name) {
-    std::string endpoint = "/api/live/structure/" + structure_name;
-    std::string response = makeRequest("DELETE", endpoint);
-    return !response.empty() && response.find("error") == std::string::npos;
+void VisualizerClient::closeBreaker() {
+    consecutive_failures_.store(0);
+    if (breaker_open_.exchange(false)) {
+        logError("Visualizer at " + base_url_ + " is reachable again");
+    }
 }
 
-bool VisualizerClient::isConnected() {
-    std::string response = makeRequest("GET", "/api/live/structures");
-    return !response.empty();
+bool VisualizerClient::probeHealth() {
+    long timeout_ms;
+    {
+        std::lock_guard<std::mutex> lock(breaker_mutex_);
+        timeout_ms = std::max<long>(static_cast<long>(breaker_options_.probe_timeout.count()), 1);
+    }
+
+    // A handle of its own so the short timeouts never leak into the pool
+    CURL* curl = curl_easy_init();
+    if (!curl) {
+        return false;
+    }
+    configureHandle(curl);
+    std::string url = base_url_ + "/api/live/health";
+    std::string body;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, timeout_ms);
+
+    long status = 0;
+    if (curl_easy_perform(curl) == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    }
+    curl_easy_cleanup(curl);
+    return status >= 200 && status < 300;
+}
+
+void VisualizerClient::breakerProbeLoop() {
+    std::unique_lock<std::mutex> lock(breaker_mutex_);
+    while (!breaker_stopping_) {
+        if (!breaker_open_.load()) {
+            breaker_wakeup_.wait(lock, [&] { return breaker_stopping_ || breaker_open_.load(); });
+            continue;
+        }
+        if (breaker_wakeup_.wait_for(lock, breaker_options_.probe_interval,
+                                     [&] { return breaker_stopping_ || !breaker_open_.load(); })) {
+            continue;
+        }
+
+        lock.unlock();
+        bool up = probeHealth();
+        lock.lock();
+        if (up && !breaker_stopping_) {
+            closeBreaker();
+        }
+    }
+}
+
+CURL* VisualizerClient::acquireHandle() {
+    {
+        std::lock_guard<std::mutex> lock(handle_mutex_);
+        if (!idle_handles_.empty()) {
+            CURL* handle = idle_handles_.back();
+            idle_handles_.pop_back();
+            return handle;
+        }
+    }
+
+    // Pool is empty: this thread gets a handle of its own, which keeps its
+    // connection alive for whoever leases it next
+    CURL* handle = curl_easy_init();
+    configureHandle(handle);
+    return handle;
+}
+
+void VisualizerClient::configureHandle(CURL* handle) {
+    if (!handle) {
+        return;
+    }
+
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT, 10L);
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 5L);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    if (http2_prior_knowledge_) {
+        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+    }
+    if (!unix_socket_path_.empty()) {
+        curl_easy_setopt(handle, CURLOPT_UNIX_SOCKET_PATH, unix_socket_path_.c_str());
+    }
+}
+
+void VisualizerClient::releaseHandle(CURL* handle) {
+    std::lock_guard<std::mutex> lock(handle_mutex_);
+    idle_handles_.push_back(handle);
+}
+
+VisualizerClient::HttpResponse VisualizerClient::makeRequest(const std::string& method, 
+                                                             const std::string& endpoint, 
+                                                             const json& data) {
+    if (shortCircuit()) {
+        return HttpResponse{};
+    }
+    const WireFormat format = wire_format_.load();
+    std::string body;
+    if (method == "POST" || method == "PUT") {
+        body = encodeBody(data, format);
+    }
+    return performRequest(method, endpoint, body, format);
+}
+
+VisualizerClient::HttpResponse VisualizerClient::performRequest(const std::string& method,
+                                                                const std::string& endpoint,
+                                                                const std::string& body,
+                                                                WireFormat format,
+                                                                const char* content_type) {
+    HttpResponse response;
+    response.status = sendRequest(method, endpoint, body, format, content_type, response.body);
+    return response;
 }
 
-std::string VisualizerClient::makeRequest(const std::string& method, 
-                                         const std::string& endpoint, 
-                                         const json& data) {
-    if (!curl_) {
+long VisualizerClient::sendRequest(const std::string& method, const std::string& endpoint, const std::string& body,
+                                   WireFormat format, const char* content_type, std::string& response_body,
+                                   detail::NodeStream* stream, const char* extra_header, std::string* etag) {
+    response_body.clear();
+    if (shortCircuit()) {
+        return 0;
+    }
+    auto started = std::chrono::steady_clock::now();
+    CURL* curl = acquireHandle();
+    if (!curl) {
         logError("CURL not initialized");
-        return "";
+        return 0;
     }
     
-    std::string url = base_url_ + endpoint;
-    std::string response_data;
-    std::string json_string;
+    // Reused per thread, so a warm buffer does not allocate
+    thread_local std::string url = reservedString(256);
+    url.assign(base_url_).append(endpoint);
+    
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    StreamTarget target{stream, curl, &response_body, 0};
+    if (stream) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, streamCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &target);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_body);
+    }
+    if (etag) {
+        etag->clear();
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, etagCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, etag);
+    }
+    // An empty string lets curl offer, and transparently decode, every
+    // encoding it was built with
+    const bool compress = compression_enabled_.load(std::memory_order_relaxed);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, compress ? "" : nullptr);
     
-    curl_easy_setopt(curl_, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl_, CURLOPT_WRITEDATA, &response_data);
+    const std::string* payload = &body;
+    const char* encoding = nullptr;
+    thread_local std::string compressed;
+    if (compress && (method == "POST" || method == "PUT") &&
+        body.size() >= compression_threshold_.load(std::memory_order_relaxed)) {
+        encoding = compressBody(body, compressed);
+        if (encoding) {
+            payload = &compressed;
+        }
+    }
     
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    // Only a content-type override or an extra header needs a header list
+    // of its own
+    struct curl_slist* own_headers = nullptr;
+    struct curl_slist* headers =
+        request_headers_[static_cast<int>(format)][encoding == kZstdEncoding ? 2 : encoding ? 1 : 0];
+    if (content_type || extra_header) {
+        own_headers = formatHeaders(format, content_type);
+        if (encoding) {
+            own_headers = curl_slist_append(own_headers, encoding);
+        }
+        if (extra_header) {
+            own_headers = curl_slist_append(own_headers, extra_header);
+        }
+        headers = own_headers;
+    }
     
     if (method == "POST" || method == "PUT") {
-        json_string = data.dump();
-        curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, json_string.c_str());
+        // Binary bodies may contain NUL bytes, so the size must be explicit
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload->data());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(payload->size()));
         
         if (method == "POST") {
-            curl_easy_setopt(curl_, CURLOPT_POST, 1L);
+            curl_easy_setopt(curl, CURLOPT_POST, 1L);
+            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, nullptr);
         } else {
-            curl_easy_setopt(curl_, CURLOPT_CUSTOMREQUEST, "PUT");
+            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
         }
     } else if (method == "DELETE") {
-        curl_easy_setopt(curl_, CURLOPT_CUSTOMREQUEST, "DELETE");
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
     } else {
-        curl_easy_setopt(curl_, CURLOPT_HTTPGET, 1L);
+        // Handles are reused, so clear any method left by the last request
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, nullptr);
     }
     
-    curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
     
-    CURLcode res = curl_easy_perform(curl_);
+    long status = 0;
+    CURLcode res = curl_easy_perform(curl);
+    // A stream aborts the transfer to stop early, after the server answered
+    const bool answered = res == CURLE_OK || (stream && stream->aborted());
+    if (answered) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    }
+    // Handles are pooled, so put the usual callbacks back
+    if (stream) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    }
+    if (etag) {
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, nullptr);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, nullptr);
+    }
     
-    curl_slist_free_all(headers);
+    curl_slist_free_all(own_headers);
+    releaseHandle(curl);
+    recordTransportResult(answered);
     
-    if (res != CURLE_OK) {
+    if (!answered) {
         logError("CURL request failed: " + std::string(curl_easy_strerror(res)));
-        return "";
+        response_body.clear();
     }
     
-    return response_data;
+    recordRequest(method, endpoint, status >= 200 && status < 300, payload->size(),
+                  stream ? target.received : response_body.size(), std::chrono::steady_clock::now() - started);
+
+    if (encoding && status == 415) {
+        refuseEncoding(encoding);
+        return sendRequest(method, endpoint, body, format, content_type, response_body, stream, extra_header, etag);
+    }
+    if (status == 404 && method != "DELETE" && response_body.find("Structure not found") != std::string::npos) {
+        // A stale structure ID: retry once by name, which cannot go stale.
+        // Not a delete, though: the structure it meant is gone already and
+        // the name may be someone else's by now.
+        std::string route;
+        if (routeByName(endpoint, route)) {
+            return sendRequest(method, route, body, format, content_type, response_body, stream, extra_header, etag);
+        }
+    }
+    return status;
+}
+
+// Single-node mutations only need the status, so the reply goes to a
+// per-thread buffer and an HttpResponse is built only to log a failure
+bool VisualizerClient::sendMutation(const char* method, const std::string& endpoint, const std::string& body,
+                                    WireFormat format, const char* what, const std::string& structure_name,
+                                    bool mirrored) {
+    thread_local std::string reply = reservedString(256);
+    long status = sendRequest(method, endpoint, body, format, nullptr, reply);
+    if (status >= 200 && status < 300) {
+        if (mirrored) {
+            mirrorAck(structure_name, 1, replyVersion(reply));
+        }
+        return true;
+    }
+    if (mirrored) {
+        mirrorAck(structure_name, 1, -1);
+    }
+    if (std::strcmp(method, "POST") == 0) {
+        // Node adds are the only POSTs, and name an ID from our range
+        refusedNodeIds(structure_name, status);
+    }
+    logFailure(what + (" on " + structure_name), HttpResponse{status, reply});
+    return false;
+}
+
+long long VisualizerClient::replyVersion(const std::string& reply) const {
+    // Minimal replies carry the version at the top, full ones in the
+    // structure; 0 when neither does
+    try {
+        json body = parseBody(reply);
+        if (body.contains("version")) {
+            return body["version"].get<long long>();
+        }
+        if (body.contains("structure")) {
+            return body["structure"].value("version", 0LL);
+        }
+    } catch (const std::exception&) {
+    }
+    return 0;
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds) {
+    ++counts_[bucketOf(nanoseconds)];
+    ++count_;
+    sum_ += nanoseconds;
+    max_ = std::max(max_, nanoseconds);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (int i = 0; i < kBuckets; ++i) {
+        counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(std::ceil(std::min(std::max(p, 0.0), 100.0) / 100.0 * count_));
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+        seen += counts_[i];
+        if (seen >= rank) {
+            return std::min(bucketValue(i), max_);
+        }
+    }
+    return max_;
+}
+
+int LatencyHistogram::bucketOf(uint64_t value) {
+    if (value < static_cast<uint64_t>(kLinear)) {
+        return static_cast<int>(value);
+    }
+    int exponent = 6;
+    while (exponent < 63 && (value >> (exponent + 1)) != 0) {
+        ++exponent;
+    }
+    if (exponent >= kMaxExponent) {
+        return kBuckets - 1;
+    }
+    // The top six bits: the leading one and five bits of sub-bucket
+    int sub = static_cast<int>((value >> (exponent - 5)) & (kSubBuckets - 1));
+    return kLinear + (exponent - 6) * kSubBuckets + sub;
+}
+
+uint64_t LatencyHistogram::bucketValue(int bucket) {
+    if (bucket < kLinear) {
+        return static_cast<uint64_t>(bucket);
+    }
+    int exponent = 6 + (bucket - kLinear) / kSubBuckets;
+    uint64_t sub = static_cast<uint64_t>((bucket - kLinear) % kSubBuckets);
+    uint64_t width = uint64_t(1) << (exponent - 5);
+    // Middle of the bucket's range
+    return (kSubBuckets + sub) * width + width / 2;
+}
+
+std::string ClientStats::format() const {
+    std::ostringstream out;
+    out << std::left << std::setw(48) << "endpoint" << std::right
+        << std::setw(9) << "calls" << std::setw(8) << "errors"
+        << std::setw(11) << "sent" << std::setw(11) << "received"
+        << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10) << "p999"
+        << std::setw(10) << "max" << "\n";
+    auto row = [&](const std::string& name, const EndpointStats& e) {
+        out << std::left << std::setw(48) << name << std::right
+            << std::setw(9) << e.calls << std::setw(8) << e.errors
+            << std::setw(11) << formatBytes(e.bytes_sent) << std::setw(11) << formatBytes(e.bytes_received)
+            << std::setw(10) << formatLatency(e.latency.percentile(50))
+            << std::setw(10) << formatLatency(e.latency.percentile(99))
+            << std::setw(10) << formatLatency(e.latency.percentile(99.9))
+            << std::setw(10) << formatLatency(e.latency.max()) << "\n";
+    };
+    for (const auto& entry : endpoints) {
+        row(entry.first, entry.second);
+    }
+    row("total", total);
+    if (dropped_ops > 0 || coalesced_ops > 0 || short_circuited > 0) {
+        out << "dropped ops " << dropped_ops << ", coalesced ops " << coalesced_ops
+            << ", short-circuited calls " << short_circuited << "\n";
+    }
+    return out.str();
+}
+
+ClientStats VisualizerClient::stats() const {
+    ClientStats result;
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        result.endpoints = endpoint_stats_;
+    }
+    for (const auto& entry : result.endpoints) {
+        const EndpointStats& e = entry.second;
+        result.total.calls += e.calls;
+        result.total.errors += e.errors;
+        result.total.bytes_sent += e.bytes_sent;
+        result.total.bytes_received += e.bytes_received;
+        result.total.latency.merge(e.latency);
+    }
+    result.dropped_ops = droppedOps();
+    result.coalesced_ops = coalescedOps();
+    result.short_circuited = short_circuited_.load(std::memory_order_relaxed);
+    return result;
+}
+
+void VisualizerClient::resetStats() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    endpoint_stats_.clear();
+}
+
+void VisualizerClient::enableStatsDump(std::chrono::milliseconds interval, const std::string& path) {
+    disableStatsDump();
+    {
+        std::lock_guard<std::mutex> lock(stats_dump_mutex_);
+        stats_dump_running_ = true;
+    }
+    stats_dumper_ = std::thread(&VisualizerClient::statsDumpLoop, this,
+                                std::max(interval, std::chrono::milliseconds(1)), path);
+}
+
+void VisualizerClient::disableStatsDump() {
+    {
+        std::lock_guard<std::mutex> lock(stats_dump_mutex_);
+        stats_dump_running_ = false;
+    }
+    stats_dump_wakeup_.notify_all();
+    if (stats_dumper_.joinable()) {
+        stats_dumper_.join();
+    }
+}
+
+void VisualizerClient::statsDumpLoop(std::chrono::milliseconds interval, std::string path) {
+    std::unique_lock<std::mutex> lock(stats_dump_mutex_);
+    auto due = std::chrono::steady_clock::now() + interval;
+    while (stats_dump_running_) {
+        if (stats_dump_wakeup_.wait_until(lock, due, [&] { return !stats_dump_running_; })) {
+            break;
+        }
+        due += interval;
+
+        std::time_t now = std::time(nullptr);
+        std::ostringstream report;
+        report << "[VisualizerClient] stats at " << std::put_time(std::localtime(&now), "%Y-%m-%d %H:%M:%S")
+               << "\n" << stats().format();
+        if (path.empty()) {
+            std::cerr << report.str() << std::flush;
+        } else {
+            std::ofstream file(path, std::ios::app);
+            file << report.str() << "\n";
+        }
+    }
+}
+
+void VisualizerClient::recordRequest(const std::string& method, const std::string& endpoint, bool ok,
+                                     size_t bytes_sent, size_t bytes_received,
+                                     std::chrono::steady_clock::duration elapsed) {
+    thread_local std::string key = reservedString(256);
+    endpointKey(method, endpoint, key);
+    uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    EndpointStats& e = endpoint_stats_[key];
+    ++e.calls;
+    if (!ok) {
+        ++e.errors;
+    }
+    e.bytes_sent += bytes_sent;
+    e.bytes_received += bytes_received;
+    e.latency.record(ns);
+}
+
+const char* VisualizerClient::mutationQuery() const {
+    return minimal_responses_.load() ? "?return=minimal" : "";
+}
+
+void VisualizerClient::logFailure(const std::string& what, const HttpResponse& response) {
+    if (!verbose_.load() || response.status == 0) {
+        // Transport failures were already logged by makeRequest
+        return;
+    }
+
+    std::string message;
+    try {
+        json body = parseBody(response.body);
+        if (body.is_object() && body.contains("message")) {
+            message = body["message"].get<std::string>();
+        }
+    } catch (const std::exception&) {
+    }
+    logError(what + " failed with HTTP " + std::to_string(response.status) +
+             (message.empty() ? "" : ": " + message));
+}
+
+void VisualizerClient::enableCompression(const CompressionOptions& options) {
+    Compression algorithm = options.algorithm;
+#ifndef VISUALIZER_WITH_ZSTD
+    if (algorithm == Compression::Zstd) {
+        logError("Built without VISUALIZER_WITH_ZSTD; compressing with gzip instead");
+        algorithm = Compression::Gzip;
+    }
+#endif
+    compression_.store(algorithm);
+    compression_level_.store(options.level);
+    compression_min_bytes_.store(options.min_bytes);
+    compression_threshold_.store(options.min_bytes);
+    compression_enabled_.store(true);
+}
+
+// The server cannot decode this encoding: step down to gzip, or to plain
+// bodies if gzip was refused too. The caller sends the body again.
+void VisualizerClient::refuseEncoding(const char* encoding) {
+    if (compression_.exchange(Compression::Gzip) == Compression::Gzip) {
+        compression_enabled_.store(false);
+    }
+    logError(std::string("Server refused ") + (encoding + 18) + " request bodies; falling back");
+}
+
+const char* VisualizerClient::compressBody(const std::string& body, std::string& out) {
+    const Compression algorithm = compression_.load();
+    bool compressed = false;
+#ifdef VISUALIZER_WITH_ZSTD
+    if (algorithm == Compression::Zstd) {
+        compressed = zstdCompress(body, out, compression_level_.load());
+    } else
+#endif
+    {
+        compressed = gzipCompress(body, out, compression_level_.load());
+    }
+    if (!compressed) {
+        return nullptr;
+    }
+
+    // Bodies that barely shrink raise the bar for the next ones; bodies that
+    // halve bring it back down
+    size_t threshold = compression_threshold_.load(std::memory_order_relaxed);
+    if (out.size() * 10 > body.size() * 9) {
+        threshold = std::min(threshold * 2, kMaxCompressionThreshold);
+    } else if (out.size() * 2 < body.size()) {
+        threshold = std::max(threshold - threshold / 4, compression_min_bytes_.load());
+    }
+    compression_threshold_.store(threshold, std::memory_order_relaxed);
+
+    if (out.size() >= body.size()) {
+        return nullptr;
+    }
+    return algorithm == Compression::Zstd ? kZstdEncoding : kGzipEncoding;
+}
+
+std::string VisualizerClient::encodeBody(const json& data, WireFormat format) const {
+    std::string body;
+    switch (format) {
+        case WireFormat::MessagePack:
+            json::to_msgpack(data, nlohmann::detail::output_adapter<char>(body));
+            break;
+        case WireFormat::Cbor:
+            json::to_cbor(data, nlohmann::detail::output_adapter<char>(body));
+            break;
+        case WireFormat::Json:
+            body = data.dump();
+            break;
+    }
+    return body;
+}
+
+void VisualizerClient::writeNodeBody(std::string& body, WireFormat format, int node_id, int index, const json& value,
+                                     const std::map<std::string, json>& metadata) const {
+    // Written directly rather than built as a json object and encoded, which
+    // would copy the value and allocate for every node
+    body.clear();
+    const bool add = node_id >= 0;
+    detail::BodyWriter writer(body, format);
+    writer.beginObject(add ? (index >= 0 ? 4 : 3) : 2);
+    if (add) {
+        writer.key("id", 2);
+        writer.value(static_cast<int64_t>(node_id));
+    }
+    writer.key("value", 5);
+    bool complete = writer.value(value);
+    if (complete) {
+        writer.key("metadata", 8);
+        writer.beginObject(metadata.size());
+        for (auto it = metadata.begin(); complete && it != metadata.end(); ++it) {
+            writer.key(it->first);
+            complete = writer.value(it->second);
+        }
+    }
+    if (complete) {
+        writer.endObject();
+        if (add && index >= 0) {
+            writer.key("index", 5);
+            writer.value(static_cast<int64_t>(index));
+        }
+        writer.endObject();
+        return;
+    }
+
+    // Nested deeper than the writer tracks; the partial body is thrown away
+    json data = {{"value", value}, {"metadata", metadata}};
+    if (add) {
+        data["id"] = node_id;
+    }
+    if (add && index >= 0) {
+        data["index"] = index;
+    }
+    body = encodeBody(data, format);
+}
+
+json VisualizerClient::parseBody(const std::string& body) const {
+    // Errors raised before the server's format middleware runs (and servers
+    // without it) still answer in JSON
+    if (!body.empty() && (body[0] == '{' || body[0] == '[')) {
+        return json::parse(body);
+    }
+    switch (wire_format_.load()) {
+        case WireFormat::MessagePack:
+            return json::from_msgpack(body);
+        case WireFormat::Cbor:
+            return json::from_cbor(body);
+        case WireFormat::Json:
+            break;
+    }
+    return json::parse(body);
+}
+
+struct curl_slist* VisualizerClient::formatHeaders(WireFormat format, const char* content_type) {
+    // content_type overrides the format's own, for raw binary bodies
+    struct curl_slist* headers = nullptr;
+    switch (format) {
+        case WireFormat::MessagePack:
+            headers = curl_slist_append(headers, content_type ? content_type : "Content-Type: application/msgpack");
+            headers = curl_slist_append(headers, "Accept: application/msgpack");
+            break;
+        case WireFormat::Cbor:
+            headers = curl_slist_append(headers, content_type ? content_type : "Content-Type: application/cbor");
+            headers = curl_slist_append(headers, "Accept: application/cbor");
+            break;
+        case WireFormat::Json:
+            headers = curl_slist_append(headers, content_type ? content_type : "Content-Type: application/json");
+            break;
+    }
+    return headers;
 }
 
 size_t VisualizerClient::WriteCallback(void* contents, size_t size, size_t nmemb, std::string* data) {
@@ -189,8 +4053,9 @@ size_t VisualizerClient::WriteCallback(void* contents, size_t size, size_t nmemb
 }
 
 void VisualizerClient::logError(const std::string& message) {
-    if (verbose_) {
-        std::cerr << "[VisualizerClient] " << message << std::endl;
+    if (verbose_.load()) {
+        // One write per line so messages from concurrent threads don't interleave
+        std::cerr << ("[VisualizerClient] " + message + "\n") << std::flush;
     }
 }
 
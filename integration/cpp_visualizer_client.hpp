@@ -5,6 +5,20 @@
 #include <map>
 #include <memory>
 #include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <tuple>
+#include <bitset>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
 
@@ -12,17 +26,597 @@ namespace cpp_visualizer {
 
 using json = nlohmann::json;
 
+/**
+ * A mutation queued while a batch is open
+ */
+struct BatchOp {
+    // Drop is a Remove that skips a node ID the structure does not have
+    enum class Kind { Add, Remove, Update, Drop };
+
+    Kind kind;
+    std::string structure_name;
+    int node_id = -1;
+    int index = -1;
+    json value;
+    std::map<std::string, json> metadata;
+    bool mirrored = false;   // already applied to the local mirror, see enableMirror()
+};
+
+/**
+ * A structure made by createStructure(): its name and the numeric ID the
+ * server gave it. id is -1 while recording, when there is no server to ask.
+ * Converts to false if creation failed.
+ */
+struct StructureHandle {
+    int id = -1;
+    std::string name;
+
+    explicit operator bool() const { return !name.empty(); }
+};
+
+/**
+ * Nodes that changed between two processing stages
+ */
+struct StageDiff {
+    std::vector<int> dropped;   // active at the first stage, not the second
+    std::vector<int> added;     // active at the second stage, not the first
+};
+
+/**
+ * Settings for streamStructure() and streamAllStructures()
+ */
+struct StreamOptions {
+    bool skip_metadata = false;   // nodes arrive without their metadata
+};
+
+/**
+ * Receives one streamed node; returning false stops the transfer
+ */
+using NodeCallback = std::function<bool(const std::string& structure_name, const json& node)>;
+
+/**
+ * What an async enqueue does when the op queue is full
+ */
+enum class OverflowPolicy {
+    Drop,   // discard the op and count it in droppedOps()
+    Block   // wait for the sender thread to make room
+};
+
+/**
+ * How the async sender talks to the server
+ */
+enum class SenderTransport {
+    Sequential,   // one blocking request at a time
+    Multiplexed   // curl_multi with many requests in flight (HTTP/2 streams for h2c:// URLs)
+};
+
+/**
+ * Encoding of request and response bodies
+ */
+enum class WireFormat {
+    Json,
+    MessagePack,  // application/msgpack
+    Cbor          // application/cbor
+};
+
+/**
+ * Content-Encoding for large request bodies
+ */
+enum class Compression {
+    Gzip,
+    Zstd          // needs VISUALIZER_WITH_ZSTD and libzstd at build time
+};
+
+/**
+ * Settings for request body compression
+ */
+struct CompressionOptions {
+    Compression algorithm = Compression::Gzip;
+    size_t min_bytes = 2048;                    // smaller bodies always go out as-is
+    int level = 0;                              // 0 = fastest level of the algorithm
+};
+
+/**
+ * Settings for the background sender used in async mode
+ */
+struct AsyncOptions {
+    size_t queue_capacity = 65536;              // rounded up to a power of two
+    OverflowPolicy overflow = OverflowPolicy::Block;
+    size_t max_ops_per_request = 1024;          // upper bound on coalesced ops per batch request
+    SenderTransport transport = SenderTransport::Sequential;
+    size_t max_in_flight = 64;                  // multiplexed: concurrent requests across structures
+    long max_connections = 4;                   // multiplexed: connections to the host (1 suffices for HTTP/2)
+};
+
+/**
+ * Settings for merging repeated updates to the same node
+ */
+struct CoalesceOptions {
+    std::chrono::milliseconds window{20};       // how long an update waits for later ones to merge into it
+    double max_ops_per_second = 0;              // per-structure token bucket for updates; 0 = unlimited
+    double burst = 0;                           // bucket size; 0 = one second's worth
+};
+
+/**
+ * Settings for the shared-memory op ring used for same-host instrumentation
+ */
+struct SharedMemoryOptions {
+    std::string name;                           // shm_open name; empty picks "/cpp-visualizer-<pid>-<n>"
+    size_t capacity = 65536;                    // 64-byte slots, rounded up to a power of two
+    OverflowPolicy overflow = OverflowPolicy::Drop;
+};
+
+/**
+ * Settings for the circuit breaker that stops requests to an unreachable
+ * visualizer
+ */
+struct CircuitBreakerOptions {
+    bool enabled = true;
+    int failure_threshold = 3;                  // consecutive transport failures that open the breaker
+    std::chrono::milliseconds probe_interval{1000};  // how often an open breaker checks /api/live/health
+    std::chrono::milliseconds probe_timeout{500};    // time budget for one health check
+};
+
+/**
+ * Log-linear latency histogram in the style of HdrHistogram. Values below
+ * 64 ns are counted exactly; above that every power of two is split into
+ * 32 buckets, so a percentile is within about 3% of the true value. Values
+ * past 2^40 ns (about 18 minutes) land in the last bucket.
+ */
+class LatencyHistogram {
+public:
+    void record(uint64_t nanoseconds);
+    void merge(const LatencyHistogram& other);
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ > 0 ? static_cast<double>(sum_) / count_ : 0.0; }
+
+    /**
+     * Value at percentile p (0-100), in nanoseconds; 0 when empty
+     */
+    uint64_t percentile(double p) const;
+
+private:
+    static const int kLinear = 64;
+    static const int kSubBuckets = 32;
+    static const int kMaxExponent = 40;
+    static const int kBuckets = kLinear + (kMaxExponent - 6) * kSubBuckets;
+
+    static int bucketOf(uint64_t value);
+    static uint64_t bucketValue(int bucket);
+
+    uint64_t counts_[kBuckets] = {};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
+
+/**
+ * Traffic for one endpoint, or for all of them
+ */
+struct EndpointStats {
+    uint64_t calls = 0;
+    uint64_t errors = 0;                        // transport failures and non-2xx responses
+    uint64_t bytes_sent = 0;                    // request bodies
+    uint64_t bytes_received = 0;                // response bodies
+    LatencyHistogram latency;                   // wall time per request
+};
+
+/**
+ * Snapshot of the client's transport statistics
+ */
+struct ClientStats {
+    // Keyed by method and route, e.g. "POST /api/live/structures/:id/batch"
+    std::map<std::string, EndpointStats> endpoints;
+    EndpointStats total;
+    uint64_t dropped_ops = 0;
+    uint64_t coalesced_ops = 0;
+    uint64_t short_circuited = 0;               // calls failed fast by the open circuit breaker
+
+    /**
+     * One line per endpoint: calls, errors, bytes and p50/p99/p999/max
+     */
+    std::string format() const;
+};
+
+namespace detail {
+
+class ShmRing;
+class NodeStream;
+
+/**
+ * Append the MessagePack array [value, metadata] that carries an add or
+ * update in the shared-memory ring and in trace files
+ */
+void appendOpPayload(std::string& out, const json& value, const std::map<std::string, json>& metadata);
+
+/**
+ * One numeric field of a registered record layout
+ */
+struct LayoutField {
+    enum class Kind : uint8_t { Bool, Signed, Unsigned, Float };
+
+    std::string name;
+    size_t offset;
+    Kind kind;
+    uint8_t size;
+    bool metadata;                              // written to the node's metadata instead of its value
+};
+
+template <typename F>
+constexpr LayoutField::Kind layoutKind() {
+    static_assert(std::is_arithmetic<F>::value, "layout fields must be numbers or bools");
+    static_assert(sizeof(F) <= 8, "layout fields are at most 64 bits wide");
+    return std::is_same<F, bool>::value ? LayoutField::Kind::Bool
+         : std::is_floating_point<F>::value ? LayoutField::Kind::Float
+         : std::is_signed<F>::value ? LayoutField::Kind::Signed
+         : LayoutField::Kind::Unsigned;
+}
+
+/**
+ * The layout registered for T, empty until registerNodeLayout<T>()
+ */
+template <typename T>
+std::vector<LayoutField>& registeredLayout() {
+    static std::vector<LayoutField> fields;
+    return fields;
+}
+
+/**
+ * Writes a request body in any of the wire formats without building a json
+ * value first. The binary formats need container sizes up front, and
+ * nesting is limited to kMaxDepth levels. Nothing is allocated beyond the
+ * growth of the output string, so a reused buffer costs nothing once warm.
+ */
+class BodyWriter {
+public:
+    static const int kMaxDepth = 16;
+
+    BodyWriter(std::string& out, WireFormat format)
+        : out_(out), format_(format), depth_(0), skipped_(0), after_key_(false), overflowed_(false) {}
+
+    void beginObject(size_t size);
+    void beginArray(size_t size);
+    void endObject();
+    void endArray();
+
+    void key(const char* name, size_t length);
+    void key(const std::string& name) { key(name.data(), name.size()); }
+
+    void value(const char* text, size_t length);
+    void value(const std::string& text) { value(text.data(), text.size()); }
+    void value(bool flag);
+    void value(int64_t number);
+    void value(uint64_t number);
+    void value(double number);
+    void null();
+
+    /**
+     * Write a json value; false if it nests deeper than the writer can
+     * track, in which case the output is incomplete
+     */
+    bool value(const json& value);
+
+    /**
+     * Whether a container was refused for nesting deeper than kMaxDepth (or
+     * a close had nothing open); the output is incomplete once this is set
+     */
+    bool overflowed() const { return overflowed_; }
+
+private:
+    void open(size_t size, char bracket, uint8_t msgpack_fix, uint8_t msgpack_marker16, uint8_t cbor_major);
+    void close(char bracket);
+    void element();
+    void string(const char* text, size_t length);
+    template <typename Number>
+    void appendChars(Number number);
+
+    std::string& out_;
+    WireFormat format_;
+    bool first_[kMaxDepth];
+    int depth_;
+    int skipped_;   // containers refused past kMaxDepth and not yet closed
+    bool after_key_;
+    bool overflowed_;
+};
+
+/**
+ * Type-erased writers for one record, used by the single-node and bulk add
+ * paths. Each writes a map; a null metadata writer means no metadata.
+ */
+struct RecordCodec {
+    using WriteFn = void (*)(BodyWriter& writer, const void* record, const void* context);
+
+    WriteFn value;
+    WriteFn metadata;
+    const void* context;
+};
+
+/**
+ * One member named in VIZ_REFLECT
+ */
+template <typename T, typename F>
+struct ReflectedField {
+    const char* name;
+    size_t name_length;
+    F T::*member;
+};
+
+template <typename T, typename F, size_t N>
+constexpr ReflectedField<T, F> reflectField(const char (&name)[N], F T::*member) {
+    return {name, N - 1, member};
+}
+
+/**
+ * Whether VIZ_REFLECT was used for T. The field tuple comes from the
+ * vizReflectFields() overload the macro defines, found by argument-dependent
+ * lookup in T's namespace.
+ */
+template <typename T, typename = void>
+struct IsReflected : std::false_type {};
+
+template <typename T>
+struct IsReflected<T, decltype((void)vizReflectFields(static_cast<const T*>(nullptr)))> : std::true_type {};
+
+template <typename T>
+void writeReflected(BodyWriter& writer, const T& record);
+
+inline void writeReflectedValue(BodyWriter& writer, const std::string& value) {
+    writer.value(value);
+}
+
+template <typename V>
+void writeReflectedValue(BodyWriter& writer, const V& value) {
+    if constexpr (std::is_same<V, bool>::value) {
+        writer.value(value);
+    } else if constexpr (std::is_floating_point<V>::value) {
+        writer.value(static_cast<double>(value));
+    } else if constexpr (std::is_integral<V>::value && std::is_signed<V>::value) {
+        writer.value(static_cast<int64_t>(value));
+    } else if constexpr (std::is_integral<V>::value) {
+        writer.value(static_cast<uint64_t>(value));
+    } else if constexpr (std::is_enum<V>::value) {
+        writeReflectedValue(writer, static_cast<std::underlying_type_t<V>>(value));
+    } else if constexpr (std::is_array<V>::value) {
+        writer.beginArray(std::extent<V>::value);
+        for (const auto& element : value) {
+            writeReflectedValue(writer, element);
+        }
+        writer.endArray();
+    } else {
+        static_assert(IsReflected<V>::value,
+                      "VIZ_REFLECT fields must be numbers, bools, enums, strings, arrays or reflected structs");
+        writeReflected(writer, value);
+    }
+}
+
+/**
+ * Write a reflected struct as a map of its fields, unrolled at compile time
+ */
+template <typename T>
+void writeReflected(BodyWriter& writer, const T& record) {
+    constexpr auto fields = vizReflectFields(static_cast<const T*>(nullptr));
+    writer.beginObject(std::tuple_size<std::remove_const_t<decltype(fields)>>::value);
+    std::apply([&](const auto&... field) {
+        ((writer.key(field.name, field.name_length), writeReflectedValue(writer, record.*(field.member))), ...);
+    }, fields);
+    writer.endObject();
+}
+
+template <typename T>
+void writeReflectedRecord(BodyWriter& writer, const void* record, const void*) {
+    writeReflected(writer, *static_cast<const T*>(record));
+}
+
+template <typename T>
+constexpr RecordCodec reflectedCodec() {
+    return {&writeReflectedRecord<T>, nullptr, nullptr};
+}
+
+/**
+ * A drop mask as bytes: element i at bit i % 8 of byte i / 8
+ */
+template <typename Mask>
+std::vector<uint8_t> packMask(const Mask& mask) {
+    std::vector<uint8_t> bits((mask.size() + 7) / 8, 0);
+    for (size_t i = 0; i < mask.size(); ++i) {
+        if (mask[i]) {
+            bits[i / 8] |= static_cast<uint8_t>(1u << (i % 8));
+        }
+    }
+    return bits;
+}
+
+/**
+ * Bounded lock-free multi-producer queue (Vyukov's sequence-stamped ring).
+ * Producers claim a slot with one CAS; the single consumer never blocks them.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity)
+        : mask_(roundUp(capacity) - 1), cells_(new Cell[mask_ + 1]) {
+        for (size_t i = 0; i <= mask_; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        enqueue_pos_.store(0, std::memory_order_relaxed);
+        dequeue_pos_.store(0, std::memory_order_relaxed);
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    bool tryPush(T&& item) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[pos & mask_];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = std::move(item);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // full
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Push every item or none of them. The whole run of slots is claimed
+     * with one CAS, so no other producer's item lands inside it.
+     */
+    bool tryPushAll(std::vector<T>& items) {
+        const size_t count = items.size();
+        if (count > mask_ + 1) {
+            return false;
+        }
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            bool stale = false;
+            for (size_t i = 0; i < count; ++i) {
+                size_t seq = cells_[(pos + i) & mask_].sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + i);
+                if (diff < 0) {
+                    return false;  // not enough room
+                }
+                if (diff > 0) {
+                    stale = true;
+                    break;
+                }
+            }
+            if (stale) {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+                continue;
+            }
+            // Free slots stay free until someone claims them, and that
+            // needs enqueue_pos_ to move first
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                for (size_t i = 0; i < count; ++i) {
+                    Cell& cell = cells_[(pos + i) & mask_];
+                    cell.data = std::move(items[i]);
+                    cell.sequence.store(pos + i + 1, std::memory_order_release);
+                }
+                return true;
+            }
+        }
+    }
+
+    bool tryPop(T& item) {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell& cell = cells_[pos & mask_];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1) < 0) {
+            return false;  // empty
+        }
+        dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+        item = std::move(cell.data);
+        cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    static size_t roundUp(size_t n) {
+        size_t p = 2;
+        while (p < n) p <<= 1;
+        return p;
+    }
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> enqueue_pos_;
+    alignas(64) std::atomic<size_t> dequeue_pos_;
+};
+
+} // namespace detail
+
+/**
+ * Field layout of a plain record type, used by addNodes() to write records
+ * straight into a request body:
+ *
+ *   registerNodeLayout(NodeLayout<RangeGate>()
+ *       .field("power", &RangeGate::power)
+ *       .field("velocity", &RangeGate::velocity)
+ *       .metadata("quality", &RangeGate::quality_flag));
+ */
+template <typename T>
+class NodeLayout {
+    static_assert(std::is_standard_layout<T>::value && std::is_trivially_copyable<T>::value,
+                  "addNodes() reads records by field offset, so they must be plain structs");
+
+public:
+    /** Map a member to a key of the node value */
+    template <typename F>
+    NodeLayout& field(const std::string& name, F T::*member) { return add(name, member, false); }
+
+    /** Map a member to a key of the node metadata */
+    template <typename F>
+    NodeLayout& metadata(const std::string& name, F T::*member) { return add(name, member, true); }
+
+    const std::vector<detail::LayoutField>& fields() const { return fields_; }
+
+private:
+    template <typename F>
+    NodeLayout& add(const std::string& name, F T::*member, bool metadata) {
+        alignas(T) unsigned char probe[sizeof(T)];
+        const T* record = reinterpret_cast<const T*>(probe);
+        size_t offset = reinterpret_cast<const unsigned char*>(&(record->*member)) - probe;
+        fields_.push_back({name, offset, detail::layoutKind<F>(), static_cast<uint8_t>(sizeof(F)), metadata});
+        return *this;
+    }
+
+    std::vector<detail::LayoutField> fields_;
+};
+
+/**
+ * Register the layout addNodes() uses for T. Register each type once,
+ * before any thread adds records of it.
+ */
+template <typename T>
+void registerNodeLayout(const NodeLayout<T>& layout) {
+    detail::registeredLayout<T>() = layout.fields();
+}
+
+class TraceWriter;
+
 /**
  * C++ Client Library for Live Data Structure Visualization
  * 
  * This library allows C++ applications to create and manipulate
  * data structures in the visualizer in real-time.
+ *
+ * All structure and node calls are thread-safe, so one client can be shared
+ * by the workers of an OpenMP loop. Each request leases its own CURL handle
+ * from a pool, so concurrent callers only contend for the moment it takes to
+ * take a handle out and put it back. enableAsync()/disableAsync(),
+ * enableSharedMemory()/disableSharedMemory(),
+ * enableCoalescing()/disableCoalescing() and
+ * startRecording()/stopRecording() must not race with other calls.
  */
 class VisualizerClient {
 public:
+    // Instrumentation through this client is live (see NullTransport)
+    static constexpr bool enabled = true;
+
     /**
      * Initialize the client with visualizer URL
-     * @param base_url URL of the visualizer service (default: http://localhost:5000)
+     * @param base_url URL of the visualizer service (default: http://localhost:5000).
+     *        An h2c://host:port URL speaks cleartext HTTP/2 with prior
+     *        knowledge, matching the server's H2C_PORT listener. A
+     *        unix:///path/to.sock URL talks to the server's LIVE_SOCKET_PATH
+     *        listener over a Unix domain socket instead of TCP.
      */
     explicit VisualizerClient(const std::string& base_url = "http://localhost:5000");
     
@@ -34,15 +628,19 @@ public:
      * @param type Type: "linked_list", "array", "tree", "graph"
      * @param depth Nesting depth for complex structures
      * @param initial_size Initial number of nodes to allocate
-     * @return true if successful
+     * @return Handle of the new structure, false if failed. Later calls
+     *         for the name go to routes addressed by the handle's ID, so the
+     *         name is never escaped or looked up by the server again.
      */
-    bool createStructure(const std::string& name, 
+    StructureHandle createStructure(const std::string& name, 
                         const std::string& type = "linked_list",
                         int depth = 1, 
                         int initial_size = 0);
 
     /**
-     * Add a node to the structure
+     * Add a node to the structure. Node IDs come from a range reserved from
+     * the server ahead of time, so in batch and async mode the ID is known
+     * immediately; a reservation round trip only happens once per block.
      * @param structure_name Name of the structure
      * @param value Node value (any JSON-serializable type)
      * @param index Optional position to insert at
@@ -54,6 +652,14 @@ public:
                 int index = -1,
                 const std::map<std::string, json>& metadata = {});
 
+    /**
+     * The per-structure calls below each also take the handle from
+     * createStructure(). Its ID picks the route directly, where a name is
+     * first looked up among the IDs this client has seen.
+     */
+    int addNode(const StructureHandle& structure, const json& value, int index = -1,
+                const std::map<std::string, json>& metadata = {});
+
     /**
      * Remove a node from the structure (marks as dropped)
      * @param structure_name Name of the structure
@@ -61,6 +667,59 @@ public:
      * @return true if successful
      */
     bool removeNode(const std::string& structure_name, int node_id);
+    bool removeNode(const StructureHandle& structure, int node_id);
+
+    /**
+     * Mark every node selected by a bitmask as dropped, in one request. Bit i
+     * selects node first_id + i, least significant bit first within each
+     * byte. The server handles the whole mask in one pass and relinks once,
+     * where one removeNode() per node relinks every time. Batches, async
+     * mode, shared memory and recording get one drop op per set bit, which
+     * like the mask skips IDs the structure does not have. They are queued
+     * together: if the queue or ring has no room for all of them, none is
+     * queued and -1 is returned.
+     * @return number of nodes dropped (in buffered modes, of drop ops
+     *         queued), -1 if failed
+     */
+    int applyDropMask(const std::string& structure_name, const uint8_t* bits, size_t bit_count, int first_id = 0);
+    int applyDropMask(const StructureHandle& structure, const uint8_t* bits, size_t bit_count, int first_id = 0);
+
+    int applyDropMask(const std::string& structure_name, const std::vector<bool>& mask, int first_id = 0);
+    int applyDropMask(const StructureHandle& structure, const std::vector<bool>& mask, int first_id = 0);
+
+    template <size_t N>
+    int applyDropMask(const std::string& structure_name, const std::bitset<N>& mask, int first_id = 0) {
+        std::vector<uint8_t> bits = detail::packMask(mask);
+        return applyDropMask(structure_name, bits.data(), N, first_id);
+    }
+
+    template <size_t N>
+    int applyDropMask(const StructureHandle& structure, const std::bitset<N>& mask, int first_id = 0) {
+        std::vector<uint8_t> bits = detail::packMask(mask);
+        return applyDropMask(structure, bits.data(), N, first_id);
+    }
+
+    /**
+     * Close a processing stage. The server snapshots which nodes are active
+     * as a bitset under the stage name; marking a name again replaces its
+     * snapshot. Ops sent before the call are flushed first, so they are
+     * included. Not available inside a batch.
+     * @return true if successful
+     */
+    bool markStage(const std::string& structure_name, const std::string& stage);
+    bool markStage(const StructureHandle& structure, const std::string& stage);
+
+    /**
+     * IDs of the nodes that were active when a stage was marked
+     */
+    std::vector<int> getStageNodes(const std::string& structure_name, const std::string& stage);
+    std::vector<int> getStageNodes(const StructureHandle& structure, const std::string& stage);
+
+    /**
+     * Nodes dropped and added between two marked stages
+     */
+    StageDiff diffStages(const std::string& structure_name, const std::string& from, const std::string& to);
+    StageDiff diffStages(const StructureHandle& structure, const std::string& from, const std::string& to);
 
     /**
      * Update a node's value and metadata
@@ -74,13 +733,46 @@ public:
                    int node_id, 
                    const json& value,
                    const std::map<std::string, json>& metadata = {});
+    bool updateNode(const StructureHandle& structure, int node_id, const json& value,
+                    const std::map<std::string, json>& metadata = {});
 
     /**
-     * Get current structure information
+     * Add a struct described by VIZ_REFLECT as the node value. Blocking and
+     * shared-memory mode write it straight into a per-thread buffer that is
+     * reused across calls; other modes, and any mode while the mirror is
+     * on, go through a json value.
+     * @return Node ID, or -1 on failure
+     */
+    template <typename T, typename = std::enable_if_t<detail::IsReflected<T>::value>>
+    int addNode(const std::string& structure_name, const T& record, int index = -1) {
+        return writeRecordNode(BatchOp::Kind::Add, structure_name, -1, index, detail::reflectedCodec<T>(), &record);
+    }
+
+    /**
+     * Replace a node value with a struct described by VIZ_REFLECT
+     */
+    template <typename T, typename = std::enable_if_t<detail::IsReflected<T>::value>>
+    bool updateNode(const std::string& structure_name, int node_id, const T& record) {
+        return writeRecordNode(BatchOp::Kind::Update, structure_name, node_id, -1,
+                               detail::reflectedCodec<T>(), &record) >= 0;
+    }
+
+    /**
+     * Get current structure information. With the structure cache enabled
+     * only what changed since the last call is transferred.
      * @param structure_name Name of the structure
      * @return JSON representation of the structure
      */
     json getStructure(const std::string& structure_name);
+    json getStructure(const StructureHandle& structure);
+
+    /**
+     * getStructure() without the copy. A current cached or mirrored copy is
+     * shared as it is; later changes go to a new copy, never to this one.
+     * @return The structure, null if failed
+     */
+    std::shared_ptr<const json> getStructureSnapshot(const std::string& structure_name);
+    std::shared_ptr<const json> getStructureSnapshot(const StructureHandle& structure);
 
     /**
      * Get all structures
@@ -88,6 +780,26 @@ public:
      */
     std::vector<json> getAllStructures();
 
+    /**
+     * Fetch a structure without holding its node list: the reply is parsed
+     * as it arrives and each node is handed to on_node, so memory stays
+     * bounded by the largest node rather than the structure. Any nodes that
+     * come before the structure's "name" field are held until it arrives.
+     * @return The structure's other fields (name, version, ...), or null on
+     *         failure
+     */
+    json streamStructure(const std::string& structure_name, const NodeCallback& on_node,
+                         const StreamOptions& options = StreamOptions{});
+    json streamStructure(const StructureHandle& structure, const NodeCallback& on_node,
+                         const StreamOptions& options = StreamOptions{});
+
+    /**
+     * streamStructure() for every structure
+     * @return The structures' other fields
+     */
+    std::vector<json> streamAllStructures(const NodeCallback& on_node,
+                                          const StreamOptions& options = StreamOptions{});
+
     /**
      * Get current matrix visualization
      * @return JSON representation of the matrix
@@ -102,86 +814,933 @@ public:
     bool deleteStructure(const std::string& structure_name);
 
     /**
-     * Check if the visualizer service is available
+     * Delete the structure a handle from createStructure() addresses
+     */
+    bool deleteStructure(const StructureHandle& structure);
+
+    /**
+     * Check if the visualizer service is available, using the small
+     * /api/live/health route. A successful check closes the circuit breaker.
      * @return true if service is reachable
      */
     bool isConnected();
 
+    /**
+     * Configure the circuit breaker. It is on by default. After
+     * failure_threshold consecutive transport failures (connection refused,
+     * timeouts; HTTP error responses do not count), every call that would
+     * reach the network fails at once without touching curl: mutations
+     * return -1/false and reads return empty values. A background thread
+     * checks /api/live/health every probe_interval and closes the breaker
+     * as soon as the visualizer answers.
+     */
+    void setCircuitBreaker(const CircuitBreakerOptions& options);
+
+    /**
+     * Check whether the breaker is open, i.e. calls are failing fast
+     */
+    bool isCircuitOpen() const { return breaker_open_.load(std::memory_order_relaxed); }
+
+    /**
+     * Start queuing mutations instead of sending them one by one.
+     * While a batch is open addNode returns the node's reserved ID and
+     * removeNode/updateNode return true; the server's results are reported
+     * by commitBatch().
+     * Calling beginBatch() on an open batch keeps queuing into it.
+     * Batches are per thread: only ops made on the calling thread are queued.
+     */
+    void beginBatch();
+
+    /**
+     * Send the calling thread's queued mutations and close its batch. Consecutive ops on the
+     * same structure go out as one request and are applied atomically.
+     * @return Node ID touched by each queued op, in queue order (-1 for ops
+     *         whose request failed)
+     */
+    std::vector<int> commitBatch();
+
+    /**
+     * Drop the calling thread's queued mutations and close its batch
+     */
+    void discardBatch();
+
+    /**
+     * Check whether the calling thread has an open batch
+     */
+    bool inBatch();
+
+    /**
+     * Switch mutations to async mode: addNode/removeNode/updateNode enqueue
+     * into a bounded lock-free queue and return immediately, and a background
+     * thread drains the queue into batch requests. addNode still returns
+     * the node's reserved ID. Unlike commitBatch(), queued ops are not
+     * applied as a unit: if the server refuses a request, its ops are sent
+     * again one at a time so only the bad ones are lost.
+     *
+     * With SenderTransport::Multiplexed the sender keeps up to
+     * max_in_flight requests outstanding on a curl_multi handle. Each
+     * structure has at most one request in flight, so ops on a structure
+     * still reach the server in order. If curl cannot create the multi
+     * handle, the sender falls back to sequential requests.
+     * @param options Queue size, overflow policy and coalescing limit
+     */
+    void enableAsync(const AsyncOptions& options = AsyncOptions{});
+
+    /**
+     * Flush outstanding ops, stop the sender thread and return to
+     * synchronous requests
+     */
+    void disableAsync();
+
+    /**
+     * Write mutations into a shared-memory ring that the visualizer tails
+     * instead of sending them over HTTP. Each op becomes one or more 64-byte
+     * records written without a syscall; structures are still created and
+     * read over HTTP. Only works when the server runs on the same host.
+     *
+     * The ring has a single producer, so calls from several threads are
+     * serialised by a mutex. A full ring drops the op (counted in
+     * droppedOps()) or, with OverflowPolicy::Block, waits for the server to
+     * catch up. Ops in a batch are written to the ring on commit, but the
+     * server does not apply them as a unit.
+     * @return false if the segment could not be created or the server could
+     *         not open it; mutations then keep using the previous transport
+     */
+    bool enableSharedMemory(const SharedMemoryOptions& options = SharedMemoryOptions{});
+
+    /**
+     * Wait for the server to drain the ring, detach it and remove the segment
+     */
+    void disableSharedMemory();
+
+    /**
+     * Check whether mutations are being written to the shared-memory ring
+     */
+    bool isSharedMemory() const { return shm_ring_ != nullptr; }
+
+    /**
+     * Block until every op enqueued before this call has been sent, or
+     * applied by the server in shared-memory mode.
+     * getStructure() and deleteStructure() flush implicitly.
+     */
+    void flush();
+
+    /**
+     * Check whether mutations are being sent by the background thread
+     */
+    bool isAsync() const { return async_queue_ != nullptr; }
+
+    /**
+     * Record mutations to a compact binary trace file instead of sending
+     * them, for runs where the visualizer is not available. Nothing touches
+     * the network while recording: node IDs are allocated locally, and
+     * getStructure()/getAllStructures()/getMatrix() return empty results.
+     * Load the trace into a server later with visualizer_replay.
+     * @return false if the file could not be opened
+     */
+    bool startRecording(const std::string& path);
+
+    /**
+     * Finish the trace file (last block, index) and go back to sending ops
+     * @return false if writing the trace failed
+     */
+    bool stopRecording();
+
+    /**
+     * Check whether mutations are being recorded to a trace file
+     */
+    bool isRecording() const { return recorder_ != nullptr; }
+
+    /**
+     * Append contiguous records of a type described by VIZ_REFLECT or
+     * registered with registerNodeLayout(). In blocking mode the records are written
+     * straight into one batch request body, without building json values;
+     * batches, async mode, shared memory, recording and the mirror get ops
+     * built from the layout.
+     * @return the new node IDs in record order, all -1 if the batch failed
+     */
+    template <typename T>
+    std::vector<int> addNodes(const std::string& structure_name, const T* records, size_t count) {
+        if constexpr (detail::IsReflected<T>::value) {
+            return addEncodedRecords(structure_name, detail::reflectedCodec<T>(), records, sizeof(T), count);
+        } else {
+            return addRecords(structure_name, detail::registeredLayout<T>(), records, sizeof(T), count);
+        }
+    }
+
+    template <typename T>
+    std::vector<int> addNodes(const std::string& structure_name, const std::vector<T>& records) {
+        return addNodes(structure_name, records.data(), records.size());
+    }
+
+#if __cplusplus >= 202002L
+    template <typename T, size_t Extent>
+    std::vector<int> addNodes(const std::string& structure_name, std::span<T, Extent> records) {
+        return addNodes(structure_name, records.data(), records.size());
+    }
+#endif
+
+    /**
+     * Send pre-built ops in batch requests, e.g. when replaying a trace.
+     * Adds carry a node ID reserved for the structure, or -1 to have the
+     * server number them; the server refuses IDs it never handed out, and
+     * IDs already in use. Ops are grouped into one request
+     * per structure, so order is kept within a structure but not across.
+     * @return the node ID each op touched, -1 where a batch was rejected
+     */
+    std::vector<int> applyOps(const std::vector<BatchOp>& ops);
+
+    /**
+     * Number of ops discarded because the async queue or shared-memory ring
+     * was full
+     */
+    uint64_t droppedOps() const { return dropped_ops_.load(std::memory_order_relaxed); }
+
+    /**
+     * Hold each updateNode() for up to options.window so that later updates
+     * to the same node merge into it: the last value wins and metadata keys
+     * are merged, which is what the server would end up with anyway. Due
+     * updates are sent per structure through the active transport, at most
+     * max_ops_per_second per structure; updates held back by the rate limit
+     * keep absorbing later ones. Adds and removes on a structure, flush()
+     * and the reads that flush send its held updates first.
+     */
+    void enableCoalescing(const CoalesceOptions& options = CoalesceOptions{});
+
+    /**
+     * Send any held updates and stop coalescing
+     */
+    void disableCoalescing();
+
+    /**
+     * Number of updates merged into an update that was already waiting, and
+     * so never sent on their own
+     */
+    uint64_t coalescedOps() const { return coalesced_ops_.load(std::memory_order_relaxed); }
+
+    /**
+     * Calls, errors, bytes and latency per endpoint since the client was
+     * created or resetStats() was last called. Every HTTP request is
+     * counted, including those sent by the async sender; shared-memory and
+     * recorded ops never reach the network and are not.
+     */
+    ClientStats stats() const;
+    void resetStats();
+
+    /**
+     * Write stats().format() every interval, to stderr or appended to a
+     * file, until disableStatsDump() or the client is destroyed
+     * @param path File to append to; empty for stderr
+     */
+    void enableStatsDump(std::chrono::milliseconds interval, const std::string& path = "");
+    void disableStatsDump();
+
+    /**
+     * Number of node IDs reserved from the server per round trip, at most
+     * kMaxIdBlockSize (the most the server hands out at once)
+     */
+    static constexpr int kMaxIdBlockSize = 65536;
+    void setIdBlockSize(int block_size) { id_block_size_.store(std::min(std::max(block_size, 1), kMaxIdBlockSize)); }
+
+    /**
+     * Encoding used for request and response bodies. The binary formats skip
+     * number-to-text conversion on both ends; JSON stays the default so the
+     * traffic is readable when debugging.
+     */
+    void setWireFormat(WireFormat format) { wire_format_.store(format); }
+    WireFormat wireFormat() const { return wire_format_.load(); }
+
+    /**
+     * Compress request bodies of at least the current threshold, and accept
+     * compressed responses (getStructure and getAllStructures reply
+     * compressed once they are large). The threshold starts at
+     * options.min_bytes and adapts: it doubles after a body that shrank by
+     * less than 10%, and falls back toward min_bytes after bodies that
+     * halved, so payloads that do not compress stop paying for it.
+     */
+    void enableCompression(const CompressionOptions& options = CompressionOptions{});
+    void disableCompression() { compression_enabled_.store(false); }
+    size_t compressionThreshold() const { return compression_threshold_.load(std::memory_order_relaxed); }
+
+    /**
+     * Ask mutation routes for an acknowledgement (node ID and structure
+     * version) instead of the whole updated structure. On by default; turn
+     * it off only when talking to a server that predates `?return=minimal`.
+     */
+    void setMinimalResponses(bool minimal) { minimal_responses_.store(minimal); }
+
+    /**
+     * Keep the last copy of every structure read with getStructure() and
+     * refresh it from the server's version: an unchanged structure costs a
+     * 304, a changed one only the nodes changed since the cached version.
+     * Off by default, since the cache holds a full copy of each structure.
+     */
+    void enableStructureCache() { structure_cache_enabled_.store(true); }
+    void disableStructureCache();
+
+    /**
+     * Mirror structures locally: every structure read with getStructure()
+     * is kept current from the server's change stream (GET
+     * /api/live/changes), and this client's addNode, updateNode and
+     * removeNode calls are applied to the copy as they are made, so later
+     * reads see them at once. Reading a mirrored structure is then a local
+     * copy, not a request. Turns the structure cache on.
+     *
+     * Other writes (records, masks, applyOps) and writes over shared memory
+     * reach the mirror through the stream. While the stream is down reads
+     * fall back to conditional fetches.
+     */
+    void enableMirror();
+    /** Stop the stream and drop the structure cache */
+    void disableMirror();
+    bool mirrorConnected() const { return mirror_connected_.load(); }
     /**
      * Enable/disable automatic error logging
      */
-    void setVerbose(bool verbose) { verbose_ = verbose; }
+    void setVerbose(bool verbose) { verbose_.store(verbose); }
 
 private:
     std::string base_url_;
-    CURL* curl_;
-    bool verbose_;
+    bool http2_prior_knowledge_;
+    std::string unix_socket_path_;
+    std::atomic<bool> verbose_;
+    std::atomic<WireFormat> wire_format_;
+    std::atomic<bool> minimal_responses_;
+
+    // Last snapshot of each structure read through the cache, with the row
+    // of each node ID so deltas merge without a scan
+    struct CachedStructure {
+        // Shared with readers of getStructureSnapshot(); changed only through
+        // writableStructure(), which copies it while a reader holds it
+        std::shared_ptr<json> structure;
+        std::unordered_map<int, size_t> rows;
+        std::string etag;
+        long long id = -1;
+        long long version = -1;
+
+        // Mirror only: nodes this client wrote that the server has not
+        // confirmed yet, and the server's copies of them, held back until
+        // it has. pending counts writes awaiting an answer; confirmed is the
+        // highest version they were answered with.
+        std::unordered_map<int, json> local;
+        std::unordered_map<int, json> shadow;
+        int pending = 0;
+        long long confirmed = 0;
+        bool stale = false;   // may have missed changes; fetched before it is served again
+    };
+    std::atomic<bool> structure_cache_enabled_;
+    std::mutex structure_cache_mutex_;
+    std::unordered_map<std::string, CachedStructure> structure_cache_;
+
+    // Server ID of each structure created here; its routes are addressed by
+    // number rather than by the escaped name. structure_names_ maps IDs back
+    // to names so a 404 for an ID another client replaced can be retried.
+    std::mutex structure_ids_mutex_;
+    std::unordered_map<std::string, int> structure_ids_;
+    std::unordered_map<int, std::string> structure_names_;
+
+    int structureId(const std::string& structure_name);
+    bool routeByName(const std::string& endpoint, std::string& route);
+    std::string structurePath(const std::string& structure_name);
+    static std::string structurePath(int structure_id, const std::string& structure_name);
+
+    // What the name and handle overloads share, given the structure's ID
+    // (-1 to address it by name)
+    int addNode(int structure_id, const std::string& structure_name, const json& value, int index,
+                const std::map<std::string, json>& metadata);
+    bool removeNode(int structure_id, const std::string& structure_name, int node_id);
+    bool deleteStructure(int structure_id, const std::string& structure_name);
+    bool updateNode(int structure_id, const std::string& structure_name, int node_id, const json& value,
+                    const std::map<std::string, json>& metadata);
+    int applyDropMask(int structure_id, const std::string& structure_name, const uint8_t* bits, size_t bit_count,
+                      int first_id);
+    bool markStage(int structure_id, const std::string& structure_name, const std::string& stage);
+    std::vector<int> getStageNodes(int structure_id, const std::string& structure_name, const std::string& stage);
+    StageDiff diffStages(int structure_id, const std::string& structure_name, const std::string& from,
+                         const std::string& to);
+    std::shared_ptr<const json> getStructureSnapshot(int structure_id, const std::string& structure_name);
+    json streamStructure(int structure_id, const std::string& structure_name, const NodeCallback& on_node,
+                         const StreamOptions& options);
+
+    std::shared_ptr<const json> getCachedStructure(int structure_id, const std::string& structure_name);
+    void forgetStructure(const std::string& structure_name);
+    void mergeStructure(CachedStructure& entry, json&& structure, std::string etag);
+    static void settleMirrored(CachedStructure& entry);
+    static json& writableStructure(CachedStructure& entry);
+
+    // Local mirror, fed by the change stream
+    std::atomic<bool> mirror_running_;
+    std::atomic<bool> mirror_connected_;
+    std::thread mirror_thread_;
+    std::mutex mirror_mutex_;
+    std::condition_variable mirror_wakeup_;
+
+    void mirrorLoop();
+    void applyMirrorEvent(const std::string& event, const std::string& data);
+    bool mirrorWrite(BatchOp::Kind kind, const std::string& structure_name, int node_id, int index,
+                     const json& value, const std::map<std::string, json>& metadata);
+    void mirrorAck(const std::string& structure_name, int count, long long version);
+    long long replyVersion(const std::string& reply) const;
+    void markMirrorStale();
+    // Request compression; the threshold adapts to how well bodies compress
+    std::atomic<bool> compression_enabled_;
+    std::atomic<Compression> compression_;
+    std::atomic<int> compression_level_;
+    std::atomic<size_t> compression_min_bytes_;
+    std::atomic<size_t> compression_threshold_;
+
+    // Header lists for every wire format and content encoding, built once
+    // and shared by all requests: [format][none, gzip, zstd]
+    struct curl_slist* request_headers_[3][3];
+
+    // Idle easy handles; a request leases one for its duration
+    std::mutex handle_mutex_;
+    std::vector<CURL*> idle_handles_;
+
+    // Open batches, one per thread
+    std::mutex batch_mutex_;
+    std::unordered_map<std::thread::id, std::vector<BatchOp>> batches_;
+    std::atomic<int> open_batches_;
+
+    bool queueBatchOp(BatchOp&& op);
+    // Queue ops in whichever buffered mode is active, all of them or none
+    bool queueAll(std::vector<BatchOp>& ops);
+
+    // Node IDs reserved from the server, per structure: [next, end)
+    struct IdRange {
+        int next = 0;
+        int end = 0;
+    };
+    std::mutex id_mutex_;
+    std::map<std::string, IdRange> id_ranges_;
+    std::atomic<int> id_block_size_;
+
+    int allocateNodeId(const std::string& structure_name);
+    void refusedNodeIds(const std::string& structure_name, long status);
+    static bool addsWithIds(const BatchOp* ops, size_t count);
+
+    // Async mode state
+    AsyncOptions async_options_;
+    std::unique_ptr<detail::BoundedQueue<BatchOp>> async_queue_;
+    std::thread sender_;
+    std::atomic<bool> sender_running_;
+    std::atomic<bool> sender_sleeping_;
+    std::atomic<uint64_t> enqueued_ops_;
+    std::atomic<uint64_t> sent_ops_;
+    std::atomic<uint64_t> dropped_ops_;
+    std::mutex sender_mutex_;
+    std::condition_variable sender_wakeup_;
+    std::condition_variable sent_cv_;
+
+    bool enqueue(BatchOp&& op);
+    bool enqueueAll(std::vector<BatchOp>& ops);
+    void senderLoop();
+    bool multiplexedSenderLoop();
+    void markSent(size_t count);
+    std::vector<int> sendOps(const std::vector<BatchOp>& ops, bool atomic = true);
+    static json batchPayload(const BatchOp* ops, size_t count);
+
+    // Outcome of one HTTP exchange; status is 0 when the transfer itself failed
+    struct HttpResponse {
+        long status = 0;
+        std::string body;
+        bool ok() const { return status >= 200 && status < 300; }
+    };
+
+    // Shared-memory transport. Structures are numbered on first use and the
+    // number is bound to the name by a define record.
+    std::mutex shm_mutex_;
+    std::unique_ptr<detail::ShmRing> shm_ring_;
+    std::unordered_map<std::string, uint32_t> shm_structures_;
+    std::string shm_scratch_;
+
+    bool shmWrite(BatchOp::Kind kind, const std::string& structure_name, int node_id, int index,
+                  const json& value, const std::map<std::string, json>& metadata);
+    bool shmWriteRecord(BatchOp::Kind kind, const std::string& structure_name, int node_id, int index,
+                        const detail::RecordCodec& codec, const void* record);
+    bool shmStructure(const std::string& structure_name, uint32_t& number);
+    bool shmWriteAll(const std::vector<BatchOp>& ops);
+
+    // Update coalescing: held updates per structure, keyed by node ID, and
+    // the structure's token bucket
+    struct HeldUpdate {
+        BatchOp op;
+        std::chrono::steady_clock::time_point due;
+    };
+    struct CoalesceLane {
+        std::unordered_map<int, HeldUpdate> pending;
+        double tokens = 0;
+        std::chrono::steady_clock::time_point refilled;
+    };
+    CoalesceOptions coalesce_options_;
+    std::mutex coalesce_mutex_;
+    std::mutex coalesce_send_mutex_;            // keeps flushes of held updates in order
+    std::condition_variable coalesce_wakeup_;
+    std::unordered_map<std::string, CoalesceLane> coalesce_lanes_;
+    std::thread coalescer_;
+    std::atomic<bool> coalescing_;
+    std::atomic<size_t> coalesce_pending_;
+    std::atomic<uint64_t> coalesced_ops_;
+
+    void coalesceUpdate(BatchOp&& op);
+    void flushCoalesced(const std::string* structure_name, bool force);
+    void coalescerLoop();
+    std::vector<int> dispatchOps(const std::vector<BatchOp>& ops, bool allow_async);
+
+    // Offline recording
+    std::unique_ptr<TraceWriter> recorder_;
+
+    std::vector<int> addRecords(const std::string& structure_name,
+                                const std::vector<detail::LayoutField>& fields,
+                                const void* records, size_t stride, size_t count);
+    std::vector<int> addEncodedRecords(const std::string& structure_name, const detail::RecordCodec& codec,
+                                       const void* records, size_t stride, size_t count);
+    int writeRecordNode(BatchOp::Kind kind, const std::string& structure_name, int node_id, int index,
+                        const detail::RecordCodec& codec, const void* record);
+
+    // Circuit breaker. The prober thread starts the first time the breaker
+    // opens and probes only while it is open.
+    std::mutex breaker_mutex_;
+    std::condition_variable breaker_wakeup_;
+    std::thread breaker_prober_;
+    CircuitBreakerOptions breaker_options_;
+    bool breaker_stopping_;
+    std::atomic<bool> breaker_enabled_;
+    std::atomic<bool> breaker_open_;
+    std::atomic<int> consecutive_failures_;
+    std::atomic<uint64_t> short_circuited_;
+
+    bool shortCircuit() {
+        if (!breaker_open_.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        short_circuited_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    void recordTransportResult(bool reached_server);
+    void openBreaker();
+    void closeBreaker();
+    bool probeHealth();
+    void breakerProbeLoop();
+
+    // Transport statistics, per endpoint key
+    mutable std::mutex stats_mutex_;
+    std::map<std::string, EndpointStats> endpoint_stats_;
+    std::mutex stats_dump_mutex_;
+    std::condition_variable stats_dump_wakeup_;
+    std::thread stats_dumper_;
+    bool stats_dump_running_;
+
+    void recordRequest(const std::string& method, const std::string& endpoint, bool ok,
+                       size_t bytes_sent, size_t bytes_received, std::chrono::steady_clock::duration elapsed);
+    void statsDumpLoop(std::chrono::milliseconds interval, std::string path);
 
     // HTTP helper methods
-    std::string makeRequest(const std::string& method, 
-                           const std::string& endpoint, 
-                           const json& data = json{});
+    HttpResponse makeRequest(const std::string& method, 
+                            const std::string& endpoint, 
+                            const json& data = json{});
+    HttpResponse performRequest(const std::string& method, const std::string& endpoint,
+                                const std::string& body, WireFormat format,
+                                const char* content_type = nullptr);
+    long sendRequest(const std::string& method, const std::string& endpoint, const std::string& body,
+                     WireFormat format, const char* content_type, std::string& response_body,
+                     detail::NodeStream* stream = nullptr, const char* extra_header = nullptr,
+                     std::string* etag = nullptr);
+    bool streamRequest(const std::string& endpoint, detail::NodeStream& stream, const std::string& what);
+    bool sendMutation(const char* method, const std::string& endpoint, const std::string& body,
+                      WireFormat format, const char* what, const std::string& structure_name,
+                      bool mirrored = false);
+    const char* mutationQuery() const;
+    void logFailure(const std::string& what, const HttpResponse& response);
+    std::string encodeBody(const json& data, WireFormat format) const;
+    void writeNodeBody(std::string& body, WireFormat format, int node_id, int index, const json& value,
+                       const std::map<std::string, json>& metadata) const;
+    const char* compressBody(const std::string& body, std::string& out);
+    void refuseEncoding(const char* encoding);
+    json parseBody(const std::string& body) const;
+    static struct curl_slist* formatHeaders(WireFormat format, const char* content_type = nullptr);
+    CURL* acquireHandle();
+    void releaseHandle(CURL* handle);
+    void configureHandle(CURL* handle);
     
     static size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* data);
     void logError(const std::string& message);
 };
 
+/**
+ * RAII guard that opens a batch and commits it when leaving scope
+ */
+class BatchGuard {
+public:
+    explicit BatchGuard(VisualizerClient& client)
+        : client_(client), owns_(!client.inBatch()), committed_(false) {
+        client_.beginBatch();
+    }
+
+    ~BatchGuard() {
+        if (owns_ && !committed_) {
+            client_.commitBatch();
+        }
+    }
+
+    BatchGuard(const BatchGuard&) = delete;
+    BatchGuard& operator=(const BatchGuard&) = delete;
+
+    /**
+     * Commit early to get at the node IDs. Only the guard that opened the
+     * batch commits it; nested guards return an empty vector.
+     */
+    std::vector<int> commit() {
+        if (!owns_ || committed_) {
+            return {};
+        }
+        committed_ = true;
+        return client_.commitBatch();
+    }
+
+private:
+    VisualizerClient& client_;
+    bool owns_;
+    bool committed_;
+};
+
 /**
  * RAII Wrapper for automatic structure lifecycle management
  */
 class ManagedStructure {
 public:
+    static constexpr bool enabled = true;
+
     ManagedStructure(VisualizerClient& client, 
                     const std::string& name,
                     const std::string& type = "linked_list",
                     int depth = 1)
         : client_(client), name_(name) {
-        client_.createStructure(name, type, depth);
+        handle_ = client_.createStructure(name, type, depth);
+        // A failed create (the name taken, say) leaves calls addressed by name
+        target_ = handle_ ? handle_ : StructureHandle{-1, name_};
     }
 
     ~ManagedStructure() {
-        client_.deleteStructure(name_);
+        client_.deleteStructure(target_);
     }
 
-    // Delegate methods to client
+    // Delegate methods to client, addressed by the handle's ID
     int addNode(const json& value, int index = -1, 
                 const std::map<std::string, json>& metadata = {}) {
-        return client_.addNode(name_, value, index, metadata);
+        return client_.addNode(target_, value, index, metadata);
     }
 
     bool removeNode(int node_id) {
-        return client_.removeNode(name_, node_id);
+        return client_.removeNode(target_, node_id);
+    }
+
+    template <typename Mask>
+    int applyDropMask(const Mask& mask, int first_id = 0) {
+        return client_.applyDropMask(target_, mask, first_id);
+    }
+
+    bool markStage(const std::string& stage) {
+        return client_.markStage(target_, stage);
+    }
+
+    std::vector<int> getStageNodes(const std::string& stage) {
+        return client_.getStageNodes(target_, stage);
+    }
+
+    StageDiff diffStages(const std::string& from, const std::string& to) {
+        return client_.diffStages(target_, from, to);
     }
 
     bool updateNode(int node_id, const json& value, 
                    const std::map<std::string, json>& metadata = {}) {
-        return client_.updateNode(name_, node_id, value, metadata);
+        return client_.updateNode(target_, node_id, value, metadata);
     }
 
     json getStructure() {
-        return client_.getStructure(name_);
+        return client_.getStructure(target_);
+    }
+
+    std::shared_ptr<const json> getStructureSnapshot() {
+        return client_.getStructureSnapshot(target_);
+    }
+
+    json streamStructure(const NodeCallback& on_node, const StreamOptions& options = StreamOptions{}) {
+        return client_.streamStructure(target_, on_node, options);
+    }
+
+    void beginBatch() {
+        client_.beginBatch();
+    }
+
+    std::vector<int> commitBatch() {
+        return client_.commitBatch();
     }
 
     const std::string& getName() const { return name_; }
+    const StructureHandle& handle() const { return handle_; }
 
 private:
     VisualizerClient& client_;
     std::string name_;
+    StructureHandle handle_;
+    StructureHandle target_;
+};
+
+/**
+ * Client policies for BasicVisualizerClient.
+ *
+ * A transport policy decides where ops go, a serializer policy picks the
+ * wire format and a threading policy decides whether mutations block the
+ * caller. NullTransport compiles instrumentation out altogether.
+ */
+struct HttpTransport {
+    static constexpr bool enabled = true;
+    static void attach(VisualizerClient&) {}
+};
+
+struct SharedMemoryTransport {
+    static constexpr bool enabled = true;
+    // Falls back to HTTP when the server is not on this host
+    static void attach(VisualizerClient& client) { client.enableSharedMemory(); }
+};
+
+struct NullTransport {
+    static constexpr bool enabled = false;
+};
+
+struct JsonSerializer {
+    static constexpr WireFormat format = WireFormat::Json;
+};
+
+struct MessagePackSerializer {
+    static constexpr WireFormat format = WireFormat::MessagePack;
+};
+
+struct CborSerializer {
+    static constexpr WireFormat format = WireFormat::Cbor;
+};
+
+struct BlockingThreading {
+    static void attach(VisualizerClient&) {}
+};
+
+struct AsyncThreading {
+    static void attach(VisualizerClient& client) { client.enableAsync(); }
+};
+
+/**
+ * Stand-in for VisualizerClient when instrumentation is compiled out.
+ *
+ * Every call is an empty inline function: mutations report success, reads
+ * return empty values, and nothing links against libcurl. Arguments to
+ * direct calls are still evaluated as usual; go through the VIZ_* macros to
+ * skip evaluating them too.
+ */
+class NullVisualizerClient {
+public:
+    static constexpr bool enabled = false;
+
+    template <typename... Args>
+    explicit NullVisualizerClient(Args&&...) {}
+
+    template <typename... Args>
+    StructureHandle createStructure(const std::string& name, Args&&...) { return {-1, name}; }
+    template <typename... Args> int addNode(Args&&...) { return 0; }
+    template <typename... Args> bool removeNode(Args&&...) { return true; }
+    template <typename... Args> int applyDropMask(Args&&...) { return 0; }
+    template <typename... Args> bool markStage(Args&&...) { return true; }
+    template <typename... Args> std::vector<int> getStageNodes(Args&&...) { return {}; }
+    template <typename... Args> StageDiff diffStages(Args&&...) { return {}; }
+    template <typename... Args> bool updateNode(Args&&...) { return true; }
+    template <typename... Args> bool deleteStructure(Args&&...) { return true; }
+    template <typename... Args> json getStructure(Args&&...) { return json(); }
+    template <typename... Args> std::shared_ptr<const json> getStructureSnapshot(Args&&...) { return nullptr; }
+    std::vector<json> getAllStructures() { return {}; }
+    template <typename... Args> json streamStructure(Args&&...) { return json(); }
+    template <typename... Args> std::vector<json> streamAllStructures(Args&&...) { return {}; }
+    json getMatrix() { return json(); }
+    bool isConnected() { return true; }
+    template <typename... Args> void setCircuitBreaker(Args&&...) {}
+    bool isCircuitOpen() const { return false; }
+
+    void beginBatch() {}
+    std::vector<int> commitBatch() { return {}; }
+    void discardBatch() {}
+    bool inBatch() { return false; }
+    template <typename... Args> std::vector<int> applyOps(Args&&...) { return {}; }
+    template <typename... Args> std::vector<int> addNodes(Args&&...) { return {}; }
+    void flush() {}
+
+    template <typename... Args> void enableAsync(Args&&...) {}
+    void disableAsync() {}
+    bool isAsync() const { return false; }
+    template <typename... Args> bool enableSharedMemory(Args&&...) { return true; }
+    void disableSharedMemory() {}
+    bool isSharedMemory() const { return false; }
+    template <typename... Args> void enableCoalescing(Args&&...) {}
+    void disableCoalescing() {}
+    template <typename... Args> bool startRecording(Args&&...) { return true; }
+    bool stopRecording() { return true; }
+    bool isRecording() const { return false; }
+
+    uint64_t droppedOps() const { return 0; }
+    uint64_t coalescedOps() const { return 0; }
+    ClientStats stats() const { return {}; }
+    void resetStats() {}
+    template <typename... Args> void enableStatsDump(Args&&...) {}
+    void disableStatsDump() {}
+    void setIdBlockSize(int) {}
+    void setWireFormat(WireFormat) {}
+    WireFormat wireFormat() const { return WireFormat::Json; }
+    void setMinimalResponses(bool) {}
+    template <typename... Args> void enableCompression(Args&&...) {}
+    void enableStructureCache() {}
+    void disableStructureCache() {}
+    void enableMirror() {}
+    void disableMirror() {}
+    bool mirrorConnected() const { return false; }
+    void disableCompression() {}
+    size_t compressionThreshold() const { return 0; }
+    void setVerbose(bool) {}
+};
+
+/**
+ * VisualizerClient configured at compile time.
+ *
+ * The policies are applied once, in the constructor, on top of the regular
+ * client:
+ *
+ *   using Viz = BasicVisualizerClient<SharedMemoryTransport, MessagePackSerializer>;
+ *
+ * With NullTransport the client is a NullVisualizerClient instead, so one
+ * alias switches instrumentation off for a whole build.
+ */
+template <typename Transport = HttpTransport,
+          typename Serializer = JsonSerializer,
+          typename Threading = BlockingThreading>
+class BasicVisualizerClient : public VisualizerClient {
+public:
+    explicit BasicVisualizerClient(const std::string& base_url = "http://localhost:5000")
+        : VisualizerClient(base_url) {
+        setWireFormat(Serializer::format);
+        Threading::attach(*this);
+        Transport::attach(*this);
+    }
+};
+
+template <typename Serializer, typename Threading>
+class BasicVisualizerClient<NullTransport, Serializer, Threading> : public NullVisualizerClient {
+public:
+    using NullVisualizerClient::NullVisualizerClient;
 };
 
 /**
- * Convenience macros for common operations
+ * ManagedStructure counterpart for NullVisualizerClient
  */
-#define VIZ_CREATE_STRUCTURE(client, name, type) \
-    ManagedStructure name(client, #name, type)
+class NullManagedStructure {
+public:
+    static constexpr bool enabled = false;
+
+    template <typename... Args>
+    explicit NullManagedStructure(Args&&...) {}
+
+    template <typename... Args> int addNode(Args&&...) { return 0; }
+    template <typename... Args> bool removeNode(Args&&...) { return true; }
+    template <typename... Args> int applyDropMask(Args&&...) { return 0; }
+    template <typename... Args> bool markStage(Args&&...) { return true; }
+    template <typename... Args> std::vector<int> getStageNodes(Args&&...) { return {}; }
+    template <typename... Args> StageDiff diffStages(Args&&...) { return {}; }
+    template <typename... Args> bool updateNode(Args&&...) { return true; }
+    json getStructure() { return json(); }
+    template <typename... Args> json streamStructure(Args&&...) { return json(); }
+    void beginBatch() {}
+    std::vector<int> commitBatch() { return {}; }
+
+    const std::string& getName() const {
+        static const std::string name;
+        return name;
+    }
+
+    const StructureHandle& handle() const {
+        static const StructureHandle handle;
+        return handle;
+    }
+};
+
+/**
+ * The managed structure type that goes with a client type
+ */
+template <typename Client>
+using ManagedStructureFor =
+    std::conditional_t<Client::enabled, ManagedStructure, NullManagedStructure>;
+
+/**
+ * Convenience macros for common operations.
+ *
+ * The instrumentation switch is a compile-time constant of the client or
+ * structure, and the call sits behind it in a conditional expression, so
+ * with NullTransport the argument expressions are never evaluated and the
+ * whole statement folds away. They still have to compile.
+ */
+#define VIZ_CREATE_STRUCTURE(client, name, structure_type) \
+    ::cpp_visualizer::ManagedStructureFor<std::decay_t<decltype(client)>> name( \
+        client, #name, std::decay_t<decltype(client)>::enabled ? (structure_type) : "")
 
 #define VIZ_ADD_NODE(structure, value) \
-    structure.addNode(value)
+    (std::decay_t<decltype(structure)>::enabled ? (structure).addNode(value) : 0)
 
 #define VIZ_REMOVE_NODE(structure, id) \
-    structure.removeNode(id)
+    (std::decay_t<decltype(structure)>::enabled ? (structure).removeNode(id) : true)
 
 #define VIZ_UPDATE_NODE(structure, id, value) \
-    structure.updateNode(id, value)
+    (std::decay_t<decltype(structure)>::enabled ? (structure).updateNode(id, value) : true)
+
+} // namespace cpp_visualizer
+
+/**
+ * Describe a struct's fields for addNode()/updateNode()/addNodes():
+ *
+ *   struct RangeGate { double power; double velocity; int quality_flag; };
+ *   VIZ_REFLECT(RangeGate, power, velocity, quality_flag)
+ *
+ * Use it at namespace scope, in the struct's own namespace. It defines a
+ * constexpr vizReflectFields() overload returning the field names and
+ * member pointers, from which a writer for the struct is generated. Up to
+ * 24 fields.
+ */
+#define VIZ_REFLECT(Type, ...) \
+    constexpr auto vizReflectFields(const Type*) { \
+        return std::make_tuple(VIZ_DETAIL_EXPAND(VIZ_DETAIL_CAT(VIZ_DETAIL_FIELDS_, VIZ_DETAIL_COUNT(__VA_ARGS__))(Type, __VA_ARGS__))); \
+    }
 
-} // namespace cpp_visualizer
\ No newline at end of file
+#define VIZ_DETAIL_EXPAND(x) x
+#define VIZ_DETAIL_CAT_(a, b) a##b
+#define VIZ_DETAIL_CAT(a, b) VIZ_DETAIL_CAT_(a, b)
+#define VIZ_DETAIL_FIELD(Type, field) ::cpp_visualizer::detail::reflectField(#field, &Type::field)
+#define VIZ_DETAIL_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, N, ...) N
+#define VIZ_DETAIL_COUNT(...) VIZ_DETAIL_EXPAND(VIZ_DETAIL_COUNT_(__VA_ARGS__, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define VIZ_DETAIL_FIELDS_1(Type, field) VIZ_DETAIL_FIELD(Type, field)
+#define VIZ_DETAIL_FIELDS_2(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_1(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_3(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_2(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_4(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_3(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_5(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_4(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_6(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_5(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_7(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_6(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_8(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_7(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_9(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_8(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_10(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_9(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_11(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_10(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_12(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_11(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_13(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_12(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_14(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_13(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_15(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_14(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_16(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_15(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_17(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_16(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_18(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_17(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_19(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_18(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_20(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_19(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_21(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_20(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_22(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_21(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_23(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_22(Type, __VA_ARGS__))
+#define VIZ_DETAIL_FIELDS_24(Type, field, ...) VIZ_DETAIL_FIELD(Type, field), VIZ_DETAIL_EXPAND(VIZ_DETAIL_FIELDS_23(Type, __VA_ARGS__))
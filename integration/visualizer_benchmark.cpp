@@ -0,0 +1,193 @@
+/**
+ * Throughput benchmark for the VisualizerClient transports.
+ *
+ * Usage: visualizer_benchmark [base_url] [ops] [structures]
+ *
+ * Pushes addNode ops spread round-robin over a number of structures through
+ * each transport and reports ops/second plus the p99 latency of the addNode
+ * call itself (the enqueue cost for async and shared-memory mode). The
+ * blocking path makes one request per op, so it runs a capped number of ops.
+ * Start the server with H2C_PORT=5001 and pass h2c://localhost:5001 to
+ * measure HTTP/2 multiplexing. The shared-memory run needs the server on
+ * the same host.
+ *
+ * The first run needs no server: it times a processing loop written with the
+ * VIZ_* macros against a NullTransport client next to the same loop with no
+ * instrumentation, and checks that the macro arguments were never evaluated.
+ *
+ * The check that warm blocking calls make no heap allocations lives in
+ * visualizer_client_test.cpp.
+ */
+#include "cpp_visualizer_client.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace cpp_visualizer;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::string structureName(const std::string& run, int index) {
+    return "bench_" + run + "_" + std::to_string(index);
+}
+
+void report(const std::string& label, int ops, Clock::duration elapsed, std::vector<Clock::duration>& latencies) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    auto p99 = latencies.begin() + static_cast<std::ptrdiff_t>(latencies.size() * 99 / 100);
+    std::nth_element(latencies.begin(), p99, latencies.end());
+    double p99_us = p99 == latencies.end() ? 0.0 : std::chrono::duration<double, std::micro>(*p99).count();
+    std::cout << std::left << std::setw(28) << label
+              << std::right << std::setw(10) << ops << " ops "
+              << std::setw(12) << std::fixed << std::setprecision(0) << ops / seconds << " ops/s "
+              << std::setw(10) << std::setprecision(2) << p99_us << " us p99 addNode"
+              << std::endl;
+}
+
+void runBenchmark(VisualizerClient& viz, const std::string& run, const std::string& label,
+                  int ops, int structures, const std::function<void()>& finish) {
+    for (int s = 0; s < structures; ++s) {
+        viz.createStructure(structureName(run, s), "array");
+    }
+
+    std::vector<std::string> names;
+    for (int s = 0; s < structures; ++s) {
+        names.push_back(structureName(run, s));
+    }
+    std::vector<Clock::duration> latencies(ops);
+
+    auto start = Clock::now();
+    for (int i = 0; i < ops; ++i) {
+        json value = {{"power", i * 0.5}, {"gate", i % 75}};
+        auto call = Clock::now();
+        viz.addNode(names[i % structures], value);
+        latencies[i] = Clock::now() - call;
+    }
+    finish();
+    report(label, ops, Clock::now() - start, latencies);
+
+    for (int s = 0; s < structures; ++s) {
+        viz.deleteStructure(structureName(run, s));
+    }
+}
+
+// Counts evaluations of the macro arguments in the disabled loop
+int evaluated_args = 0;
+
+json gateValue(int gate, double power) {
+    ++evaluated_args;
+    return {{"power", power}, {"gate", gate}};
+}
+
+double plainLoop(const std::vector<double>& samples) {
+    double total = 0;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        total += std::sqrt(samples[i]) * 0.5;
+    }
+    return total;
+}
+
+double disabledLoop(const std::vector<double>& samples) {
+    BasicVisualizerClient<NullTransport> viz;
+    VIZ_CREATE_STRUCTURE(viz, gates, "array");
+    double total = 0;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        double power = std::sqrt(samples[i]) * 0.5;
+        int id = VIZ_ADD_NODE(gates, gateValue(static_cast<int>(i % 75), power));
+        VIZ_UPDATE_NODE(gates, id, gateValue(static_cast<int>(i % 75), power * 2));
+        total += power;
+    }
+    return total;
+}
+
+// Best of several runs, in nanoseconds per sample
+double timeLoop(double (*loop)(const std::vector<double>&), const std::vector<double>& samples, double& result) {
+    double best = 0;
+    for (int run = 0; run < 7; ++run) {
+        auto start = Clock::now();
+        result = loop(samples);
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / samples.size();
+        if (run == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+void runDisabledBenchmark(int ops) {
+    std::vector<double> samples(static_cast<size_t>(std::max(ops, 1) * 10));
+    for (size_t i = 0; i < samples.size(); ++i) {
+        samples[i] = static_cast<double>(i % 4096);
+    }
+
+    double plain_result = 0;
+    double disabled_result = 0;
+    double plain_ns = timeLoop(plainLoop, samples, plain_result);
+    double disabled_ns = timeLoop(disabledLoop, samples, disabled_result);
+
+    std::cout << std::left << std::setw(28) << "uninstrumented loop"
+              << std::right << std::setw(10) << samples.size() << " ops "
+              << std::setw(12) << std::fixed << std::setprecision(3) << plain_ns << " ns/op" << std::endl;
+    std::cout << std::left << std::setw(28) << "NullTransport VIZ_* loop"
+              << std::right << std::setw(10) << samples.size() << " ops "
+              << std::setw(12) << std::fixed << std::setprecision(3) << disabled_ns << " ns/op"
+              << "  args evaluated: " << evaluated_args
+              << (plain_result == disabled_result ? "" : "  RESULT MISMATCH") << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string url = argc > 1 ? argv[1] : "http://localhost:5000";
+    int ops = argc > 2 ? std::atoi(argv[2]) : 100000;
+    int structures = argc > 3 ? std::max(1, std::atoi(argv[3])) : 16;
+
+    runDisabledBenchmark(ops);
+
+    {
+        VisualizerClient viz(url);
+        if (!viz.isConnected()) {
+            std::cerr << "Visualizer not reachable at " << url << std::endl;
+            return 1;
+        }
+
+        runBenchmark(viz, "blocking", "blocking makeRequest", std::min(ops, 2000), structures, [] {});
+    }
+
+    {
+        VisualizerClient viz(url);
+        AsyncOptions options;
+        options.transport = SenderTransport::Sequential;
+        viz.enableAsync(options);
+        runBenchmark(viz, "sequential", "async sequential", ops, structures, [&] { viz.flush(); });
+    }
+
+    {
+        VisualizerClient viz(url);
+        AsyncOptions options;
+        options.transport = SenderTransport::Multiplexed;
+        options.max_ops_per_request = 256;
+        viz.enableAsync(options);
+        runBenchmark(viz, "multiplexed", "async multiplexed", ops, structures, [&] { viz.flush(); });
+    }
+
+    {
+        VisualizerClient viz(url);
+        SharedMemoryOptions options;
+        options.overflow = OverflowPolicy::Block;
+        if (viz.enableSharedMemory(options)) {
+            runBenchmark(viz, "shm", "shared memory ring", ops, structures, [&] { viz.flush(); });
+        } else {
+            std::cout << "shared memory ring: not available (server on another host?)" << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,680 @@
+/**
+ * Checks for VisualizerClient that need a C++ build rather than the server's
+ * test suite.
+ *
+ * Usage: visualizer_client_test [base_url]
+ *
+ * The BodyWriter, streaming, encoding fallback, trace file and latency
+ * histogram checks need no server.
+ * With a visualizer running at base_url, a counting operator new also
+ * checks that warm blocking addNode/updateNode/removeNode calls make no
+ * heap allocations in the client (libcurl's own mallocs are not counted).
+ * The other server checks cover a value nested deeper than BodyWriter
+ * tracks, mirrored snapshots and records, batched drop masks, structures
+ * recreated by another client, and async ops the server refuses. Exits
+ * non-zero if any check fails.
+ */
+#include "cpp_visualizer_client.hpp"
+#include "visualizer_trace.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace cpp_visualizer;
+
+// Every operator new in the process, for the allocation checks
+std::atomic<size_t> heap_allocations{0};
+
+void* operator new(size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    std::cout << (ok ? "ok   " : "FAIL ") << what << std::endl;
+    failures += ok ? 0 : 1;
+}
+
+json nested(int depth) {
+    json value = 1;
+    for (int i = 0; i < depth; ++i) {
+        value = json::array({value});
+    }
+    return value;
+}
+
+void checkNesting() {
+    const int max = detail::BodyWriter::kMaxDepth;
+
+    std::string out;
+    detail::BodyWriter full(out, WireFormat::Json);
+    for (int i = 0; i < max; ++i) {
+        full.beginArray(1);
+    }
+    full.value(static_cast<int64_t>(1));
+    for (int i = 0; i < max; ++i) {
+        full.endArray();
+    }
+    check(!full.overflowed() && json::parse(out) == nested(max), "kMaxDepth levels are written");
+
+    // One level more must be refused, not written past the depth stack
+    for (WireFormat format : {WireFormat::Json, WireFormat::MessagePack, WireFormat::Cbor}) {
+        out.clear();
+        detail::BodyWriter deep(out, format);
+        for (int i = 0; i <= max; ++i) {
+            deep.beginObject(1);
+            deep.key("k", 1);
+        }
+        deep.null();
+        for (int i = 0; i <= max; ++i) {
+            deep.endObject();
+        }
+        check(deep.overflowed(), "a level past kMaxDepth is refused");
+    }
+
+    out.clear();
+    detail::BodyWriter writer(out, WireFormat::MessagePack);
+    check(!writer.value(nested(max + 1)) && writer.overflowed(), "value() reports a json value nested too deep");
+
+    detail::BodyWriter unbalanced(out, WireFormat::Json);
+    unbalanced.endObject();
+    check(unbalanced.overflowed(), "a close with nothing open is refused");
+}
+
+void checkWriterAllocations() {
+    const json value = {{"power", 12.5}, {"gate", 42}, {"flags", {true, false}}, {"label", "gate 42"}};
+    std::string out;
+    out.reserve(1024);
+    for (WireFormat format : {WireFormat::Json, WireFormat::MessagePack, WireFormat::Cbor}) {
+        size_t before = heap_allocations.load();
+        for (int i = 0; i < 100; ++i) {
+            out.clear();
+            detail::BodyWriter writer(out, format);
+            writer.value(value);
+        }
+        size_t allocations = heap_allocations.load() - before;
+        check(allocations == 0, "BodyWriter into a warm buffer allocates nothing");
+    }
+}
+
+void checkDoubleLayout() {
+    const std::vector<std::pair<double, std::string>> cases = {
+        {0.0, "0.0"}, {-0.0, "-0.0"}, {100.0, "100.0"}, {-12.5, "-12.5"}, {0.1, "0.1"},
+        {1e-4, "0.0001"}, {1e-5, "1e-05"}, {1e14, "100000000000000.0"}, {1e15, "1e+15"},
+        {123456789012345678.0, "1.2345678901234568e+17"}, {5e-324, "5e-324"},
+        {1.7976931348623157e308, "1.7976931348623157e+308"},
+    };
+    bool same = true;
+    for (const auto& c : cases) {
+        std::string out;
+        detail::BodyWriter writer(out, WireFormat::Json);
+        writer.value(c.first);
+        same = same && out == c.second && out == json(c.first).dump();
+    }
+    check(same, "doubles are laid out as json::dump() lays them out");
+}
+
+// Answers one request per reply on a loopback port, for replies a real
+// server would not send. Each reply has status 200 unless statuses says
+// otherwise.
+class CannedServer {
+public:
+    explicit CannedServer(std::vector<std::string> replies, std::vector<int> statuses = {})
+        : replies_(std::move(replies)), statuses_(std::move(statuses)) {
+        statuses_.resize(replies_.size(), 200);
+        listener_ = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof address;
+        bind(listener_, reinterpret_cast<sockaddr*>(&address), length);
+        listen(listener_, 4);
+        // A request that never comes ends the wait rather than the test
+        timeval timeout{5, 0};
+        setsockopt(listener_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        getsockname(listener_, reinterpret_cast<sockaddr*>(&address), &length);
+        port_ = ntohs(address.sin_port);
+        thread_ = std::thread([this] { serve(); });
+    }
+
+    ~CannedServer() {
+        wait();
+        close(listener_);
+    }
+
+    std::string url() const { return "http://127.0.0.1:" + std::to_string(port_); }
+
+    // Head of each request answered, once every reply has gone out
+    const std::vector<std::string>& requests() {
+        wait();
+        return requests_;
+    }
+
+private:
+    void wait() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void serve() {
+        for (size_t i = 0; i < replies_.size(); ++i) {
+            int connection = accept(listener_, nullptr, nullptr);
+            if (connection < 0) {
+                return;
+            }
+            std::string request;
+            char buffer[4096];
+            ssize_t received;
+            while (request.find("\r\n\r\n") == std::string::npos &&
+                   (received = recv(connection, buffer, sizeof buffer, 0)) > 0) {
+                request.append(buffer, static_cast<size_t>(received));
+            }
+            // Read any body too, so the client is not cut off mid-send
+            size_t head = request.find("\r\n\r\n") + 4;
+            size_t length_at = request.find("Content-Length: ");
+            size_t length = length_at < head ? std::stoul(request.substr(length_at + 16)) : 0;
+            while (request.size() < head + length && (received = recv(connection, buffer, sizeof buffer, 0)) > 0) {
+                request.append(buffer, static_cast<size_t>(received));
+            }
+            requests_.push_back(request.substr(0, head));
+
+            const std::string& reply = replies_[i];
+            std::string response = "HTTP/1.1 " + std::to_string(statuses_[i]) +
+                                   " Canned\r\nContent-Type: application/json\r\nContent-Length: " +
+                                   std::to_string(reply.size()) + "\r\nConnection: close\r\n\r\n" + reply;
+            send(connection, response.data(), response.size(), 0);
+            close(connection);
+        }
+    }
+
+    std::vector<std::string> replies_;
+    std::vector<int> statuses_;
+    std::vector<std::string> requests_;
+    int listener_;
+    int port_;
+    std::thread thread_;
+};
+
+void checkStreamKeyOrder() {
+    CannedServer server({
+        R"({"nodes":[{"id":0,"value":1},{"id":1,"value":2}],"type":"array","name":"late"})",
+        R"([{"name":"first","nodes":[{"id":0}]},{"nodes":[{"id":0},{"id":1}],"name":"second"}])",
+    });
+    VisualizerClient viz(server.url());
+
+    std::vector<std::string> names;
+    auto record = [&](const std::string& name, const json&) {
+        names.push_back(name);
+        return true;
+    };
+    json late = viz.streamStructure("late", record);
+    check(late.value("name", "") == "late" && names == std::vector<std::string>{"late", "late"},
+          "nodes before the name are handed over with it");
+
+    names.clear();
+    std::vector<json> all = viz.streamAllStructures(record);
+    check(all.size() == 2 && names == std::vector<std::string>{"first", "second", "second"},
+          "each structure's nodes carry their own name");
+}
+
+bool sameOp(const TraceOp& a, const TraceOp& b) {
+    if (a.kind != b.kind || a.structure_name != b.structure_name) {
+        return false;
+    }
+    switch (a.kind) {
+    case TraceOp::Kind::Create:
+        return a.type == b.type && a.depth == b.depth && a.initial_size == b.initial_size;
+    case TraceOp::Kind::Add:
+    case TraceOp::Kind::Update:
+        return a.node_id == b.node_id && a.index == b.index && a.value == b.value && a.metadata == b.metadata;
+    case TraceOp::Kind::Remove:
+    case TraceOp::Kind::Drop:
+        return a.node_id == b.node_id;
+    case TraceOp::Kind::Stage:
+        return a.stage == b.stage;
+    case TraceOp::Kind::Delete:
+        return true;
+    }
+    return false;
+}
+
+void checkLatencyPercentiles() {
+    LatencyHistogram empty;
+    check(empty.percentile(50) == 0 && empty.percentile(100) == 0, "an empty histogram reports 0");
+
+    // Below 64ns every value has its own bucket
+    LatencyHistogram small;
+    for (uint64_t ns = 1; ns <= 50; ++ns) {
+        small.record(ns);
+    }
+    check(small.percentile(0) == 1 && small.percentile(50) == 25 && small.percentile(100) == 50 &&
+              small.percentile(-5) == 1 && small.percentile(250) == 50,
+          "small values are exact and p is clamped to 0-100");
+
+    // 1us to 10ms in two halves merged, each percentile within 3% of exact
+    LatencyHistogram low;
+    LatencyHistogram high;
+    const uint64_t n = 10000;
+    for (uint64_t i = 1; i <= n; ++i) {
+        (i % 2 ? low : high).record(i * 1000);
+    }
+    LatencyHistogram all;
+    all.merge(low);
+    all.merge(high);
+    bool close = all.count() == n && all.max() == n * 1000;
+    for (double p : {1.0, 10.0, 50.0, 90.0, 99.0, 99.9, 100.0}) {
+        double exact = std::ceil(p / 100.0 * n) * 1000.0;
+        double reported = static_cast<double>(all.percentile(p));
+        close = close && std::abs(reported - exact) <= exact * 0.03 && all.percentile(p) <= all.max();
+    }
+    check(close, "merged percentiles are within 3% of the exact values");
+}
+
+// Ops left in reader, compared against expected from first on
+bool readsBack(TraceReader& reader, const std::vector<TraceOp>& expected, size_t first, size_t* count = nullptr) {
+    TraceOp op;
+    size_t i = first;
+    uint64_t last_time = 0;
+    bool ok = true;
+    while (reader.next(op)) {
+        ok = ok && i < expected.size() && sameOp(op, expected[i]) && op.time_us >= last_time;
+        last_time = op.time_us;
+        ++i;
+    }
+    if (count) {
+        *count = i - first;
+    }
+    return ok;
+}
+
+// Writes every op kind across several blocks, with node IDs that step
+// backwards, then reads the trace back whole and with its tail cut off as
+// a crashed recorder would leave it
+void checkTraceRoundTrip() {
+    const std::string path = "/tmp/visualizer_client_test_" + std::to_string(getpid()) + ".vzt";
+    const std::string cut_path = path + ".cut";
+
+    std::vector<TraceOp> expected;
+    auto expect = [&](TraceOp::Kind kind, const std::string& name, int node_id = -1) -> TraceOp& {
+        expected.emplace_back();
+        expected.back().kind = kind;
+        expected.back().structure_name = name;
+        expected.back().node_id = node_id;
+        return expected.back();
+    };
+
+    std::string error;
+    std::unique_ptr<TraceWriter> writer = TraceWriter::open(path, error);
+    if (!writer) {
+        check(false, "a trace file opens for writing: " + error);
+        return;
+    }
+
+    writer->create("list", "linked_list", 2, 4);
+    TraceOp& create = expect(TraceOp::Kind::Create, "list");
+    create.type = "linked_list";
+    create.depth = 2;
+    create.initial_size = 4;
+
+    const std::map<std::string, json> metadata = {{"color", "red"}, {"weight", 2.5}};
+    writer->add("list", 10, -1, json{{"power", 12.5}}, metadata);
+    TraceOp& first_add = expect(TraceOp::Kind::Add, "list", 10);
+    first_add.value = json{{"power", 12.5}};
+    first_add.metadata = metadata;
+    writer->add("list", 3, 0, "front", {});
+    expect(TraceOp::Kind::Add, "list", 3).index = 0;
+    expected.back().value = "front";
+    writer->update("list", 10, json::array({1, -2, true}), {{"color", "blue"}});
+    TraceOp& update = expect(TraceOp::Kind::Update, "list", 10);
+    update.value = json::array({1, -2, true});
+    update.metadata = {{"color", "blue"}};
+    writer->remove("list", 1);
+    expect(TraceOp::Kind::Remove, "list", 1);
+    writer->drop("list", 0);
+    expect(TraceOp::Kind::Drop, "list", 0);
+    writer->stage("list", "sorted");
+    expect(TraceOp::Kind::Stage, "list").stage = "sorted";
+
+    // Enough payload for several 64KB blocks, IDs alternating high and low
+    const std::string padding(200, 'x');
+    for (int i = 0; i < 1500; ++i) {
+        int id = i % 2 ? 5000 - i : i;
+        writer->add("array", id, -1, padding + std::to_string(i), {});
+        expect(TraceOp::Kind::Add, "array", id).value = padding + std::to_string(i);
+    }
+    writer->destroy("list");
+    expect(TraceOp::Kind::Delete, "list");
+    check(writer->close(), "a trace file closes cleanly");
+    writer.reset();
+
+    TraceReader reader(path);
+    size_t count = 0;
+    check(reader.ok() && reader.indexed() && reader.blockCount() > 2 && reader.opCount() == expected.size(),
+          "a closed trace is read with its index");
+    check(readsBack(reader, expected, 0, &count) && count == expected.size(),
+          "every op kind reads back as written");
+
+    // Keep the header and every block but the last, plus a few bytes of it
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    size_t last_block = bytes.rfind("VZBK");
+    if (last_block == std::string::npos || last_block == 0) {
+        check(false, "a trace file has blocks to cut");
+    } else {
+        std::ofstream(cut_path, std::ios::binary).write(bytes.data(), static_cast<std::streamsize>(last_block + 10));
+
+        TraceReader cut(cut_path);
+        check(cut.ok() && !cut.indexed() && cut.blockCount() == reader.blockCount() - 1,
+              "a trace without its trailer is rescanned up to the torn block");
+        check(readsBack(cut, expected, 0, &count) && count > 0 && count == cut.opCount() && count < expected.size(),
+              "ops in complete blocks of a torn trace read back");
+
+        // The last complete block holds the tail of what was read above
+        size_t whole = count;
+        std::vector<TraceOp> tail;
+        TraceOp op;
+        cut.seek(cut.duration());
+        while (cut.next(op)) {
+            tail.push_back(op);
+        }
+        bool suffix = !tail.empty() && tail.size() < whole;
+        for (size_t i = 0; suffix && i < tail.size(); ++i) {
+            suffix = sameOp(tail[i], expected[whole - tail.size() + i]);
+        }
+        check(suffix, "seek in a torn trace lands on a complete block");
+    }
+    std::remove(path.c_str());
+    std::remove(cut_path.c_str());
+}
+
+// A multiplexed sender whose compressed batch is refused with a 415 steps
+// down and sends it again, as blocking requests do
+void checkMultiplexedEncodingFallback() {
+    CannedServer server({"{}", R"({"ids":[0],"count":1,"version":1})"}, {415, 200});
+    VisualizerClient viz(server.url());
+    CompressionOptions compression;
+    compression.min_bytes = 1;
+    viz.enableCompression(compression);
+    AsyncOptions options;
+    options.transport = SenderTransport::Multiplexed;
+    viz.enableAsync(options);
+    viz.updateNode("canned", 0, std::string(600, 'x'));
+    viz.flush();
+    viz.disableAsync();
+
+    const std::vector<std::string>& requests = server.requests();
+    check(requests.size() == 2 && requests[0].find("Content-Encoding: gzip") != std::string::npos &&
+              requests[1].find("Content-Encoding") == std::string::npos,
+          "a multiplexed batch refused for its encoding is sent again plain");
+}
+
+// Blocking single-node calls once buffers, handles and stats entries are
+// warm. Each pass adds, updates and removes one node.
+void checkMutationAllocations(VisualizerClient& viz, int passes) {
+    const std::string name = "client_test_allocations";
+    const json value = {{"power", 12.5}, {"gate", 42}, {"flags", {true, false}}};
+    const std::map<std::string, json> metadata = {{"beam", 7}, {"label", "gate 42"}};
+    viz.setIdBlockSize(passes * 2 + 64);
+    viz.createStructure(name, "array");
+
+    bool sent = true;
+    auto pass = [&] {
+        int id = viz.addNode(name, value, -1, metadata);
+        sent = viz.updateNode(name, id, value, metadata) && sent;
+        sent = viz.removeNode(name, id) && sent;
+    };
+    for (int i = 0; i < 16; ++i) {
+        pass();
+    }
+
+    size_t before = heap_allocations.load();
+    for (int i = 0; i < passes; ++i) {
+        pass();
+    }
+    size_t allocations = heap_allocations.load() - before;
+    viz.deleteStructure(name);
+
+    check(sent, "blocking mutations succeed");
+    check(allocations == 0, "warm blocking mutations allocate nothing (" + std::to_string(allocations) +
+                                " allocations in " + std::to_string(passes * 3) + " ops)");
+}
+
+void checkDeepValue(VisualizerClient& viz) {
+    const std::string name = "client_test_deep";
+    viz.createStructure(name, "array", 1, 0);
+    const json deep = nested(detail::BodyWriter::kMaxDepth + 1);
+    const std::map<std::string, json> metadata = {{"deep", deep}};
+    int id = viz.addNode(name, deep, -1, metadata);
+    json structure = viz.getStructure(name);
+    viz.deleteStructure(name);
+
+    bool whole = false;
+    for (const json& node : structure.value("nodes", json::array())) {
+        if (node.value("id", -1) == id) {
+            whole = node["value"] == deep && node["metadata"]["deep"] == deep;
+        }
+    }
+    check(id >= 0 && whole, "a value nested past kMaxDepth arrives whole");
+}
+
+void checkManagedStructure(VisualizerClient& viz) {
+    std::vector<int> ids;
+    StageDiff diff;
+    json structure;
+    {
+        // A name that has to be escaped in a route, which the ID avoids
+        ManagedStructure managed(viz, "client test/managed", "array");
+        ids = {managed.addNode(1), managed.addNode(2)};
+        managed.markStage("before");
+        managed.updateNode(ids[0], 10);
+        managed.removeNode(ids[1]);
+        managed.markStage("after");
+        diff = managed.diffStages("before", "after");
+        structure = managed.getStructure();
+    }
+    check(ids[0] >= 0 && ids[1] >= 0 && diff.dropped == std::vector<int>{ids[1]} &&
+              structure["nodes"][0]["value"] == 10,
+          "ManagedStructure calls reach the structure through its handle");
+}
+
+struct Gate {
+    double power;
+    int flag;
+};
+VIZ_REFLECT(Gate, power, flag)
+
+// Records skip json on their fast path, which the mirror must not miss
+void checkMirroredRecords(const std::string& url) {
+    const std::string name = "client_test_mirrored_records";
+    VisualizerClient viz(url);
+    viz.createStructure(name, "array");
+    viz.enableMirror();
+    for (int i = 0; i < 50 && !viz.mirrorConnected(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    viz.addNode(name, 0);
+    viz.getStructureSnapshot(name);
+    std::vector<int> ids = viz.addNodes(name, std::vector<Gate>{{1.5, 1}, {2.5, 2}});
+    int id = viz.addNode(name, Gate{3.5, 3});
+    viz.updateNode(name, ids[0], Gate{4.5, 4});
+    std::shared_ptr<const json> snapshot = viz.getStructureSnapshot(name);
+    viz.deleteStructure(name);
+    viz.disableMirror();
+
+    std::vector<double> powers;
+    for (const json& node : snapshot ? (*snapshot)["nodes"] : json::array()) {
+        powers.push_back(node["value"].is_object() ? node["value"].value("power", 0.0) : -1.0);
+    }
+    check(id >= 0 && powers == std::vector<double>{-1.0, 4.5, 2.5, 3.5},
+          "records added and updated reach the mirror");
+}
+
+void checkMirrorSnapshots(const std::string& url) {
+    const std::string name = "client_test_snapshot";
+    VisualizerClient viz(url);
+    viz.createStructure(name, "array");
+    viz.enableMirror();
+    for (int i = 0; i < 50 && !viz.mirrorConnected(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    viz.addNode(name, 1);
+    std::shared_ptr<const json> before = viz.getStructureSnapshot(name);
+    std::shared_ptr<const json> again = viz.getStructureSnapshot(name);
+    viz.addNode(name, 2);
+    std::shared_ptr<const json> after = viz.getStructureSnapshot(name);
+    viz.deleteStructure(name);
+    viz.disableMirror();
+
+    check(before && before == again, "an unchanged mirrored structure is shared, not copied");
+    check(before && after && (*before)["nodes"].size() == 1 && (*after)["nodes"].size() == 2,
+          "a write leaves snapshots already handed out alone");
+}
+
+// Another client recreating a structure gives it a new ID, which the first
+// client's cached ID and handle must recover from
+void checkRecreatedStructure(const std::string& url) {
+    const std::string name = "client_test_recreated";
+    VisualizerClient viz(url);
+    VisualizerClient other(url);
+    StructureHandle handle = viz.createStructure(name, "array");
+    other.createStructure(name, "array");
+    int by_name = viz.addNode(name, 1);
+    int by_handle = viz.addNode(handle, 2);
+    json structure = other.getStructure(name);
+    other.deleteStructure(name);
+
+    check(by_name >= 0 && by_handle >= 0 && structure.value("nodes", json::array()).size() == 2,
+          "calls for a structure recreated elsewhere reach the new one");
+}
+
+// IDs reserved from a structure mean nothing to its replacement: once the
+// server refuses one, the next add reserves a fresh range
+void checkRefusedNodeId(const std::string& url) {
+    const std::string name = "client_test_refused_id";
+    VisualizerClient viz(url);
+    VisualizerClient other(url);
+    viz.createStructure(name, "array");
+    viz.addNode(name, 1);
+    other.createStructure(name, "array");
+    viz.addNode(name, 2);
+    int id = viz.addNode(name, 3);
+    json structure = other.getStructure(name);
+    other.deleteStructure(name);
+
+    check(id >= 0 && structure.value("nodes", json::array()).size() == 1,
+          "an add after a refused ID reserves a new range");
+}
+
+// A drop mask queued in a batch means what the drop route does: a bit past
+// the last node selects nothing rather than failing the batch
+void checkBatchedDropMask(VisualizerClient& viz) {
+    const std::string name = "client_test_batched_drop";
+    viz.createStructure(name, "array");
+    const int first = viz.addNode(name, 1);
+    viz.addNode(name, 2);
+    viz.beginBatch();
+    viz.applyDropMask(name, std::vector<bool>{false, true, false, true}, first);
+    viz.addNode(name, 7);
+    std::vector<int> ids = viz.commitBatch();
+    json structure = viz.getStructure(name);
+    viz.deleteStructure(name);
+
+    std::vector<bool> active;
+    for (const json& node : structure.value("nodes", json::array())) {
+        active.push_back(node.value("active", false));
+    }
+    check(ids.size() == 3 && std::all_of(ids.begin(), ids.end(), [](int id) { return id >= 0; }) &&
+              active == std::vector<bool>{true, false, true},
+          "a batched drop mask skips bits with no node");
+}
+
+// An op the server refuses, queued among valid ones, must cost only itself
+void checkAsyncRejectedOp(const std::string& url, SenderTransport transport, const std::string& what) {
+    const std::string name = "client_test_rejected_op";
+    VisualizerClient viz(url);
+    viz.createStructure(name, "array");
+    AsyncOptions options;
+    options.transport = transport;
+    viz.enableAsync(options);
+    for (int i = 0; i < 3; ++i) {
+        viz.addNode(name, i);
+    }
+    viz.removeNode(name, 1 << 30);
+    for (int i = 3; i < 6; ++i) {
+        viz.addNode(name, i);
+    }
+    viz.flush();
+    viz.disableAsync();
+    json structure = viz.getStructure(name);
+    viz.deleteStructure(name);
+
+    check(structure.value("nodes", json::array()).size() == 6,
+          "a refused op does not take the rest of its " + what + " batch with it");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string url = argc > 1 ? argv[1] : "http://localhost:5000";
+
+    checkNesting();
+    checkWriterAllocations();
+    checkDoubleLayout();
+    checkStreamKeyOrder();
+    checkMultiplexedEncodingFallback();
+    checkTraceRoundTrip();
+    checkLatencyPercentiles();
+
+    VisualizerClient viz(url);
+    if (viz.isConnected()) {
+        checkMutationAllocations(viz, 200);
+        checkDeepValue(viz);
+        checkManagedStructure(viz);
+        checkMirrorSnapshots(url);
+        checkMirroredRecords(url);
+        checkBatchedDropMask(viz);
+        checkRecreatedStructure(url);
+        checkRefusedNodeId(url);
+        checkAsyncRejectedOp(url, SenderTransport::Sequential, "sequential");
+        checkAsyncRejectedOp(url, SenderTransport::Multiplexed, "multiplexed");
+    } else {
+        std::cout << "skip client checks: visualizer not reachable at " << url << std::endl;
+    }
+
+    std::cout << (failures == 0 ? "all checks passed" : std::to_string(failures) + " checks failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
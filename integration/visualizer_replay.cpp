@@ -0,0 +1,189 @@
+/**
+ * Replays a trace written by VisualizerClient::startRecording() into a
+ * running visualizer.
+ *
+ * Usage: visualizer_replay <trace> [base_url] [--realtime] [--speed=N]
+ *                          [--from=SECONDS] [--info]
+ *
+ * By default node ops are bulk-loaded through the batch route as fast as the
+ * server takes them. --realtime keeps the recorded spacing between ops
+ * (scaled by --speed), so a run can be watched as it happened. --from skips
+ * ahead using the block index; the structures must already exist on the
+ * server. --info prints the trace summary from the index and exits.
+ */
+#include "visualizer_trace.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+
+using namespace cpp_visualizer;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Node ops are sent in batches of this many, or sooner when timing requires
+const size_t kMaxBatch = 1024;
+
+void printInfo(const TraceReader& reader) {
+    std::time_t start = static_cast<std::time_t>(reader.startTime() / 1000000);
+    std::cout << "recorded   " << std::put_time(std::localtime(&start), "%Y-%m-%d %H:%M:%S") << "\n"
+              << "duration   " << std::fixed << std::setprecision(3) << reader.duration() / 1e6 << " s\n"
+              << "ops        " << reader.opCount() << "\n"
+              << "blocks     " << reader.blockCount()
+              << (reader.indexed() ? "" : " (no index, trace was not closed cleanly)") << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0]
+                  << " <trace> [base_url] [--realtime] [--speed=N] [--from=SECONDS] [--info]" << std::endl;
+        return 2;
+    }
+
+    std::string path = argv[1];
+    std::string url = "http://localhost:5000";
+    bool realtime = false;
+    bool info = false;
+    double speed = 1.0;
+    uint64_t from_us = 0;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--realtime") {
+            realtime = true;
+        } else if (arg == "--info") {
+            info = true;
+        } else if (arg.compare(0, 8, "--speed=") == 0) {
+            speed = std::atof(arg.c_str() + 8);
+        } else if (arg.compare(0, 7, "--from=") == 0) {
+            from_us = static_cast<uint64_t>(std::atof(arg.c_str() + 7) * 1e6);
+        } else {
+            url = arg;
+        }
+    }
+    if (speed <= 0) {
+        speed = 1.0;
+    }
+
+    TraceReader reader(path);
+    if (!reader.ok()) {
+        std::cerr << reader.error() << std::endl;
+        return 1;
+    }
+    if (info) {
+        printInfo(reader);
+        return 0;
+    }
+
+    VisualizerClient viz(url);
+    viz.setVerbose(true);
+    if (!viz.isConnected()) {
+        std::cerr << "Visualizer not reachable at " << url << std::endl;
+        return 1;
+    }
+
+    if (from_us > 0) {
+        reader.seek(from_us);
+    }
+
+    std::vector<BatchOp> pending;
+    std::vector<int> expected;   // node ID the trace recorded for each pending op
+    uint64_t applied = 0;
+    uint64_t failed = 0;
+    auto count = [&](bool ok) {
+        if (ok) {
+            ++applied;
+        } else {
+            ++failed;
+        }
+    };
+    auto sendPending = [&] {
+        if (pending.empty()) {
+            return;
+        }
+        std::vector<int> ids = viz.applyOps(pending);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            count(ids[i] >= 0 && ids[i] == expected[i]);
+        }
+        pending.clear();
+        expected.clear();
+    };
+
+    TraceOp op;
+    bool first = true;
+    uint64_t base_us = from_us;
+    auto start = Clock::now();
+    while (reader.next(op)) {
+        if (op.time_us < from_us) {
+            continue;
+        }
+        if (first) {
+            base_us = op.time_us;
+            first = false;
+        }
+
+        if (realtime) {
+            auto due = start + std::chrono::microseconds(static_cast<int64_t>((op.time_us - base_us) / speed));
+            if (Clock::now() < due) {
+                sendPending();
+                std::this_thread::sleep_until(due);
+            }
+        }
+
+        switch (op.kind) {
+            case TraceOp::Kind::Create:
+                sendPending();
+                count(static_cast<bool>(viz.createStructure(op.structure_name, op.type, op.depth, op.initial_size)));
+                break;
+            case TraceOp::Kind::Delete:
+                sendPending();
+                count(viz.deleteStructure(op.structure_name));
+                break;
+            case TraceOp::Kind::Stage:
+                sendPending();
+                count(viz.markStage(op.structure_name, op.stage));
+                break;
+            case TraceOp::Kind::Add:
+                // The recorder numbered nodes the way the server does, and the
+                // server only accepts IDs it reserved, so let it number them
+                // again; a different ID counts as a failure
+                expected.push_back(op.node_id);
+                pending.push_back({BatchOp::Kind::Add, op.structure_name, -1, op.index,
+                                   std::move(op.value), std::move(op.metadata)});
+                break;
+            case TraceOp::Kind::Remove:
+                expected.push_back(op.node_id);
+                pending.push_back({BatchOp::Kind::Remove, op.structure_name, op.node_id, -1, json{}, {}});
+                break;
+            case TraceOp::Kind::Drop:
+                expected.push_back(op.node_id);
+                pending.push_back({BatchOp::Kind::Drop, op.structure_name, op.node_id, -1, json{}, {}});
+                break;
+            case TraceOp::Kind::Update:
+                expected.push_back(op.node_id);
+                pending.push_back({BatchOp::Kind::Update, op.structure_name, op.node_id, -1,
+                                   std::move(op.value), std::move(op.metadata)});
+                break;
+        }
+        if (pending.size() >= kMaxBatch) {
+            sendPending();
+        }
+    }
+    sendPending();
+
+    if (!reader.ok()) {
+        std::cerr << "Stopped early: " << reader.error() << std::endl;
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << "replayed " << applied << " ops (" << failed << " failed) in "
+              << std::fixed << std::setprecision(2) << seconds << " s, "
+              << std::setprecision(0) << (seconds > 0 ? applied / seconds : 0.0) << " ops/s" << std::endl;
+    return reader.ok() && failed == 0 ? 0 : 1;
+}
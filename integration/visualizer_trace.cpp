@@ -0,0 +1,589 @@
+#include "visualizer_trace.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace cpp_visualizer {
+
+namespace {
+
+const char kFileMagic[8] = {'V', 'Z', 'T', 'R', 'A', 'C', 'E', '1'};
+const char kBlockMagic[4] = {'V', 'Z', 'B', 'K'};
+const char kIndexMagic[4] = {'V', 'Z', 'I', 'X'};
+const char kTrailerMagic[4] = {'V', 'Z', 'T', 'E'};
+
+const size_t kFileHeaderSize = 16;
+const size_t kBlockHeaderSize = 24;
+const size_t kIndexEntrySize = 20;
+const size_t kTrailerSize = 12;
+
+// Ops are buffered until a block reaches this size
+const size_t kBlockTarget = 64 * 1024;
+
+// Record kinds inside a block
+enum : uint8_t {
+    kDefine = 0,
+    kCreate = 1,
+    kAdd = 2,
+    kRemove = 3,
+    kUpdate = 4,
+    kDelete = 5,
+    kStage = 6,
+    kDrop = 7,
+};
+
+void putU32(std::string& out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>(v >> (8 * i)));
+    }
+}
+
+void putU64(std::string& out, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(static_cast<char>(v >> (8 * i)));
+    }
+}
+
+void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+// Zigzag keeps small negative deltas small
+void putSignedVarint(std::string& out, int64_t v) {
+    putVarint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+}
+
+void putString(std::string& out, const std::string& s) {
+    putVarint(out, s.size());
+    out.append(s);
+}
+
+uint32_t getU32(const char* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+        v |= static_cast<uint32_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    }
+    return v;
+}
+
+uint64_t getU64(const char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    }
+    return v;
+}
+
+// Bounds-checked reader over a decoded block or index
+struct Cursor {
+    const std::string& data;
+    size_t& pos;
+
+    bool varint(uint64_t& v) {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos >= data.size()) {
+                return false;
+            }
+            unsigned char byte = static_cast<unsigned char>(data[pos++]);
+            v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool signedVarint(int64_t& v) {
+        uint64_t u;
+        if (!varint(u)) {
+            return false;
+        }
+        v = static_cast<int64_t>(u >> 1) ^ -static_cast<int64_t>(u & 1);
+        return true;
+    }
+
+    bool bytes(size_t n, const char*& p) {
+        if (n > data.size() - pos) {
+            return false;
+        }
+        p = data.data() + pos;
+        pos += n;
+        return true;
+    }
+
+    bool string(std::string& s) {
+        uint64_t n;
+        const char* p;
+        if (!varint(n) || !bytes(n, p)) {
+            return false;
+        }
+        s.assign(p, n);
+        return true;
+    }
+};
+
+bool readAt(std::FILE* file, uint64_t offset, void* buffer, size_t size) {
+    return std::fseek(file, static_cast<long>(offset), SEEK_SET) == 0 &&
+           std::fread(buffer, 1, size, file) == size;
+}
+
+} // namespace
+
+// --- TraceWriter ---
+
+std::unique_ptr<TraceWriter> TraceWriter::open(const std::string& path, std::string& error) {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        error = "cannot open " + path + ": " + std::strerror(errno);
+        return nullptr;
+    }
+    return std::unique_ptr<TraceWriter>(new TraceWriter(file, path));
+}
+
+TraceWriter::TraceWriter(std::FILE* file, const std::string& path)
+    : file_(file), path_(path), failed_(false), start_(std::chrono::steady_clock::now()),
+      offset_(0), block_ops_(0), block_first_time_us_(0), last_time_us_(0), last_node_id_(0) {
+    std::string header(kFileMagic, sizeof(kFileMagic));
+    auto wall = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch());
+    putU64(header, static_cast<uint64_t>(wall.count()));
+    failed_ = std::fwrite(header.data(), 1, header.size(), file_) != header.size();
+    offset_ = header.size();
+    block_.reserve(kBlockTarget + 4096);
+}
+
+TraceWriter::~TraceWriter() {
+    close();
+}
+
+void TraceWriter::create(const std::string& name, const std::string& type, int depth, int initial_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    beginOp(kCreate, name, 0);
+    putString(block_, type);
+    putVarint(block_, static_cast<uint64_t>(std::max(depth, 0)));
+    putVarint(block_, static_cast<uint64_t>(std::max(initial_size, 0)));
+    endOp();
+}
+
+void TraceWriter::add(const std::string& name, int node_id, int index,
+                      const json& value, const std::map<std::string, json>& metadata) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    beginOp(kAdd, name, node_id);
+    putVarint(block_, index >= 0 ? static_cast<uint64_t>(index) + 1 : 0);
+    // Length-prefixed; the prefix is patched in once the payload is known
+    size_t mark = block_.size();
+    detail::appendOpPayload(block_, value, metadata);
+    std::string length;
+    putVarint(length, block_.size() - mark);
+    block_.insert(mark, length);
+    endOp();
+}
+
+void TraceWriter::remove(const std::string& name, int node_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    beginOp(kRemove, name, node_id);
+    endOp();
+}
+
+void TraceWriter::drop(const std::string& name, int node_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    beginOp(kDrop, name, node_id);
+    endOp();
+}
+
+void TraceWriter::update(const std::string& name, int node_id,
+                         const json& value, const std::map<std::string, json>& metadata) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    beginOp(kUpdate, name, node_id);
+    size_t mark = block_.size();
+    detail::appendOpPayload(block_, value, metadata);
+    std::string length;
+    putVarint(length, block_.size() - mark);
+    block_.insert(mark, length);
+    endOp();
+}
+
+void TraceWriter::destroy(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    beginOp(kDelete, name, 0);
+    endOp();
+}
+
+void TraceWriter::stage(const std::string& name, const std::string& stage) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    beginOp(kStage, name, 0);
+    putString(block_, stage);
+    endOp();
+}
+
+void TraceWriter::beginOp(int kind, const std::string& name, int node_id) {
+    uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_).count());
+    if (block_.empty()) {
+        block_first_time_us_ = now;
+        last_time_us_ = now;
+        last_node_id_ = 0;
+    }
+
+    auto it = names_.find(name);
+    if (it == names_.end()) {
+        uint32_t number = static_cast<uint32_t>(name_table_.size());
+        it = names_.emplace(name, number).first;
+        name_table_.push_back(name);
+        block_.push_back(static_cast<char>(kDefine));
+        putVarint(block_, number);
+        putString(block_, name);
+    }
+
+    block_.push_back(static_cast<char>(kind));
+    putVarint(block_, now - last_time_us_);
+    putVarint(block_, it->second);
+    if (kind == kAdd || kind == kRemove || kind == kUpdate || kind == kDrop) {
+        putSignedVarint(block_, static_cast<int64_t>(node_id) - last_node_id_);
+        last_node_id_ = node_id;
+    }
+    last_time_us_ = now;
+}
+
+void TraceWriter::endOp() {
+    ++block_ops_;
+    if (block_.size() >= kBlockTarget) {
+        writeBlock();
+    }
+}
+
+void TraceWriter::writeBlock() {
+    if (block_.empty() || !file_) {
+        return;
+    }
+
+    std::string header(kBlockMagic, sizeof(kBlockMagic));
+    putU32(header, static_cast<uint32_t>(block_.size()));
+    putU32(header, block_ops_);
+    putU32(header, 0);
+    putU64(header, block_first_time_us_);
+
+    if (std::fwrite(header.data(), 1, header.size(), file_) != header.size() ||
+        std::fwrite(block_.data(), 1, block_.size(), file_) != block_.size()) {
+        failed_ = true;
+    }
+    index_.push_back({offset_, block_first_time_us_, block_ops_});
+    offset_ += header.size() + block_.size();
+
+    block_.clear();
+    block_ops_ = 0;
+}
+
+bool TraceWriter::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!file_) {
+        return !failed_;
+    }
+
+    writeBlock();
+
+    std::string index(kIndexMagic, sizeof(kIndexMagic));
+    putU32(index, static_cast<uint32_t>(index_.size()));
+    putU64(index, last_time_us_);
+    for (const BlockEntry& entry : index_) {
+        putU64(index, entry.offset);
+        putU64(index, entry.first_time_us);
+        putU32(index, entry.op_count);
+    }
+    putVarint(index, name_table_.size());
+    for (const std::string& name : name_table_) {
+        putString(index, name);
+    }
+    putU64(index, offset_);
+    index.append(kTrailerMagic, sizeof(kTrailerMagic));
+
+    if (std::fwrite(index.data(), 1, index.size(), file_) != index.size()) {
+        failed_ = true;
+    }
+    if (std::fclose(file_) != 0) {
+        failed_ = true;
+    }
+    file_ = nullptr;
+    return !failed_;
+}
+
+// --- TraceReader ---
+
+TraceReader::TraceReader(const std::string& path)
+    : file_(std::fopen(path.c_str(), "rb")), start_time_us_(0), end_time_us_(0), indexed_(false),
+      next_block_(0), pos_(0), last_time_us_(0), last_node_id_(0) {
+    if (!file_) {
+        error_ = "cannot open " + path + ": " + std::strerror(errno);
+        return;
+    }
+
+    char header[kFileHeaderSize];
+    if (!readAt(file_, 0, header, sizeof(header)) || std::memcmp(header, kFileMagic, sizeof(kFileMagic)) != 0) {
+        error_ = path + " is not a visualizer trace";
+        return;
+    }
+    start_time_us_ = getU64(header + sizeof(kFileMagic));
+
+    indexed_ = loadIndex();
+    if (!indexed_) {
+        scanBlocks();
+    }
+}
+
+TraceReader::~TraceReader() {
+    if (file_) {
+        std::fclose(file_);
+    }
+}
+
+uint64_t TraceReader::opCount() const {
+    uint64_t count = 0;
+    for (const BlockEntry& entry : index_) {
+        count += entry.op_count;
+    }
+    return count;
+}
+
+bool TraceReader::loadIndex() {
+    if (std::fseek(file_, 0, SEEK_END) != 0) {
+        return false;
+    }
+    long size = std::ftell(file_);
+    if (size < static_cast<long>(kFileHeaderSize + kTrailerSize)) {
+        return false;
+    }
+
+    char trailer[kTrailerSize];
+    if (!readAt(file_, static_cast<uint64_t>(size) - kTrailerSize, trailer, sizeof(trailer)) ||
+        std::memcmp(trailer + 8, kTrailerMagic, sizeof(kTrailerMagic)) != 0) {
+        return false;
+    }
+    uint64_t index_offset = getU64(trailer);
+    if (index_offset < kFileHeaderSize || index_offset > static_cast<uint64_t>(size) - kTrailerSize) {
+        return false;
+    }
+
+    std::string index(static_cast<size_t>(size) - kTrailerSize - index_offset, '\0');
+    if (!readAt(file_, index_offset, &index[0], index.size()) || index.size() < 16 ||
+        std::memcmp(index.data(), kIndexMagic, sizeof(kIndexMagic)) != 0) {
+        return false;
+    }
+
+    uint32_t blocks = getU32(index.data() + 4);
+    end_time_us_ = getU64(index.data() + 8);
+    size_t pos = 16;
+    if (blocks > (index.size() - pos) / kIndexEntrySize) {
+        return false;
+    }
+    for (uint32_t i = 0; i < blocks; ++i, pos += kIndexEntrySize) {
+        const char* p = index.data() + pos;
+        index_.push_back({getU64(p), getU64(p + 8), getU32(p + 16)});
+    }
+
+    Cursor cursor{index, pos};
+    uint64_t names;
+    if (!cursor.varint(names)) {
+        index_.clear();
+        return false;
+    }
+    names_.resize(names);
+    for (std::string& name : names_) {
+        if (!cursor.string(name)) {
+            index_.clear();
+            names_.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+void TraceReader::scanBlocks() {
+    // No usable index: walk the blocks, stopping at the first one that is
+    // incomplete, and decode them to pick up the structure names
+    uint64_t offset = kFileHeaderSize;
+    char header[kBlockHeaderSize];
+    while (readAt(file_, offset, header, sizeof(header)) &&
+           std::memcmp(header, kBlockMagic, sizeof(kBlockMagic)) == 0) {
+        index_.push_back({offset, getU64(header + 16), getU32(header + 8)});
+        if (!loadBlock(index_.size() - 1)) {
+            index_.pop_back();
+            break;
+        }
+        TraceOp op;
+        while (pos_ < block_.size()) {
+            if (readRecord(op) < 0) {
+                break;
+            }
+            end_time_us_ = std::max(end_time_us_, op.time_us);
+        }
+        offset += kBlockHeaderSize + getU32(header + 4);
+    }
+
+    next_block_ = 0;
+    block_.clear();
+    pos_ = 0;
+}
+
+bool TraceReader::loadBlock(size_t block) {
+    const BlockEntry& entry = index_[block];
+    char header[kBlockHeaderSize];
+    if (!readAt(file_, entry.offset, header, sizeof(header)) ||
+        std::memcmp(header, kBlockMagic, sizeof(kBlockMagic)) != 0) {
+        return false;
+    }
+
+    block_.resize(getU32(header + 4));
+    if (!block_.empty() && std::fread(&block_[0], 1, block_.size(), file_) != block_.size()) {
+        block_.clear();
+        return false;
+    }
+    pos_ = 0;
+    last_time_us_ = getU64(header + 16);
+    last_node_id_ = 0;
+    return true;
+}
+
+int TraceReader::readRecord(TraceOp& op) {
+    Cursor cursor{block_, pos_};
+    const char* kind;
+    if (!cursor.bytes(1, kind)) {
+        return -1;
+    }
+
+    if (*kind == kDefine) {
+        uint64_t number;
+        std::string name;
+        if (!cursor.varint(number) || !cursor.string(name) || number > names_.size() + 1024) {
+            return -1;
+        }
+        if (number >= names_.size()) {
+            names_.resize(number + 1);
+        }
+        names_[number] = name;
+        return 0;
+    }
+
+    uint64_t delta, structure;
+    if (!cursor.varint(delta) || !cursor.varint(structure) || structure >= names_.size()) {
+        return -1;
+    }
+    last_time_us_ += delta;
+    op.time_us = last_time_us_;
+    op.structure_name = names_[structure];
+    op.node_id = -1;
+    op.index = -1;
+    op.value = nullptr;
+    op.metadata.clear();
+
+    if (*kind == kAdd || *kind == kRemove || *kind == kUpdate || *kind == kDrop) {
+        int64_t node_delta;
+        if (!cursor.signedVarint(node_delta)) {
+            return -1;
+        }
+        last_node_id_ += node_delta;
+        op.node_id = static_cast<int>(last_node_id_);
+    }
+
+    uint64_t n;
+    const char* payload;
+    switch (*kind) {
+        case kCreate: {
+            uint64_t depth, initial_size;
+            if (!cursor.string(op.type) || !cursor.varint(depth) || !cursor.varint(initial_size)) {
+                return -1;
+            }
+            op.kind = TraceOp::Kind::Create;
+            op.depth = static_cast<int>(depth);
+            op.initial_size = static_cast<int>(initial_size);
+            return 1;
+        }
+        case kAdd:
+            if (!cursor.varint(n)) {
+                return -1;
+            }
+            op.index = static_cast<int>(n) - 1;
+            op.kind = TraceOp::Kind::Add;
+            break;
+        case kUpdate:
+            op.kind = TraceOp::Kind::Update;
+            break;
+        case kRemove:
+            op.kind = TraceOp::Kind::Remove;
+            return 1;
+        case kDrop:
+            op.kind = TraceOp::Kind::Drop;
+            return 1;
+        case kDelete:
+            op.kind = TraceOp::Kind::Delete;
+            return 1;
+        case kStage:
+            if (!cursor.string(op.stage)) {
+                return -1;
+            }
+            op.kind = TraceOp::Kind::Stage;
+            return 1;
+        default:
+            return -1;
+    }
+
+    // Add and update carry the MessagePack array [value, metadata]
+    if (!cursor.varint(n) || !cursor.bytes(n, payload)) {
+        return -1;
+    }
+    json decoded = json::from_msgpack(payload, payload + n, true, false);
+    if (!decoded.is_array() || decoded.size() != 2) {
+        return -1;
+    }
+    op.value = std::move(decoded[0]);
+    if (decoded[1].is_object()) {
+        op.metadata = decoded[1].get<std::map<std::string, json>>();
+    }
+    return 1;
+}
+
+bool TraceReader::next(TraceOp& op) {
+    if (!file_) {
+        return false;
+    }
+    for (;;) {
+        if (pos_ >= block_.size()) {
+            if (next_block_ >= index_.size()) {
+                return false;
+            }
+            if (!loadBlock(next_block_++)) {
+                error_ = "corrupt block " + std::to_string(next_block_ - 1);
+                return false;
+            }
+            continue;
+        }
+
+        int result = readRecord(op);
+        if (result < 0) {
+            error_ = "corrupt record in block " + std::to_string(next_block_ - 1);
+            return false;
+        }
+        if (result > 0) {
+            return true;
+        }
+    }
+}
+
+bool TraceReader::seek(uint64_t time_us) {
+    if (!file_) {
+        return false;
+    }
+    // Last block that starts at or before time_us
+    auto it = std::upper_bound(index_.begin(), index_.end(), time_us,
+                               [](uint64_t t, const BlockEntry& entry) { return t < entry.first_time_us; });
+    next_block_ = it == index_.begin() ? 0 : static_cast<size_t>(it - index_.begin()) - 1;
+    block_.clear();
+    pos_ = 0;
+    return true;
+}
+
+} // namespace cpp_visualizer
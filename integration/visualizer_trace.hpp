@@ -0,0 +1,162 @@
+#pragma once
+
+#include "cpp_visualizer_client.hpp"
+#include <chrono>
+#include <cstdio>
+
+namespace cpp_visualizer {
+
+/**
+ * One op read back from a trace
+ */
+struct TraceOp {
+    enum class Kind { Create, Add, Remove, Update, Delete, Stage, Drop };
+
+    Kind kind;
+    uint64_t time_us = 0;                       // since recording started
+    std::string structure_name;
+    int node_id = -1;
+    int index = -1;
+    json value;
+    std::map<std::string, json> metadata;
+    std::string type;                           // Create only
+    int depth = 1;                              // Create only
+    int initial_size = 0;                       // Create only
+    std::string stage;                          // Stage only
+};
+
+/**
+ * Appends ops to a compact binary trace file.
+ *
+ * File layout (all integers little-endian):
+ *   header   "VZTRACE1", u64 wall-clock start in microseconds since the epoch
+ *   blocks   "VZBK", u32 payload bytes, u32 op count, u32 reserved,
+ *            u64 time of the first op, then the encoded ops
+ *   index    "VZIX", u32 block count, u64 time of the last op, per block
+ *            u64 file offset, u64 first op time, u32 op count; then the
+ *            structure name table
+ *   trailer  u64 index offset, "VZTE"
+ *
+ * Ops inside a block are delta-encoded against the previous op of the same
+ * block (time and node ID) and written as LEB128 varints, so a block decodes
+ * on its own once the structure names are known. Names are written once, as
+ * define ops in the block where they first appear and again in the index.
+ * A trace cut short by a crash has no index; the reader rebuilds it by
+ * scanning the blocks, up to the last complete one.
+ *
+ * Calls are thread-safe.
+ */
+class TraceWriter {
+public:
+    static std::unique_ptr<TraceWriter> open(const std::string& path, std::string& error);
+    ~TraceWriter();
+
+    void create(const std::string& name, const std::string& type, int depth, int initial_size);
+    void add(const std::string& name, int node_id, int index,
+             const json& value, const std::map<std::string, json>& metadata);
+    void remove(const std::string& name, int node_id);
+    void drop(const std::string& name, int node_id);
+    void update(const std::string& name, int node_id,
+                const json& value, const std::map<std::string, json>& metadata);
+    void destroy(const std::string& name);
+    void stage(const std::string& name, const std::string& stage);
+
+    /**
+     * Write the last block, the index and the trailer
+     * @return false if any write to the file failed
+     */
+    bool close();
+
+private:
+    TraceWriter(std::FILE* file, const std::string& path);
+
+    struct BlockEntry {
+        uint64_t offset;
+        uint64_t first_time_us;
+        uint32_t op_count;
+    };
+
+    void beginOp(int kind, const std::string& name, int node_id);
+    void endOp();
+    void writeBlock();
+
+    std::mutex mutex_;
+    std::FILE* file_;
+    std::string path_;
+    bool failed_;
+    std::chrono::steady_clock::time_point start_;
+    std::unordered_map<std::string, uint32_t> names_;
+    std::vector<std::string> name_table_;
+    std::vector<BlockEntry> index_;
+    uint64_t offset_;
+
+    // Block being filled
+    std::string block_;
+    uint32_t block_ops_;
+    uint64_t block_first_time_us_;
+    uint64_t last_time_us_;
+    int64_t last_node_id_;
+};
+
+/**
+ * Reads a trace written by TraceWriter, in order
+ */
+class TraceReader {
+public:
+    explicit TraceReader(const std::string& path);
+    ~TraceReader();
+
+    bool ok() const { return error_.empty(); }
+    const std::string& error() const { return error_; }
+
+    /**
+     * Read the next op
+     * @return false at the end of the trace or on a corrupt block
+     */
+    bool next(TraceOp& op);
+
+    /**
+     * Jump to the first block that may contain ops at or after time_us,
+     * using the block index. Structures created before that point are not
+     * replayed.
+     */
+    bool seek(uint64_t time_us);
+
+    /** Wall-clock start of the recording, microseconds since the epoch */
+    uint64_t startTime() const { return start_time_us_; }
+    size_t blockCount() const { return index_.size(); }
+    uint64_t opCount() const;
+    /** Time of the last op, relative to the start of the recording */
+    uint64_t duration() const { return end_time_us_; }
+    /** Whether the index came from the trailer rather than a rescan */
+    bool indexed() const { return indexed_; }
+
+private:
+    struct BlockEntry {
+        uint64_t offset;
+        uint64_t first_time_us;
+        uint32_t op_count;
+    };
+
+    bool loadIndex();
+    void scanBlocks();
+    bool loadBlock(size_t block);
+    int readRecord(TraceOp& op);
+
+    std::FILE* file_;
+    std::string error_;
+    uint64_t start_time_us_;
+    uint64_t end_time_us_;
+    bool indexed_;
+    std::vector<BlockEntry> index_;
+    std::vector<std::string> names_;
+
+    // Block being decoded
+    size_t next_block_;
+    std::string block_;
+    size_t pos_;
+    uint64_t last_time_us_;
+    int64_t last_node_id_;
+};
+
+} // namespace cpp_visualizer
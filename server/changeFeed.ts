@@ -0,0 +1,89 @@
+import type { Response } from "express";
+import { storage } from "./storage";
+import { projectStructure } from "./columnar";
+import { canDelta, nodesSince } from "./versions";
+
+// Server-sent change stream for clients that mirror structures locally
+// (VisualizerClient::enableMirror). Routes call publishChange() after every
+// mutation; changes are gathered for FLUSH_DELAY_MS and each changed
+// structure is then sent once to every subscriber, as the same delta a
+// `?since=` fetch returns. Events:
+//
+//   event: delta     the structure's fields, the nodes changed since the
+//                    last event for it, `delta: true` and `since`
+//   event: snapshot  the whole structure: nodes were reordered, or it was
+//                    created or recreated
+//   event: deleted   { name }
+//
+// Every subscriber gets the same events, so an event is built once per
+// flush rather than once per subscriber.
+
+const FLUSH_DELAY_MS = 5;
+const HEARTBEAT_MS = 15000;
+
+const subscribers = new Set<Response>();
+// Version of each structure as of the last event sent for it
+const streamed = new Map<string, { id: number; version: number }>();
+const dirty = new Set<string>();
+let flushTimer: NodeJS.Timeout | undefined;
+
+/** Note that a structure changed (or was deleted); sent on the next flush */
+export function publishChange(name: string) {
+  dirty.add(name);
+  if (!flushTimer) {
+    flushTimer = setTimeout(flushChanges, FLUSH_DELAY_MS);
+  }
+}
+
+async function flushChanges() {
+  flushTimer = undefined;
+  const names = Array.from(dirty);
+  dirty.clear();
+
+  for (const name of names) {
+    const structure = await storage.getLiveStructureByName(name);
+    const last = streamed.get(name);
+    if (!structure) {
+      streamed.delete(name);
+      if (last) send("deleted", JSON.stringify({ name }));
+      continue;
+    }
+    streamed.set(name, { id: structure.id, version: structure.version });
+    if (subscribers.size === 0) continue;
+
+    if (last && last.id === structure.id && canDelta(structure, last.version)) {
+      if (last.version === structure.version) continue;
+      const { columns, nodes, ...rest } = structure;
+      const view = projectStructure({ ...rest, nodes: [], ...(columns ? { schema: columns.schema } : {}) });
+      send("delta", JSON.stringify({ ...view, nodes: nodesSince(structure, last.version), delta: true, since: last.version }));
+    } else {
+      send("snapshot", JSON.stringify(projectStructure(structure)));
+    }
+  }
+}
+
+function send(event: string, data: string) {
+  const message = `event: ${event}\ndata: ${data}\n\n`;
+  subscribers.forEach(res => res.write(message));
+}
+
+/** Hold the request open as an event stream until the client goes away */
+export function subscribeChanges(res: Response) {
+  res.status(200).set({
+    "Content-Type": "text/event-stream",
+    "Cache-Control": "no-cache",
+    "Connection": "keep-alive",
+    "X-Accel-Buffering": "no",
+  });
+  res.flushHeaders();
+  // Tells the client the stream is live; changes before this point it must
+  // fetch itself
+  res.write(": connected\n\n");
+  subscribers.add(res);
+
+  const heartbeat = setInterval(() => res.write(": ping\n\n"), HEARTBEAT_MS);
+  res.on("close", () => {
+    clearInterval(heartbeat);
+    subscribers.delete(res);
+  });
+}
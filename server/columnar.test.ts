@@ -0,0 +1,47 @@
+import { test } from "node:test";
+import assert from "node:assert/strict";
+import { NodeColumns, parseSchema } from "./columnar";
+
+function roundTrip(schema: Record<string, string>, value: any): any {
+  const columns = new NodeColumns(parseSchema(schema));
+  columns.insert(0, 0, value, true, {});
+  return JSON.parse(JSON.stringify(columns.value(0)));
+}
+
+test("values the columns hold exactly are stored in them", () => {
+  const columns = new NodeColumns(parseSchema({ a: "int8", b: "uint32", c: "float32", d: "float64" }));
+  const value = { a: -128, b: 4294967295, c: Math.fround(0.1), d: 0.1 };
+  columns.insert(0, 0, value, true, {});
+  assert.equal(columns.overflow.size, 0);
+  assert.deepEqual(columns.value(0), value);
+});
+
+test("values a column would change read back as written", () => {
+  const cases: [Record<string, string>, any][] = [
+    [{ a: "int8" }, { a: 300 }],
+    [{ a: "int8" }, { a: -129 }],
+    [{ a: "uint8" }, { a: -1 }],
+    [{ a: "uint16" }, { a: 65536 }],
+    [{ a: "int32" }, { a: 1.5 }],
+    [{ a: "int32" }, { a: 2 ** 31 }],
+    [{ a: "uint32" }, { a: 2 ** 32 }],
+    [{ a: "float32" }, { a: 0.1 }],
+    [{ a: "float32" }, { a: 1e39 }],
+    [{ a: "uint8" }, { a: true }],
+    [{ a: "float64" }, { a: false }],
+    [{ a: "int16", b: "int16" }, { a: 1, b: 70000 }],
+  ];
+  for (const [schema, value] of cases) {
+    assert.deepEqual(roundTrip(schema, value), value, `${JSON.stringify(value)} in ${JSON.stringify(schema)}`);
+  }
+});
+
+test("an update that no longer fits moves the row to overflow and back", () => {
+  const columns = new NodeColumns(parseSchema({ a: "int8" }));
+  columns.insert(0, 0, { a: 1 }, true, {});
+  columns.setValue(0, { a: 1000 });
+  assert.deepEqual(columns.value(0), { a: 1000 });
+  columns.setValue(0, { a: 2 });
+  assert.deepEqual(columns.value(0), { a: 2 });
+  assert.equal(columns.overflow.size, 0);
+});
@@ -0,0 +1,371 @@
+import type { LiveNode, LiveStructure } from "./storage";
+import { LiveOpError, checkNodeId, type Relink } from "./liveOps";
+import { stageSummaries, type StageSummary } from "./stages";
+
+// Typed column storage for structures created with a value schema. Instead
+// of one JS object per node (plus one per value, with its own copy of every
+// key), the node list is a handful of typed arrays: id, active and next, and
+// one column per schema field. Values that do not fit the schema, and
+// metadata, are kept per row in sparse maps, so the common case of uniform
+// numeric records costs a few bytes per field.
+//
+// The rest of the server still sees LiveNode objects: liveOps dispatches to
+// this store when a structure has columns, and projectStructure() rebuilds
+// the usual JSON shape for responses.
+
+export const COLUMN_TYPES = {
+  float32: Float32Array,
+  float64: Float64Array,
+  int8: Int8Array,
+  uint8: Uint8Array,
+  int16: Int16Array,
+  uint16: Uint16Array,
+  int32: Int32Array,
+  uint32: Uint32Array,
+} as const;
+
+export type ColumnType = keyof typeof COLUMN_TYPES;
+export type Column = InstanceType<(typeof COLUMN_TYPES)[ColumnType]>;
+
+// One element of each column type, for checking that a number survives
+// being stored in it: in range, integral for integer types, and exact in
+// single precision for float32
+const PROBES = Object.fromEntries(
+  Object.entries(COLUMN_TYPES).map(([type, Type]) => [type, new Type(1)]),
+) as Record<ColumnType, Column>;
+
+function fitsColumn(type: ColumnType, value: number): boolean {
+  const probe = PROBES[type];
+  probe[0] = value;
+  return probe[0] === value;
+}
+
+export interface SchemaField {
+  name: string;
+  type: ColumnType;
+}
+
+// Per-row state of the value
+const VALUE_NULL = 0;
+const VALUE_COLUMNS = 1;
+const VALUE_OVERFLOW = 2;
+
+const NO_NEXT = -1;
+const MIN_CAPACITY = 16;
+
+/**
+ * Accept a schema as [{ name, type }, ...] or { name: type, ... }
+ */
+export function parseSchema(raw: unknown): SchemaField[] {
+  const entries: [unknown, unknown][] = Array.isArray(raw)
+    ? raw.map((field: any) => [field?.name, field?.type])
+    : raw && typeof raw === "object"
+      ? Object.entries(raw)
+      : [];
+  if (entries.length === 0) {
+    throw new LiveOpError(400, "schema must list at least one field");
+  }
+
+  const seen = new Set<string>();
+  return entries.map(([name, type]) => {
+    if (typeof name !== "string" || name.length === 0 || seen.has(name)) {
+      throw new LiveOpError(400, "schema field names must be unique non-empty strings");
+    }
+    if (typeof type !== "string" || !(type in COLUMN_TYPES)) {
+      throw new LiveOpError(400, `schema field ${name}: type must be one of ${Object.keys(COLUMN_TYPES).join(", ")}`);
+    }
+    seen.add(name);
+    return { name, type: type as ColumnType };
+  });
+}
+
+/**
+ * Bytes per row of a binary row block: i32 node id, then each field in
+ * schema order, little-endian and unpadded
+ */
+export function rowSize(schema: SchemaField[]): number {
+  return schema.reduce((size, field) => size + COLUMN_TYPES[field.type].BYTES_PER_ELEMENT, 4);
+}
+
+export class NodeColumns {
+  length = 0;
+  ids: Int32Array;
+  active: Uint8Array;
+  next: Int32Array;
+  valueKind: Uint8Array;
+  columns: Column[];
+  overflow = new Map<number, any>();
+  metadata = new Map<number, Record<string, any>>();
+
+  constructor(readonly schema: SchemaField[], capacity = MIN_CAPACITY) {
+    capacity = Math.max(capacity, MIN_CAPACITY);
+    this.ids = new Int32Array(capacity);
+    this.active = new Uint8Array(capacity);
+    this.next = new Int32Array(capacity);
+    this.valueKind = new Uint8Array(capacity);
+    this.columns = schema.map(field => new COLUMN_TYPES[field.type](capacity));
+  }
+
+  /**
+   * Row holding a node ID, or -1. IDs are usually handed out in order, so
+   * the row is tried at the ID's offset from the first before scanning.
+   */
+  rowOf(id: number): number {
+    if (this.length === 0) return -1;
+    const guess = id - this.ids[0];
+    if (guess >= 0 && guess < this.length && this.ids[guess] === id) return guess;
+    return this.ids.subarray(0, this.length).indexOf(id);
+  }
+
+  /**
+   * Append or insert a row, shifting later rows (and their sparse entries)
+   * up by one
+   */
+  insert(row: number, id: number, value: any, active: boolean, metadata: Record<string, any>) {
+    this.reserve(this.length + 1);
+    if (row < this.length) {
+      this.shiftRows(row);
+    }
+    this.length++;
+    this.ids[row] = id;
+    this.active[row] = active ? 1 : 0;
+    this.next[row] = NO_NEXT;
+    this.setValue(row, value);
+    this.setMetadata(row, metadata);
+  }
+
+  setValue(row: number, value: any) {
+    this.overflow.delete(row);
+    if (value === null || value === undefined) {
+      this.valueKind[row] = VALUE_NULL;
+    } else if (this.fitsColumns(value)) {
+      this.valueKind[row] = VALUE_COLUMNS;
+      for (let i = 0; i < this.columns.length; i++) {
+        this.columns[i][row] = value[this.schema[i].name];
+      }
+    } else {
+      this.valueKind[row] = VALUE_OVERFLOW;
+      this.overflow.set(row, value);
+    }
+  }
+
+  value(row: number): any {
+    switch (this.valueKind[row]) {
+      case VALUE_COLUMNS: {
+        const value: Record<string, number> = {};
+        for (let i = 0; i < this.columns.length; i++) {
+          value[this.schema[i].name] = this.columns[i][row];
+        }
+        return value;
+      }
+      case VALUE_OVERFLOW:
+        return this.overflow.get(row);
+      default:
+        return null;
+    }
+  }
+
+  getMetadata(row: number): Record<string, any> {
+    let metadata = this.metadata.get(row);
+    if (!metadata) {
+      metadata = {};
+      this.metadata.set(row, metadata);
+    }
+    return metadata;
+  }
+
+  setMetadata(row: number, metadata: Record<string, any>) {
+    if (metadata && Object.keys(metadata).length > 0) {
+      this.metadata.set(row, metadata);
+    } else {
+      this.metadata.delete(row);
+    }
+  }
+
+  node(row: number): LiveNode {
+    const next = this.next[row];
+    return {
+      id: this.ids[row],
+      value: this.value(row),
+      active: this.active[row] === 1,
+      next: next === NO_NEXT ? null : next,
+      metadata: this.metadata.get(row) ?? {},
+    };
+  }
+
+  toNodes(): LiveNode[] {
+    const nodes = new Array<LiveNode>(this.length);
+    for (let row = 0; row < this.length; row++) {
+      nodes[row] = this.node(row);
+    }
+    return nodes;
+  }
+
+  /** Relink rows in order; `onChange` gets the ID of each row whose next moved */
+  relink(relink: Relink, onChange?: (id: number) => void) {
+    if (relink === "none") return;
+    const link = (row: number, next: number) => {
+      if (this.next[row] === next) return;
+      this.next[row] = next;
+      onChange?.(this.ids[row]);
+    };
+    let previous = -1;
+    for (let row = 0; row < this.length; row++) {
+      if (relink === "active" && !this.active[row]) continue;
+      if (previous >= 0) link(previous, this.ids[row]);
+      previous = row;
+    }
+    if (previous >= 0) link(previous, NO_NEXT);
+  }
+
+  /**
+   * Append a binary row block to `structure`, whose columns these are. All
+   * IDs are checked before any row is written, so a bad block leaves the
+   * store untouched; the caller claims the returned IDs.
+   * @returns the IDs of the new rows; -1 in the block means "assign one"
+   */
+  appendRows(block: Buffer, structure: LiveStructure, linked: boolean): { ids: Int32Array; nextId: number } {
+    const size = rowSize(this.schema);
+    if (block.length % size !== 0) {
+      throw new LiveOpError(400, `Row block length ${block.length} is not a multiple of the ${size}-byte row`);
+    }
+    const count = block.length / size;
+    const view = new DataView(block.buffer, block.byteOffset, block.byteLength);
+
+    const ids = new Int32Array(count);
+    const given = new Set<number>();
+    let nextId = structure.next_node_id;
+    for (let i = 0; i < count; i++) {
+      let id = view.getInt32(i * size, true);
+      if (id === -1) {
+        id = nextNodeId(structure, nextId++);
+      } else {
+        try {
+          checkNodeId(structure, id);
+          if (given.has(id)) throw new LiveOpError(409, `Node id ${id} is already in use`);
+        } catch (error) {
+          if (error instanceof LiveOpError) throw new LiveOpError(error.status, `Row ${i}: ${error.message}`);
+          throw error;
+        }
+        given.add(id);
+      }
+      ids[i] = id;
+    }
+
+    this.reserve(this.length + count);
+    const readers = this.schema.map(field => columnReader(field.type));
+    const first = this.length;
+    for (let i = 0; i < count; i++) {
+      const row = first + i;
+      let offset = i * size + 4;
+      this.ids[row] = ids[i];
+      this.active[row] = 1;
+      this.next[row] = NO_NEXT;
+      this.valueKind[row] = VALUE_COLUMNS;
+      for (let f = 0; f < readers.length; f++) {
+        this.columns[f][row] = readers[f](view, offset);
+        offset += this.columns[f].BYTES_PER_ELEMENT;
+      }
+    }
+    this.length += count;
+
+    if (linked && count > 0) {
+      // Same as appending one node at a time: each links to the one before
+      for (let row = Math.max(first - 1, 0); row < this.length - 1; row++) {
+        this.next[row] = this.ids[row + 1];
+      }
+    }
+    return { ids, nextId };
+  }
+
+  /** Approximate bytes held, for stats */
+  byteLength(): number {
+    let bytes = this.ids.byteLength + this.active.byteLength + this.next.byteLength + this.valueKind.byteLength;
+    for (const column of this.columns) bytes += column.byteLength;
+    return bytes;
+  }
+
+  /**
+   * Whether a value can live in the columns and read back as the same JSON:
+   * exactly the schema's keys, each a number its column holds exactly.
+   * Anything else (booleans included) is kept in overflow.
+   */
+  private fitsColumns(value: any): boolean {
+    if (typeof value !== "object" || Array.isArray(value)) return false;
+    let keys = 0;
+    for (const key in value) keys++;
+    if (keys !== this.schema.length) return false;
+    for (const field of this.schema) {
+      const v = value[field.name];
+      if (typeof v !== "number" || !fitsColumn(field.type, v)) return false;
+    }
+    return true;
+  }
+
+  private reserve(capacity: number) {
+    if (capacity <= this.ids.length) return;
+    let grown = this.ids.length * 2;
+    while (grown < capacity) grown *= 2;
+    this.ids = growArray(this.ids, grown);
+    this.active = growArray(this.active, grown);
+    this.next = growArray(this.next, grown);
+    this.valueKind = growArray(this.valueKind, grown);
+    this.columns = this.columns.map(column => growArray(column, grown));
+  }
+
+  private shiftRows(row: number) {
+    const end = this.length;
+    this.ids.copyWithin(row + 1, row, end);
+    this.active.copyWithin(row + 1, row, end);
+    this.next.copyWithin(row + 1, row, end);
+    this.valueKind.copyWithin(row + 1, row, end);
+    for (const column of this.columns) column.copyWithin(row + 1, row, end);
+    this.overflow = shiftKeys(this.overflow, row);
+    this.metadata = shiftKeys(this.metadata, row);
+  }
+}
+
+function growArray<T extends Column>(array: T, capacity: number): T {
+  const grown = new (array.constructor as any)(capacity) as T;
+  grown.set(array as any);
+  return grown;
+}
+
+function shiftKeys<V>(map: Map<number, V>, from: number): Map<number, V> {
+  if (map.size === 0) return map;
+  const shifted = new Map<number, V>();
+  map.forEach((value, row) => shifted.set(row >= from ? row + 1 : row, value));
+  return shifted;
+}
+
+function columnReader(type: ColumnType): (view: DataView, offset: number) => number {
+  switch (type) {
+    case "float32": return (view, offset) => view.getFloat32(offset, true);
+    case "float64": return (view, offset) => view.getFloat64(offset, true);
+    case "int8": return (view, offset) => view.getInt8(offset);
+    case "uint8": return (view, offset) => view.getUint8(offset);
+    case "int16": return (view, offset) => view.getInt16(offset, true);
+    case "uint16": return (view, offset) => view.getUint16(offset, true);
+    case "int32": return (view, offset) => view.getInt32(offset, true);
+    case "uint32": return (view, offset) => view.getUint32(offset, true);
+  }
+}
+
+export type StructureView = Omit<LiveStructure, "columns" | "stages" | "node_versions" | "order_version" | "node_ids"> & {
+  stages?: StageSummary[];
+};
+
+/**
+ * The structure as clients see it: columnar node storage is expanded back
+ * into LiveNode objects with the schema listed alongside, and stage
+ * snapshots are summarised without their masks
+ */
+export function projectStructure(structure: LiveStructure): StructureView {
+  const { columns, stages, node_versions, order_version, node_ids, ...rest } = structure;
+  if (!columns && !stages) return rest;
+  return {
+    ...rest,
+    ...(columns ? { schema: columns.schema, nodes: columns.toNodes() } : {}),
+    ...(stages ? { stages: stageSummaries(structure) } : {}),
+  };
+}
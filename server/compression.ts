@@ -0,0 +1,122 @@
+import zlib from "zlib";
+import { promisify } from "util";
+import type { Request, Response, NextFunction } from "express";
+
+// Content-Encoding support for bulk traffic. Clients compress large request
+// bodies (batches, whole-beam uploads) and ask for compressed snapshots;
+// both are repetitive numeric JSON or MessagePack and shrink several-fold.
+// zstd is used when this Node build has it (22.15 and later), gzip otherwise.
+
+const MAX_BODY = 50 * 1024 * 1024;
+const RESPONSE_THRESHOLD = 1024;
+
+const zstdDecompress = (zlib as any).zstdDecompress ? promisify((zlib as any).zstdDecompress) : undefined;
+const zstdCompress = (zlib as any).zstdCompress ? promisify((zlib as any).zstdCompress) : undefined;
+const gunzip = promisify(zlib.gunzip);
+const inflate = promisify(zlib.inflate);
+const gzip = promisify(zlib.gzip);
+
+function decoderFor(encoding: string): ((body: Buffer) => Promise<Buffer>) | undefined {
+  switch (encoding) {
+    case "gzip":
+    case "x-gzip":
+      return body => gunzip(body, { maxOutputLength: MAX_BODY });
+    case "deflate":
+      return body => inflate(body, { maxOutputLength: MAX_BODY });
+    case "zstd":
+      return zstdDecompress && (body => zstdDecompress(body, { maxOutputLength: MAX_BODY }));
+    default:
+      return undefined;
+  }
+}
+
+/**
+ * Inflate compressed request bodies before the body parsers run. JSON is
+ * parsed here; any other type is left as a Buffer in req.body, where the
+ * wire-format middleware and raw routes pick it up as usual.
+ */
+export function decompressRequests() {
+  return (req: Request, res: Response, next: NextFunction) => {
+    const encoding = String(req.headers["content-encoding"] ?? "identity").trim().toLowerCase();
+    if (encoding === "identity") return next();
+
+    const decode = decoderFor(encoding);
+    if (!decode) {
+      return res.status(415).json({ message: `Unsupported Content-Encoding "${encoding}"` });
+    }
+
+    const chunks: Buffer[] = [];
+    let received = 0;
+    req.on("data", (chunk: Buffer) => {
+      received += chunk.length;
+      if (received > MAX_BODY) {
+        req.destroy();
+        return;
+      }
+      chunks.push(chunk);
+    });
+    req.on("error", next);
+    req.on("end", async () => {
+      try {
+        const body = await decode(Buffer.concat(chunks));
+        delete req.headers["content-encoding"];
+        req.headers["content-length"] = String(body.length);
+        req.body = req.is("json") ? (body.length > 0 ? JSON.parse(body.toString("utf8")) : {}) : body;
+        // Tells the body parsers the body has already been read
+        (req as any)._body = true;
+        next();
+      } catch (error) {
+        res.status(400).json({ message: `Invalid ${encoding} body`, error: String(error) });
+      }
+    });
+  };
+}
+
+function preferredEncoding(acceptEncoding: string | undefined): "zstd" | "gzip" | undefined {
+  if (!acceptEncoding) return undefined;
+  const accepted = new Set(
+    acceptEncoding
+      .split(",")
+      .map(part => part.trim().toLowerCase().split(";"))
+      .filter(([, q]) => !q || !/^\s*q\s*=\s*0(\.0*)?\s*$/.test(q))
+      .map(([coding]) => coding),
+  );
+  if (zstdCompress && accepted.has("zstd")) return "zstd";
+  if (accepted.has("gzip")) return "gzip";
+  return undefined;
+}
+
+/**
+ * Compress replies of at least RESPONSE_THRESHOLD bytes when the client
+ * accepts zstd or gzip. Applied to the snapshot routes, whose replies grow
+ * with the structure.
+ */
+export function compressResponses() {
+  return (req: Request, res: Response, next: NextFunction) => {
+    const encoding = preferredEncoding(req.headers["accept-encoding"]);
+    res.vary("Accept-Encoding");
+    if (!encoding) return next();
+
+    const send = res.send.bind(res);
+    res.send = ((body?: any) => {
+      if (!(typeof body === "string" || Buffer.isBuffer(body)) || res.getHeader("Content-Encoding")) {
+        return send(body);
+      }
+      const data = typeof body === "string" ? Buffer.from(body) : body;
+      if (data.length < RESPONSE_THRESHOLD) {
+        return send(body);
+      }
+
+      const compress = encoding === "zstd" ? zstdCompress!(data) : gzip(data, { level: 1 });
+      compress.then(
+        (compressed: Buffer) => {
+          res.setHeader("Content-Encoding", encoding);
+          send(compressed);
+        },
+        () => send(body),
+      );
+      return res;
+    }) as Response["send"];
+    next();
+  };
+}
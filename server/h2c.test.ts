@@ -0,0 +1,52 @@
+import { test } from "node:test";
+import assert from "node:assert/strict";
+import http2 from "http2";
+import zlib from "zlib";
+import { once } from "events";
+import type { AddressInfo } from "net";
+import { listenH2c } from "./h2c";
+
+function request(session: http2.ClientHttp2Session, headers: http2.OutgoingHttpHeaders, body: Buffer) {
+  return new Promise<{ status: number; body: any }>((resolve, reject) => {
+    const stream = session.request(headers);
+    const chunks: Buffer[] = [];
+    let status = 0;
+    stream.on("response", response => (status = Number(response[":status"])));
+    stream.on("data", (chunk: Buffer) => chunks.push(chunk));
+    stream.on("end", () => resolve({ status, body: JSON.parse(Buffer.concat(chunks).toString("utf8")) }));
+    stream.on("error", reject);
+    stream.end(body);
+  });
+}
+
+test("the h2c listener accepts compressed batches", async () => {
+  const server = await listenH2c(0);
+  if (!server.listening) await once(server, "listening");
+  const session = http2.connect(`http://127.0.0.1:${(server.address() as AddressInfo).port}`);
+
+  try {
+    const created = await request(
+      session,
+      { ":method": "POST", ":path": "/api/live/structure", "content-type": "application/json" },
+      Buffer.from(JSON.stringify({ name: "h2c-gzip", type: "array", initialSize: 0 })),
+    );
+    assert.equal(created.status, 200);
+
+    const ops = [1, 2, 3].map(value => ({ op: "add", value }));
+    const batch = await request(
+      session,
+      {
+        ":method": "POST",
+        ":path": "/api/live/structure/h2c-gzip/batch",
+        "content-type": "application/json",
+        "content-encoding": "gzip",
+      },
+      zlib.gzipSync(JSON.stringify({ ops })),
+    );
+    assert.equal(batch.status, 200);
+    assert.equal(batch.body.count, 3);
+  } finally {
+    session.close();
+    server.close();
+  }
+});
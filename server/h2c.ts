@@ -0,0 +1,38 @@
+import express from "express";
+import http2 from "http2";
+import { registerRoutes } from "./routes";
+import { installBodyParsers } from "./middleware";
+import { log } from "./vite";
+
+// Cleartext HTTP/2 (h2c) listener for the C++ client's multiplexed sender.
+// Node cannot upgrade an HTTP/1.1 connection to h2c, so clients connect with
+// prior knowledge on a dedicated port (h2c://host:port on the client side).
+export async function listenH2c(port: number) {
+  const app = express();
+
+  // Express 4 builds its req/res on top of http.IncomingMessage and
+  // http.ServerResponse. Give this app copies of Express's request/response
+  // methods that sit on the HTTP/2 compatibility classes instead, so the
+  // getters they rely on (url, method, headers, ...) resolve.
+  const h2Request = Object.create(
+    http2.Http2ServerRequest.prototype,
+    Object.getOwnPropertyDescriptors(express.request),
+  );
+  const h2Response = Object.create(
+    http2.Http2ServerResponse.prototype,
+    Object.getOwnPropertyDescriptors(express.response),
+  );
+  Object.setPrototypeOf(app.request, h2Request);
+  Object.setPrototypeOf(app.response, h2Response);
+
+  installBodyParsers(app);
+
+  // Routes share the in-memory storage with the HTTP/1.1 server
+  await registerRoutes(app);
+
+  const server = http2.createServer({}, app as any);
+  server.listen(port, "0.0.0.0", () => {
+    log(`serving h2c on port ${port}`);
+  });
+  return server;
+}
@@ -1,10 +1,13 @@
 import express, { type Request, Response, NextFunction } from "express";
+import fs from "fs";
+import { createServer } from "http";
 import { registerRoutes } from "./routes";
 import { setupVite, serveStatic, log } from "./vite";
+import { listenH2c } from "./h2c";
+import { installBodyParsers } from "./middleware";
 
 const app = express();
-app.use(express.json());
-app.use(express.urlencoded({ extended: false }));
+installBodyParsers(app);
 
 app.use((req, res, next) => {
   const start = Date.now();
@@ -67,4 +70,22 @@ app.use((req, res, next) => {
   }, () => {
     log(`serving on port ${port}`);
   });
+
+  // Optional Unix domain socket listener for clients on the same host. It
+  // skips the TCP loopback stack and needs no free port.
+  const socketPath = process.env.LIVE_SOCKET_PATH;
+  if (socketPath) {
+    // A socket file left behind by a previous run would make listen() fail
+    if (fs.existsSync(socketPath)) {
+      fs.unlinkSync(socketPath);
+    }
+    createServer(app).listen(socketPath, () => {
+      log(`serving on unix socket ${socketPath}`);
+    });
+  }
+
+  // Optional cleartext HTTP/2 listener for multiplexed live API clients
+  if (process.env.H2C_PORT) {
+    await listenH2c(parseInt(process.env.H2C_PORT));
+  }
 })();
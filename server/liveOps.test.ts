@@ -0,0 +1,130 @@
+import { test } from "node:test";
+import assert from "node:assert/strict";
+import type { LiveStructure } from "./storage";
+import { addNode, applyBatch, reserveNodeIds, LiveOpError, MAX_NODE_ID, MAX_RESERVATION } from "./liveOps";
+import { NodeColumns, parseSchema } from "./columnar";
+
+function structure(columnar = false): LiveStructure {
+  return {
+    id: 1,
+    name: "test",
+    type: "linked_list",
+    depth: 1,
+    nodes: [],
+    next_node_id: 0,
+    version: 0,
+    created_at: "",
+    last_modified: "",
+    columns: columnar ? new NodeColumns(parseSchema({ x: "float64" })) : undefined,
+  };
+}
+
+function rejects(status: number, fn: () => unknown) {
+  assert.throws(fn, (error: unknown) => error instanceof LiveOpError && error.status === status);
+}
+
+test("reserveNodeIds caps a block and the ID space", () => {
+  const s = structure();
+  rejects(400, () => reserveNodeIds(s, 0));
+  rejects(400, () => reserveNodeIds(s, MAX_RESERVATION + 1));
+  rejects(400, () => reserveNodeIds(s, 2e9));
+  assert.equal(s.next_node_id, 0);
+  assert.deepEqual(reserveNodeIds(s, MAX_RESERVATION), { start: 0, count: MAX_RESERVATION });
+
+  // The last ID a client can count in an int is handed out, none past it
+  s.next_node_id = MAX_NODE_ID - 1;
+  assert.deepEqual(reserveNodeIds(s, 2), { start: MAX_NODE_ID - 1, count: 2 });
+  rejects(409, () => reserveNodeIds(s, 1));
+  rejects(409, () => addNode(s, { value: 1 }));
+  rejects(409, () => applyBatch(s, [{ op: "add", value: 1 }]));
+  assert.equal(s.next_node_id, MAX_NODE_ID + 1);
+});
+
+for (const columnar of [false, true]) {
+  const layout = columnar ? "columns" : "nodes";
+
+  test(`addNode refuses IDs that were never reserved (${layout})`, () => {
+    const s = structure(columnar);
+    reserveNodeIds(s, 4);
+    rejects(400, () => addNode(s, { id: 4, value: { x: 1 } }));
+    rejects(400, () => addNode(s, { id: 2 ** 31 - 1, value: { x: 1 } }));
+    assert.equal(s.next_node_id, 4);
+    assert.ok((s.node_ids?.length ?? 0) <= 32);
+    assert.equal(addNode(s, { id: 3, value: { x: 1 } }).node.id, 3);
+  });
+
+  test(`addNode refuses IDs already in use (${layout})`, () => {
+    const s = structure(columnar);
+    reserveNodeIds(s, 4);
+    addNode(s, { id: 1, value: { x: 1 } });
+    rejects(409, () => addNode(s, { id: 1, value: { x: 2 } }));
+    // A server-assigned ID never collides with a reserved one
+    assert.equal(addNode(s, { value: { x: 3 } }).node.id, 4);
+    rejects(409, () => addNode(s, { id: 4, value: { x: 4 } }));
+    const count = columnar ? s.columns!.length : s.nodes.length;
+    assert.equal(count, 2);
+  });
+
+  test(`a batch with a duplicate ID is refused as a whole (${layout})`, () => {
+    const s = structure(columnar);
+    reserveNodeIds(s, 4);
+    rejects(409, () => applyBatch(s, [{ op: "add", id: 0 }, { op: "add", id: 0 }]));
+  });
+}
+
+for (const columnar of [false, true]) {
+  const layout = columnar ? "columns" : "nodes";
+
+  test(`a failing batch leaves the structure untouched (${layout})`, () => {
+    const s = structure(columnar);
+    reserveNodeIds(s, 4);
+    applyBatch(s, [{ op: "add", id: 0, value: { x: 1 } }]);
+    const before = JSON.stringify({ ...s, node_versions: Array.from(s.node_versions ?? []), node_ids: Array.from(s.node_ids ?? []) });
+
+    rejects(404, () => applyBatch(s, [
+      { op: "add", id: 1, value: { x: 2 } },
+      { op: "update", id: 0, value: { x: 3 } },
+      { op: "remove", id: 3 },
+    ]));
+    rejects(400, () => applyBatch(s, [{ op: "update", id: 0, value: { x: 3 } }, { op: "move" } as any]));
+
+    const after = JSON.stringify({ ...s, node_versions: Array.from(s.node_versions ?? []), node_ids: Array.from(s.node_ids ?? []) });
+    assert.equal(after, before);
+  });
+
+  test(`a batch is applied in place (${layout})`, () => {
+    const s = structure(columnar);
+    reserveNodeIds(s, 4);
+    const columns = s.columns;
+    const nodes = s.nodes;
+    const ids = applyBatch(s, [
+      { op: "add", id: 2, value: { x: 1 } },
+      { op: "add", value: { x: 2 } },
+      { op: "update", id: 2, value: { x: 5 } },
+      { op: "remove", id: 4 },
+    ]);
+    assert.deepEqual(ids, [2, 4, 2, 4]);
+    assert.equal(s.columns, columns);
+    assert.equal(s.nodes, nodes);
+    assert.equal(s.next_node_id, 5);
+  });
+
+  test(`a drop op skips IDs with no node, as the drop route does (${layout})`, () => {
+    const s = structure(columnar);
+    reserveNodeIds(s, 4);
+    applyBatch(s, [{ op: "add", id: 0, value: { x: 1 } }, { op: "add", id: 1, value: { x: 2 } }]);
+    const ids = applyBatch(s, [
+      { op: "drop", id: 1 },
+      { op: "drop", id: 3 },
+      { op: "drop", id: 1000 },
+      { op: "add", id: 2, value: { x: 3 } },
+      { op: "drop", id: 2 },
+    ]);
+    assert.deepEqual(ids, [1, 3, 1000, 2, 2]);
+    const active = columnar
+      ? Array.from(s.columns!.ids).filter((_, row) => s.columns!.active[row])
+      : s.nodes.filter(node => node.active).map(node => node.id);
+    assert.deepEqual(active, [0]);
+    rejects(400, () => applyBatch(s, [{ op: "drop", id: "x" } as any]));
+  });
+}
@@ -0,0 +1,367 @@
+import type { LiveNode, LiveStructure } from "./storage";
+import type { NodeColumns } from "./columnar";
+import { stampNode, stampOrder } from "./versions";
+
+// Shared node mutation helpers for live structures. The single-op routes and
+// the batch route both go through these so that an op means the same thing
+// regardless of how it reached the server. Structures created with a schema
+// keep their nodes in NodeColumns; each helper handles both layouts, and
+// stamps the nodes it changes so delta fetches can find them.
+
+export type LiveOp =
+  | { op: "add"; id?: number; value?: any; index?: number; metadata?: Record<string, any> }
+  | { op: "remove"; id: number }
+  | { op: "drop"; id: number }
+  | { op: "update"; id: number; value?: any; metadata?: Record<string, any> };
+
+export class LiveOpError extends Error {
+  constructor(public status: number, message: string) {
+    super(message);
+  }
+}
+
+// Which relink a sequence of ops needs once it has been applied. Indexed
+// inserts relink every node, removals relink only the active ones.
+export type Relink = "none" | "all" | "active";
+
+// IDs stay within a signed 32-bit int, which is what clients count them in;
+// per-ID arrays are sized from the largest one, so blocks are capped too
+export const MAX_NODE_ID = 2 ** 31 - 1;
+export const MAX_RESERVATION = 65536;
+
+/** Take the next server-assigned ID, if the structure has one left */
+export function nextNodeId(structure: LiveStructure, next = structure.next_node_id): number {
+  if (next > MAX_NODE_ID) {
+    throw new LiveOpError(409, "Node ids for this structure are used up");
+  }
+  return next;
+}
+
+// Hand out a contiguous range of node IDs. Clients that reserve IDs up front
+// can name their nodes without waiting for the server to do it.
+export function reserveNodeIds(structure: LiveStructure, count: number): { start: number; count: number } {
+  if (!Number.isInteger(count) || count < 1 || count > MAX_RESERVATION) {
+    throw new LiveOpError(400, `count must be an integer from 1 to ${MAX_RESERVATION}`);
+  }
+  const start = structure.next_node_id;
+  if (start + count - 1 > MAX_NODE_ID) {
+    throw new LiveOpError(409, "Node ids for this structure are used up");
+  }
+  structure.next_node_id += count;
+  return { start, count };
+}
+
+export function nodeIdInUse(structure: LiveStructure, id: number): boolean {
+  const used = structure.node_ids;
+  return used !== undefined && Number.isInteger(id) && id >= 0 && id >>> 5 < used.length && (used[id >>> 5] & (1 << (id & 31))) !== 0;
+}
+
+/** Record that a node ID is taken. IDs stay taken: nodes are only ever marked inactive. */
+export function claimNodeId(structure: LiveStructure, id: number) {
+  let used = structure.node_ids;
+  const word = id >>> 5;
+  if (!used || word >= used.length) {
+    let capacity = Math.max(used?.length ?? 0, 32);
+    while (capacity <= word) capacity *= 2;
+    const grown = new Uint32Array(capacity);
+    if (used) grown.set(used);
+    structure.node_ids = used = grown;
+  }
+  used[word] |= 1 << (id & 31);
+}
+
+/**
+ * Check a client-supplied node ID. It must come from a range handed out by
+ * reserveNodeIds, so IDs past next_node_id are refused: per-ID arrays (change
+ * versions, stage masks, the ID bitmap) are sized from them.
+ */
+export function checkNodeId(structure: LiveStructure, id: number) {
+  if (!Number.isInteger(id) || id < 0) {
+    throw new LiveOpError(400, "Node id must be a non-negative integer");
+  }
+  if (id >= structure.next_node_id) {
+    throw new LiveOpError(400, `Node id ${id} was not reserved`);
+  }
+  if (nodeIdInUse(structure, id)) {
+    throw new LiveOpError(409, `Node id ${id} is already in use`);
+  }
+}
+
+export function addNode(
+  structure: LiveStructure,
+  op: { id?: number; value?: any; index?: number; metadata?: Record<string, any> },
+): { node: LiveNode; relink: Relink } {
+  let nodeId: number;
+  if (op.id !== undefined && op.id !== null) {
+    nodeId = Number(op.id);
+    checkNodeId(structure, nodeId);
+  } else {
+    nodeId = nextNodeId(structure);
+    structure.next_node_id++;
+  }
+  claimNodeId(structure, nodeId);
+
+  const columns = structure.columns;
+  if (columns) {
+    const index = op.index;
+    const indexed = index !== undefined && index !== null && index >= 0 && index <= columns.length;
+    const row = indexed ? index : columns.length;
+    columns.insert(row, nodeId, op.value, true, op.metadata ?? {});
+    stampNode(structure, nodeId);
+    if (indexed) {
+      stampOrder(structure);
+      return { node: columns.node(row), relink: structure.type === 'linked_list' ? "all" : "none" };
+    }
+    if (structure.type === 'linked_list' && row > 0) {
+      columns.next[row - 1] = nodeId;
+      stampNode(structure, columns.ids[row - 1]);
+    }
+    return { node: columns.node(row), relink: "none" };
+  }
+
+  const newNode: LiveNode = {
+    id: nodeId,
+    value: op.value,
+    active: true,
+    next: null,
+    metadata: op.metadata ?? {},
+  };
+
+  stampNode(structure, nodeId);
+  const index = op.index;
+  if (index !== undefined && index !== null && index >= 0 && index <= structure.nodes.length) {
+    structure.nodes.splice(index, 0, newNode);
+    stampOrder(structure);
+    return { node: newNode, relink: structure.type === 'linked_list' ? "all" : "none" };
+  }
+
+  structure.nodes.push(newNode);
+  // For linked list, link the previous last node to this one
+  if (structure.type === 'linked_list' && structure.nodes.length > 1) {
+    const previous = structure.nodes[structure.nodes.length - 2];
+    previous.next = nodeId;
+    stampNode(structure, previous.id);
+  }
+  return { node: newNode, relink: "none" };
+}
+
+export function removeNode(structure: LiveStructure, nodeId: number, droppedAt: string): { node: LiveNode; relink: Relink } {
+  const columns = structure.columns;
+  if (columns) {
+    const row = findRow(columns, nodeId);
+    columns.active[row] = 0;
+    columns.getMetadata(row).dropped_at = droppedAt;
+    stampNode(structure, nodeId);
+    return { node: columns.node(row), relink: structure.type === 'linked_list' ? "active" : "none" };
+  }
+
+  const node = structure.nodes.find(n => n.id === nodeId);
+  if (!node) {
+    throw new LiveOpError(404, "Node not found");
+  }
+
+  // Mark as inactive instead of actual removal for visualization
+  node.active = false;
+  node.metadata.dropped_at = droppedAt;
+  stampNode(structure, nodeId);
+  return { node, relink: structure.type === 'linked_list' ? "active" : "none" };
+}
+
+/**
+ * Drop every node selected by a packed bitmap in one pass: bit i (least
+ * significant first within each byte) selects node firstId + i. All dropped
+ * nodes share one dropped_at stamp, and the caller relinks once afterwards.
+ * Returns the number of nodes dropped.
+ */
+export function dropNodes(
+  structure: LiveStructure,
+  mask: Uint8Array,
+  firstId: number,
+  droppedAt: string,
+): { count: number; relink: Relink } {
+  const bits = mask.length * 8;
+  const selected = (id: number) => {
+    const bit = id - firstId;
+    return bit >= 0 && bit < bits && (mask[bit >> 3] & (1 << (bit & 7))) !== 0;
+  };
+
+  let count = 0;
+  const columns = structure.columns;
+  if (columns) {
+    for (let row = 0; row < columns.length; row++) {
+      if (!selected(columns.ids[row])) continue;
+      columns.active[row] = 0;
+      columns.getMetadata(row).dropped_at = droppedAt;
+      stampNode(structure, columns.ids[row]);
+      count++;
+    }
+  } else {
+    for (const node of structure.nodes) {
+      if (!selected(node.id)) continue;
+      node.active = false;
+      node.metadata.dropped_at = droppedAt;
+      stampNode(structure, node.id);
+      count++;
+    }
+  }
+  return { count, relink: count > 0 && structure.type === 'linked_list' ? "active" : "none" };
+}
+
+export function updateNode(
+  structure: LiveStructure,
+  nodeId: number,
+  op: { value?: any; metadata?: Record<string, any> },
+  updatedAt: string,
+): LiveNode {
+  const columns = structure.columns;
+  if (columns) {
+    const row = findRow(columns, nodeId);
+    if (op.value !== undefined) columns.setValue(row, op.value);
+    const metadata = columns.getMetadata(row);
+    Object.assign(metadata, op.metadata ?? {});
+    metadata.last_updated = updatedAt;
+    stampNode(structure, nodeId);
+    return columns.node(row);
+  }
+
+  const node = structure.nodes.find(n => n.id === nodeId);
+  if (!node) {
+    throw new LiveOpError(404, "Node not found");
+  }
+
+  if (op.value !== undefined) node.value = op.value;
+  node.metadata = { ...node.metadata, ...(op.metadata ?? {}) };
+  node.metadata.last_updated = updatedAt;
+  stampNode(structure, nodeId);
+  return node;
+}
+
+export function relinkNodes(structure: LiveStructure, relink: Relink) {
+  const stamp = (id: number) => stampNode(structure, id);
+  if (structure.columns) {
+    structure.columns.relink(relink, stamp);
+  } else if (relink === "all") {
+    updateLinkedListPointers(structure.nodes, stamp);
+  } else if (relink === "active") {
+    updateLinkedListPointers(structure.nodes.filter(n => n.active), stamp);
+  }
+}
+
+/**
+ * Apply a list of ops to a structure as one unit. Every op is checked before
+ * any is applied, so a batch that would fail leaves the structure untouched
+ * without the cost of copying it. Returns the node ID each op touched, in op
+ * order.
+ */
+export function applyBatch(structure: LiveStructure, ops: LiveOp[]): number[] {
+  checkBatch(structure, ops);
+
+  const now = new Date().toISOString();
+  const ids: number[] = [];
+  let relinkAll = false;
+  let relinkActive = false;
+
+  for (const op of ops) {
+    switch (op.op) {
+      case "add": {
+        const { node, relink } = addNode(structure, op);
+        if (relink === "all") {
+          relinkAll = true;
+          relinkActive = false;
+        }
+        ids.push(node.id);
+        break;
+      }
+      case "remove": {
+        const { node, relink } = removeNode(structure, Number(op.id), now);
+        if (relink === "active") relinkActive = true;
+        ids.push(node.id);
+        break;
+      }
+      case "drop": {
+        // A remove that skips an ID with no node, as the drop route does
+        const id = Number(op.id);
+        if (nodeIdInUse(structure, id)) {
+          const { relink } = removeNode(structure, id, now);
+          if (relink === "active") relinkActive = true;
+        }
+        ids.push(id);
+        break;
+      }
+      case "update":
+        ids.push(updateNode(structure, Number(op.id), op, now).id);
+        break;
+    }
+  }
+
+  if (relinkAll) relinkNodes(structure, "all");
+  if (relinkActive) relinkNodes(structure, "active");
+  return ids;
+}
+
+/**
+ * Throw the error the first failing op of a batch would, without changing
+ * anything. Nodes are never deleted, so a node exists exactly when its ID
+ * is in use or an earlier op of the batch adds it.
+ */
+function checkBatch(structure: LiveStructure, ops: LiveOp[]) {
+  const added = new Set<number>();
+  let nextId = structure.next_node_id;
+
+  ops.forEach((op, i) => {
+    try {
+      switch (op?.op) {
+        case "add": {
+          if (op.id === undefined || op.id === null) {
+            added.add(nextNodeId(structure, nextId++));
+            break;
+          }
+          const id = Number(op.id);
+          checkNodeId(structure, id);
+          if (added.has(id)) {
+            throw new LiveOpError(409, `Node id ${id} is already in use`);
+          }
+          added.add(id);
+          break;
+        }
+        case "remove":
+        case "update": {
+          const id = Number(op.id);
+          if (!nodeIdInUse(structure, id) && !added.has(id)) {
+            throw new LiveOpError(404, "Node not found");
+          }
+          break;
+        }
+        case "drop":
+          if (!Number.isInteger(Number(op.id))) {
+            throw new LiveOpError(400, "Drop needs an integer id");
+          }
+          break;
+        default:
+          throw new LiveOpError(400, `Unknown op "${(op as any)?.op}"`);
+      }
+    } catch (error) {
+      if (error instanceof LiveOpError) {
+        throw new LiveOpError(error.status, `Op ${i}: ${error.message}`);
+      }
+      throw error;
+    }
+  });
+}
+
+function findRow(columns: NodeColumns, nodeId: number): number {
+  const row = columns.rowOf(nodeId);
+  if (row < 0) {
+    throw new LiveOpError(404, "Node not found");
+  }
+  return row;
+}
+
+export function updateLinkedListPointers(nodes: LiveNode[], onChange?: (id: number) => void) {
+  for (let i = 0; i < nodes.length; i++) {
+    const next = i < nodes.length - 1 ? nodes[i + 1].id : null;
+    if (nodes[i].next === next) continue;
+    nodes[i].next = next;
+    onChange?.(nodes[i].id);
+  }
+}
@@ -0,0 +1,13 @@
+import express, { type Express } from "express";
+import { decompressRequests } from "./compression";
+
+/**
+ * Body handling shared by every listener (HTTP/1.1, the Unix socket and
+ * h2c), so a batch any one of them accepts is accepted by all of them.
+ */
+export function installBodyParsers(app: Express) {
+  // Must run first: the body parsers below skip bodies it has already inflated
+  app.use(decompressRequests());
+  app.use(express.json({ limit: "50mb" }));
+  app.use(express.urlencoded({ extended: false }));
+}
@@ -0,0 +1,35 @@
+import { test } from "node:test";
+import assert from "node:assert/strict";
+import express from "express";
+import type { AddressInfo } from "net";
+import { installBodyParsers } from "./middleware";
+import { registerRoutes } from "./routes";
+import { MAX_RESERVATION } from "./liveOps";
+
+test("POST …/ids refuses blocks past the cap", async () => {
+  const app = express();
+  installBodyParsers(app);
+  await registerRoutes(app);
+  const server = app.listen(0);
+  const base = `http://127.0.0.1:${(server.address() as AddressInfo).port}/api/live`;
+  const post = (path: string, body: unknown) =>
+    fetch(base + path, { method: "POST", headers: { "Content-Type": "application/json" }, body: JSON.stringify(body) });
+
+  try {
+    const created = await (await post("/structure", { name: "route-ids", type: "array", initialSize: 0 })).json();
+    const ids = `/structures/${created.id}/ids`;
+
+    assert.equal((await post(ids, { count: 2e9 })).status, 400);
+    assert.equal((await post(ids, { count: MAX_RESERVATION + 1 })).status, 400);
+    assert.equal((await post(ids, { count: "many" })).status, 400);
+
+    const range = await post(ids, { count: MAX_RESERVATION });
+    assert.equal(range.status, 200);
+    assert.deepEqual(await range.json(), { start: 0, count: MAX_RESERVATION });
+
+    // Refused blocks did not move the next ID
+    assert.deepEqual(await (await post(ids, { count: 1 })).json(), { start: MAX_RESERVATION, count: 1 });
+  } finally {
+    server.close();
+  }
+});
@@ -1,10 +1,21 @@
-import type { Express } from "express";
+import express, { type Express, type Request, type Response } from "express";
 import { createServer, type Server } from "http";
 import { storage } from "./storage";
+import { addNode, removeNode, dropNodes, updateNode, relinkNodes, applyBatch, reserveNodeIds, claimNodeId, LiveOpError, type LiveOp } from "./liveOps";
+import { wireFormatMiddleware, replyFormat } from "./wireFormat";
+import { compressResponses } from "./compression";
+import { attachShmRing, detachShmRing, shmRingStats } from "./shmRing";
+import { NodeColumns, parseSchema, projectStructure } from "./columnar";
+import { canDelta, nodesSince, stampRows, structureTag } from "./versions";
+import { publishChange, subscribeChanges } from "./changeFeed";
+import { markStage, getStage, stageSummaries, diffStages, maskIds, maskBytes } from "./stages";
 import { insertCppFileSchema, insertAnalysisResultSchema } from "@shared/schema";
 import { z } from "zod";
 
 export async function registerRoutes(app: Express): Promise<Server> {
+  // Live API bodies may be MessagePack or CBOR as well as JSON
+  app.use("/api/live", ...wireFormatMiddleware());
+
   // C++ File Routes
   app.post("/api/files", async (req, res) => {
     try {
@@ -131,27 +142,46 @@ export async function registerRoutes(app: Express): Promise<Server> {
     }
   });
 
+  // Reachability check for clients; deliberately does no work
+  app.get("/api/live/health", (req, res) => {
+    res.json({ status: "ok" });
+  });
+
   // Live Data Structure Manipulation API
   // Create a new data structure
   app.post("/api/live/structure", async (req, res) => {
     try {
-      const { name, type, depth = 1, initialSize = 10 } = req.body;
+      const { name, type, depth = 1, initialSize = 10, schema } = req.body;
       
       if (!name || !type) {
         return res.status(400).json({ message: "Name and type are required" });
       }
 
+      // With a schema, node values are stored as typed columns
+      const columns = schema !== undefined ? new NodeColumns(parseSchema(schema), initialSize) : undefined;
+
       const structure = await storage.createLiveStructure({
         name,
         type,
         depth: Math.max(1, depth),
         nodes: [],
+        next_node_id: 0,
+        version: 0,
         created_at: new Date().toISOString(),
         last_modified: new Date().toISOString(),
+        columns,
       });
 
       // Initialize with empty nodes if specified
-      if (initialSize > 0) {
+      if (initialSize > 0 && columns) {
+        for (let i = 0; i < initialSize; i++) {
+          columns.insert(i, i, null, false, {});
+          claimNodeId(structure, i);
+        }
+        if (type === 'linked_list') columns.relink("all");
+        structure.next_node_id = initialSize;
+        await storage.updateLiveStructure(structure.id, structure);
+      } else if (initialSize > 0) {
         for (let i = 0; i < initialSize; i++) {
           structure.nodes.push({
             id: i,
@@ -160,140 +190,400 @@ export async function registerRoutes(app: Express): Promise<Server> {
             next: type === 'linked_list' ? (i < initialSize - 1 ? i + 1 : null) : null,
             metadata: {},
           });
+          claimNodeId(structure, i);
         }
+        structure.next_node_id = initialSize;
         await storage.updateLiveStructure(structure.id, structure);
       }
+      publishChange(structure.name);
 
-      res.json(structure);
+      res.json(projectStructure(structure));
     } catch (error) {
+      if (error instanceof LiveOpError) {
+        return res.status(error.status).json({ message: error.message });
+      }
       res.status(500).json({ message: "Failed to create structure", error });
     }
   });
 
+  // Change stream for clients mirroring structures locally; see changeFeed.ts
+  app.get("/api/live/changes", (req, res) => {
+    subscribeChanges(res);
+  });
+
   // Get all live structures
-  app.get("/api/live/structures", async (req, res) => {
+  app.get("/api/live/structures", compressResponses(), async (req, res) => {
     try {
       const structures = await storage.getAllLiveStructures();
-      res.json(structures);
+      res.json(structures.map(projectStructure));
     } catch (error) {
       res.status(500).json({ message: "Failed to fetch structures", error });
     }
   });
 
-  // Get specific structure
-  app.get("/api/live/structure/:name", async (req, res) => {
+  // Get specific structure. Replies carry an ETag, so a client re-polling an
+  // unchanged structure gets a 304; with `?since=<version>` only the nodes
+  // changed after that version are sent, marked `delta: true`.
+  app.get(structurePaths(), compressResponses(), async (req, res) => {
     try {
-      const structure = await storage.getLiveStructureByName(req.params.name);
+      let since: number | undefined;
+      if (req.query.since !== undefined) {
+        since = Number(req.query.since);
+        if (!Number.isInteger(since) || since < 0) {
+          return res.status(400).json({ message: "since must be a non-negative integer" });
+        }
+      }
+
+      const structure = await findLiveStructure(req);
       if (!structure) {
         return res.status(404).json({ message: "Structure not found" });
       }
-      res.json(structure);
+
+      res.set("ETag", structureTag(structure, replyFormat(res)));
+      if (req.fresh) {
+        return res.status(304).end();
+      }
+      if (since !== undefined && since <= structure.version && canDelta(structure, since)) {
+        const { columns, nodes, ...rest } = structure;
+        const view = projectStructure({ ...rest, nodes: [], ...(columns ? { schema: columns.schema } : {}) });
+        return res.json({ ...view, nodes: nodesSince(structure, since), delta: true, since });
+      }
+      res.json(projectStructure(structure));
     } catch (error) {
       res.status(500).json({ message: "Failed to fetch structure", error });
     }
   });
 
   // Add node to structure
-  app.post("/api/live/structure/:name/node", async (req, res) => {
+  app.post(structurePaths("/node"), async (req, res) => {
     try {
-      const { value, index, metadata = {} } = req.body;
-      const structure = await storage.getLiveStructureByName(req.params.name);
+      const { id, value, index, metadata = {} } = req.body;
+      const structure = await findLiveStructure(req);
       
       if (!structure) {
         return res.status(404).json({ message: "Structure not found" });
       }
 
-      const nodeId = structure.nodes.length > 0 ? Math.max(...structure.nodes.map(n => n.id)) + 1 : 0;
-      const newNode = {
-        id: nodeId,
-        value: value,
-        active: true,
-        next: null,
-        metadata: metadata,
-      };
-
-      if (index !== undefined && index >= 0 && index <= structure.nodes.length) {
-        structure.nodes.splice(index, 0, newNode);
-        // Update next pointers for linked list
-        if (structure.type === 'linked_list') {
-          updateLinkedListPointers(structure.nodes);
-        }
-      } else {
-        structure.nodes.push(newNode);
-        // For linked list, link the previous last node to this one
-        if (structure.type === 'linked_list' && structure.nodes.length > 1) {
-          structure.nodes[structure.nodes.length - 2].next = nodeId;
-        }
-      }
+      const { node: newNode, relink } = addNode(structure, { id, value, index, metadata });
+      relinkNodes(structure, relink);
 
+      structure.version++;
       structure.last_modified = new Date().toISOString();
       await storage.updateLiveStructure(structure.id, structure);
+      publishChange(structure.name);
 
-      res.json({ node: newNode, structure });
+      if (wantsMinimalResponse(req, res)) {
+        return res.json({ id: newNode.id, version: structure.version });
+      }
+      res.json({ node: newNode, structure: projectStructure(structure) });
     } catch (error) {
+      if (error instanceof LiveOpError) {
+        return res.status(error.status).json({ message: error.message });
+      }
       res.status(500).json({ message: "Failed to add node", error });
     }
   });
 
+  // Reserve a range of node IDs for client-side allocation
+  app.post(structurePaths("/ids"), async (req, res) => {
+    try {
+      const count = Number(req.body.count ?? 1);
+
+      const structure = await findLiveStructure(req);
+      if (!structure) {
+        return res.status(404).json({ message: "Structure not found" });
+      }
+
+      const range = reserveNodeIds(structure, count);
+      await storage.updateLiveStructure(structure.id, { next_node_id: structure.next_node_id });
+
+      res.json(range);
+    } catch (error) {
+      if (error instanceof LiveOpError) {
+        return res.status(error.status).json({ message: error.message });
+      }
+      res.status(500).json({ message: "Failed to reserve node IDs", error });
+    }
+  });
+
   // Remove node from structure
-  app.delete("/api/live/structure/:name/node/:nodeId", async (req, res) => {
+  app.delete(structurePaths("/node/:nodeId"), async (req, res) => {
     try {
       const nodeId = parseInt(req.params.nodeId);
-      const structure = await storage.getLiveStructureByName(req.params.name);
+      const structure = await findLiveStructure(req);
       
       if (!structure) {
         return res.status(404).json({ message: "Structure not found" });
       }
 
-      const nodeIndex = structure.nodes.findIndex(n => n.id === nodeId);
-      if (nodeIndex === -1) {
-        return res.status(404).json({ message: "Node not found" });
+      const { relink } = removeNode(structure, nodeId, new Date().toISOString());
+      relinkNodes(structure, relink);
+
+      structure.version++;
+      structure.last_modified = new Date().toISOString();
+      await storage.updateLiveStructure(structure.id, structure);
+      publishChange(structure.name);
+
+      if (wantsMinimalResponse(req, res)) {
+        return res.json({ id: nodeId, version: structure.version });
+      }
+      res.json({ message: "Node marked as inactive", structure: projectStructure(structure) });
+    } catch (error) {
+      if (error instanceof LiveOpError) {
+        return res.status(error.status).json({ message: error.message });
       }
+      res.status(500).json({ message: "Failed to remove node", error });
+    }
+  });
 
-      // Mark as inactive instead of actual removal for visualization
-      structure.nodes[nodeIndex].active = false;
-      structure.nodes[nodeIndex].metadata.dropped_at = new Date().toISOString();
+  // Drop many nodes at once. The body is a packed bitmap; bit i (least
+  // significant first within each byte) selects node `first + i`.
+  app.post(structurePaths("/drop"), express.raw({ type: "application/octet-stream", limit: "64mb" }), async (req, res) => {
+    try {
+      if (!Buffer.isBuffer(req.body)) {
+        return res.status(415).json({ message: "Mask must be sent as application/octet-stream" });
+      }
+      const first = parseInt(String(req.query.first ?? 0));
+      if (!Number.isInteger(first) || first < 0) {
+        return res.status(400).json({ message: "first must be a non-negative integer" });
+      }
 
-      // Update linked list pointers if needed
-      if (structure.type === 'linked_list') {
-        updateLinkedListPointers(structure.nodes.filter(n => n.active));
+      const structure = await findLiveStructure(req);
+      if (!structure) {
+        return res.status(404).json({ message: "Structure not found" });
       }
 
+      const { count, relink } = dropNodes(structure, req.body, first, new Date().toISOString());
+      relinkNodes(structure, relink);
+
+      structure.version++;
       structure.last_modified = new Date().toISOString();
       await storage.updateLiveStructure(structure.id, structure);
+      publishChange(structure.name);
 
-      res.json({ message: "Node marked as inactive", structure });
+      res.json({ count, version: structure.version });
     } catch (error) {
-      res.status(500).json({ message: "Failed to remove node", error });
+      res.status(500).json({ message: "Failed to drop nodes", error });
+    }
+  });
+
+  // Close a processing stage: snapshot the active nodes under a name
+  app.post(structurePaths("/stage"), async (req, res) => {
+    try {
+      const { stage } = req.body;
+      if (typeof stage !== "string" || stage.length === 0) {
+        return res.status(400).json({ message: "stage is required" });
+      }
+
+      const structure = await findLiveStructure(req);
+      if (!structure) {
+        return res.status(404).json({ message: "Structure not found" });
+      }
+
+      const { name, version, marked_at, active } = markStage(structure, stage, new Date().toISOString());
+      // The stage list is part of the snapshot, so it moves the version on
+      // and invalidates cached copies; the stage itself records the version
+      // it was taken at
+      structure.version++;
+      structure.last_modified = marked_at;
+      await storage.updateLiveStructure(structure.id, structure);
+      publishChange(structure.name);
+
+      res.json({ stage: name, version, marked_at, active });
+    } catch (error) {
+      res.status(500).json({ message: "Failed to mark stage", error });
+    }
+  });
+
+  app.get(structurePaths("/stages"), async (req, res) => {
+    try {
+      const structure = await findLiveStructure(req);
+      if (!structure) {
+        return res.status(404).json({ message: "Structure not found" });
+      }
+      res.json(stageSummaries(structure));
+    } catch (error) {
+      res.status(500).json({ message: "Failed to fetch stages", error });
+    }
+  });
+
+  // Nodes active at a stage, as an ID list or with `?format=bitmap` as the
+  // packed mask itself
+  app.get(structurePaths("/stage/:stage"), async (req, res) => {
+    try {
+      const structure = await findLiveStructure(req);
+      if (!structure) {
+        return res.status(404).json({ message: "Structure not found" });
+      }
+
+      const stage = getStage(structure, req.params.stage);
+      if (req.query.format === "bitmap") {
+        return res.type("application/octet-stream").send(maskBytes(stage.mask));
+      }
+      const { name, version, marked_at, active } = stage;
+      res.json({ stage: name, version, marked_at, active, ids: maskIds(stage.mask) });
+    } catch (error) {
+      if (error instanceof LiveOpError) {
+        return res.status(error.status).json({ message: error.message });
+      }
+      res.status(500).json({ message: "Failed to fetch stage", error });
+    }
+  });
+
+  // What changed between two stages: nodes dropped and nodes added
+  app.get(structurePaths("/stage/:from/diff/:to"), async (req, res) => {
+    try {
+      const structure = await findLiveStructure(req);
+      if (!structure) {
+        return res.status(404).json({ message: "Structure not found" });
+      }
+
+      const { dropped, added } = diffStages(getStage(structure, req.params.from), getStage(structure, req.params.to));
+      res.json({
+        from: req.params.from,
+        to: req.params.to,
+        dropped: maskIds(dropped),
+        added: maskIds(added),
+      });
+    } catch (error) {
+      if (error instanceof LiveOpError) {
+        return res.status(error.status).json({ message: error.message });
+      }
+      res.status(500).json({ message: "Failed to diff stages", error });
     }
   });
 
   // Update node in structure
-  app.put("/api/live/structure/:name/node/:nodeId", async (req, res) => {
+  app.put(structurePaths("/node/:nodeId"), async (req, res) => {
     try {
       const nodeId = parseInt(req.params.nodeId);
       const { value, metadata = {} } = req.body;
-      const structure = await storage.getLiveStructureByName(req.params.name);
+      const structure = await findLiveStructure(req);
       
       if (!structure) {
         return res.status(404).json({ message: "Structure not found" });
       }
 
-      const node = structure.nodes.find(n => n.id === nodeId);
-      if (!node) {
-        return res.status(404).json({ message: "Node not found" });
+      const node = updateNode(structure, nodeId, { value, metadata }, new Date().toISOString());
+
+      structure.version++;
+      structure.last_modified = new Date().toISOString();
+      await storage.updateLiveStructure(structure.id, structure);
+      publishChange(structure.name);
+
+      if (wantsMinimalResponse(req, res)) {
+        return res.json({ id: node.id, version: structure.version });
+      }
+      res.json({ node, structure: projectStructure(structure) });
+    } catch (error) {
+      if (error instanceof LiveOpError) {
+        return res.status(error.status).json({ message: error.message });
+      }
+      res.status(500).json({ message: "Failed to update node", error });
+    }
+  });
+
+  // Apply a batch of add/remove/update ops in one request. The whole batch
+  // is applied or rejected as a unit, and the touched node IDs are returned
+  // in op order.
+  app.post(structurePaths("/batch"), async (req, res) => {
+    try {
+      const { ops } = req.body;
+      if (!Array.isArray(ops)) {
+        return res.status(400).json({ message: "ops must be an array" });
       }
 
-      if (value !== undefined) node.value = value;
-      node.metadata = { ...node.metadata, ...metadata };
-      node.metadata.last_updated = new Date().toISOString();
+      const structure = await findLiveStructure(req);
+      if (!structure) {
+        return res.status(404).json({ message: "Structure not found" });
+      }
 
+      const ids = applyBatch(structure, ops as LiveOp[]);
+      structure.version++;
       structure.last_modified = new Date().toISOString();
       await storage.updateLiveStructure(structure.id, structure);
+      publishChange(structure.name);
 
-      res.json({ node, structure });
+      res.json({ ids, count: ids.length, version: structure.version });
     } catch (error) {
-      res.status(500).json({ message: "Failed to update node", error });
+      if (error instanceof LiveOpError) {
+        return res.status(error.status).json({ message: error.message });
+      }
+      res.status(500).json({ message: "Failed to apply batch", error });
+    }
+  });
+
+  // Append a block of binary rows to a structure created with a schema.
+  // Each row is an int32 node ID (-1 to have one assigned) followed by the
+  // schema fields in order, little-endian and unpadded.
+  app.post(structurePaths("/rows"), express.raw({ type: "application/octet-stream", limit: "256mb" }), async (req, res) => {
+    try {
+      if (!Buffer.isBuffer(req.body)) {
+        return res.status(415).json({ message: "Rows must be sent as application/octet-stream" });
+      }
+
+      const structure = await findLiveStructure(req);
+      if (!structure) {
+        return res.status(404).json({ message: "Structure not found" });
+      }
+      if (!structure.columns) {
+        return res.status(409).json({ message: "Structure was not created with a schema" });
+      }
+
+      const linked = structure.type === 'linked_list';
+      const first = structure.columns.length;
+      const { ids, nextId } = structure.columns.appendRows(req.body, structure, linked);
+      ids.forEach(id => claimNodeId(structure, id));
+      // The new rows, plus the old last row when it now links to them
+      stampRows(structure, linked && ids.length > 0 ? first - 1 : first);
+      structure.next_node_id = nextId;
+      structure.version++;
+      structure.last_modified = new Date().toISOString();
+      await storage.updateLiveStructure(structure.id, structure);
+      publishChange(structure.name);
+
+      res.json({ count: ids.length, first: ids.length > 0 ? ids[0] : null, version: structure.version });
+    } catch (error) {
+      if (error instanceof LiveOpError) {
+        return res.status(error.status).json({ message: error.message });
+      }
+      res.status(500).json({ message: "Failed to append rows", error });
+    }
+  });
+
+  // Start tailing a shared-memory op ring created by a client on this host
+  app.post("/api/live/shm", async (req, res) => {
+    try {
+      const { name } = req.body;
+      if (typeof name !== "string") {
+        return res.status(400).json({ message: "name is required" });
+      }
+      res.json(attachShmRing(name));
+    } catch (error) {
+      if (error instanceof LiveOpError) {
+        return res.status(error.status).json({ message: error.message });
+      }
+      res.status(500).json({ message: "Failed to attach shared memory ring", error: String(error) });
+    }
+  });
+
+  app.get("/api/live/shm", async (req, res) => {
+    try {
+      res.json(shmRingStats());
+    } catch (error) {
+      res.status(500).json({ message: "Failed to read shared memory rings", error: String(error) });
+    }
+  });
+
+  // Apply whatever is left in the ring, then stop tailing it
+  app.delete("/api/live/shm/:name", async (req, res) => {
+    try {
+      if (!(await detachShmRing(req.params.name))) {
+        return res.status(404).json({ message: "Shared memory ring not attached" });
+      }
+      res.json({ message: "Shared memory ring detached" });
+    } catch (error) {
+      res.status(500).json({ message: "Failed to detach shared memory ring", error: String(error) });
     }
   });
 
@@ -301,7 +591,7 @@ export async function registerRoutes(app: Express): Promise<Server> {
   app.get("/api/live/matrix", async (req, res) => {
     try {
       const structures = await storage.getAllLiveStructures();
-      const matrix = generateLiveMatrix(structures);
+      const matrix = generateLiveMatrix(structures.map(projectStructure));
       res.json(matrix);
     } catch (error) {
       res.status(500).json({ message: "Failed to generate live matrix", error });
@@ -309,12 +599,13 @@ export async function registerRoutes(app: Express): Promise<Server> {
   });
 
   // Clear/reset a structure
-  app.delete("/api/live/structure/:name", async (req, res) => {
+  app.delete(structurePaths(), async (req, res) => {
     try {
-      const deleted = await storage.deleteLiveStructure(req.params.name);
-      if (!deleted) {
+      const structure = await findLiveStructure(req);
+      if (!structure || !(await storage.deleteLiveStructure(structure.name))) {
         return res.status(404).json({ message: "Structure not found" });
       }
+      publishChange(structure.name);
       res.json({ message: "Structure deleted successfully" });
     } catch (error) {
       res.status(500).json({ message: "Failed to delete structure", error });
@@ -325,6 +616,33 @@ export async function registerRoutes(app: Express): Promise<Server> {
   return httpServer;
 }
 
+// Every per-structure route answers under the structure's name and under the
+// numeric `id` from its create reply. Clients that keep the ID skip escaping
+// the name and the server skips the string-keyed lookup; an ID also never
+// resolves to a later structure that reused the name.
+function structurePaths(suffix = ""): string[] {
+  return [`/api/live/structure/:name${suffix}`, `/api/live/structures/:id(\\d+)${suffix}`];
+}
+
+function findLiveStructure(req: Request) {
+  return req.params.id !== undefined
+    ? storage.getLiveStructure(Number(req.params.id))
+    : storage.getLiveStructureByName(req.params.name);
+}
+
+// Mutation routes normally echo the whole structure back, which makes every
+// op cost O(N) on the wire. Clients that only need an acknowledgement ask for
+// `?return=minimal` or send `Prefer: return=minimal` (RFC 7240).
+function wantsMinimalResponse(req: Request, res: Response): boolean {
+  if (req.query.return === "minimal") return true;
+  const prefer = req.get("Prefer");
+  if (prefer && /(^|[,;\s])return=minimal\b/.test(prefer)) {
+    res.set("Preference-Applied", "return=minimal");
+    return true;
+  }
+  return false;
+}
+
 // Helper functions for code analysis
 async function analyzeCode(content: string) {
   // Simple regex-based structure detection
@@ -387,16 +705,6 @@ function generateMatrixData(structures: any[]) {
 }
 
 // Helper functions for live data structures
-function updateLinkedListPointers(nodes: any[]) {
-  for (let i = 0; i < nodes.length; i++) {
-    if (i < nodes.length - 1) {
-      nodes[i].next = nodes[i + 1].id;
-    } else {
-      nodes[i].next = null;
-    }
-  }
-}
-
 function generateLiveMatrix(structures: any[]) {
   const matrix = [];
   const gridWidth = 12;
@@ -0,0 +1,115 @@
+import { test } from "node:test";
+import assert from "node:assert/strict";
+import fs from "fs";
+import { storage } from "./storage";
+import { reserveNodeIds } from "./liveOps";
+import { encode } from "./wireFormat";
+import { attachShmRing, detachShmRing, shmRingStats, SHM_MAGIC, SHM_LAYOUT_VERSION, SHM_HEADER_SIZE, SHM_SLOT_SIZE } from "./shmRing";
+
+function record(kind: number, nodeId: number, payload: Buffer, payloadLength = payload.length): Buffer {
+  const slot = Buffer.alloc(SHM_SLOT_SIZE);
+  slot.writeUInt8(kind, 0);
+  slot.writeUInt16LE(1, 2);
+  slot.writeInt32LE(nodeId, 8);
+  slot.writeUInt32LE(payloadLength, 16);
+  payload.copy(slot, 24);
+  return slot;
+}
+
+function writeRing(suffix: string, slots: Buffer[]): string {
+  const capacity = 8;
+  const header = Buffer.alloc(SHM_HEADER_SIZE);
+  header.writeUInt32LE(SHM_MAGIC, 0);
+  header.writeUInt32LE(SHM_LAYOUT_VERSION, 4);
+  header.writeUInt32LE(SHM_SLOT_SIZE, 8);
+  header.writeUInt32LE(capacity, 12);
+  header.writeBigUInt64LE(BigInt(slots.length), 64);
+  const segment = `viz-test-${suffix}-${process.pid}`;
+  const padding = Buffer.alloc((capacity - slots.length) * SHM_SLOT_SIZE);
+  fs.writeFileSync(`/dev/shm/${segment}`, Buffer.concat([header, ...slots, padding]));
+  return segment;
+}
+
+async function drainRing(segment: string) {
+  attachShmRing(segment);
+  const stats = () => shmRingStats().find(ring => ring.name === segment)!;
+  for (let i = 0; i < 200 && stats().lag > 0; i++) {
+    await new Promise(resolve => setTimeout(resolve, 5));
+  }
+  return stats();
+}
+
+test("a record whose payload runs past its own slots is rejected", async () => {
+  const structure = await storage.createLiveStructure({
+    name: "shm-lengths",
+    type: "array",
+    depth: 1,
+    nodes: [],
+    next_node_id: 0,
+    version: 0,
+    created_at: "",
+    last_modified: "",
+  });
+  reserveNodeIds(structure, 2);
+
+  const value = encode("msgpack", [5, {}]);
+  const slots = [
+    record(1, 0, Buffer.from(structure.name)),
+    // Claims 41 bytes where a one-slot record holds 40
+    record(2, 0, value, SHM_SLOT_SIZE - 24 + 1),
+    record(2, 1, value),
+  ];
+  const segment = writeRing("lengths", slots);
+
+  try {
+    const stats = await drainRing(segment);
+    assert.equal(stats.lag, 0);
+    assert.equal(stats.errors, 1);
+    assert.equal(stats.applied, 1);
+
+    const stored = await storage.getLiveStructureByName(structure.name);
+    assert.deepEqual(stored?.nodes.map(node => [node.id, node.value]), [[1, 5]]);
+  } finally {
+    await detachShmRing(segment, false);
+    fs.unlinkSync(`/dev/shm/${segment}`);
+  }
+});
+
+test("a malformed payload is counted as an error and the reader carries on", async () => {
+  const structure = await storage.createLiveStructure({
+    name: "shm-malformed",
+    type: "array",
+    depth: 1,
+    nodes: [],
+    next_node_id: 0,
+    version: 0,
+    created_at: "",
+    last_modified: "",
+  });
+  reserveNodeIds(structure, 4);
+
+  const slots = [
+    record(1, 0, Buffer.from(structure.name)),
+    record(2, 0, encode("msgpack", [5, {}])),
+    // Truncated msgpack: a fixarray of two with nothing after it
+    record(2, 1, Buffer.from([0x92])),
+    // Decodes, but is not a [value, metadata] pair
+    record(2, 2, encode("msgpack", 7)),
+    record(2, 3, encode("msgpack", [8, {}])),
+  ];
+  const segment = writeRing("malformed", slots);
+
+  try {
+    const stats = await drainRing(segment);
+    assert.equal(stats.lag, 0);
+    assert.equal(stats.errors, 2);
+    assert.equal(stats.applied, 2);
+
+    const stored = await storage.getLiveStructureByName(structure.name);
+    assert.deepEqual(stored?.nodes.map(node => [node.id, node.value]), [[0, 5], [3, 8]]);
+    assert.ok(stored!.version >= 2);
+  } finally {
+    await detachShmRing(segment, false);
+    fs.unlinkSync(`/dev/shm/${segment}`);
+  }
+});
@@ -0,0 +1,349 @@
+import fs from "fs";
+import path from "path";
+import { storage } from "./storage";
+import type { LiveStructure } from "./storage";
+import { addNode, removeNode, updateNode, relinkNodes, nodeIdInUse, LiveOpError, type Relink } from "./liveOps";
+import { decode } from "./wireFormat";
+import { publishChange } from "./changeFeed";
+
+// Tailing reader for the shared-memory op ring written by the C++ client
+// (VisualizerClient::enableSharedMemory). The client shm_open()s a segment,
+// which Linux exposes as a file under /dev/shm; Node has no mmap, so the
+// reader uses positioned reads on that file, which see the same pages.
+//
+// Layout (little-endian, offsets in bytes):
+//
+//   header, 4096 bytes
+//     0  u32  magic "VZR1" (0x3152_5A56)
+//     4  u32  layout version (1)
+//     8  u32  slot size (64)
+//    12  u32  capacity in slots, a power of two
+//    64  u64  write index: slots published by the client
+//   128  u64  read index: slots consumed by this reader
+//   192  u64  ops the client dropped because the ring was full
+//
+//   slots, capacity x 64 bytes, starting at 4096. A record takes one or more
+//   consecutive slots (modulo capacity):
+//     0  u8   kind: 1 define structure, 2 add, 3 remove, 4 update, 5 drop
+//             (a remove that skips a node id the structure does not have)
+//     1  u8   flags: bit 0 = index is set
+//     2  u16  slots used by this record
+//     4  u32  structure number (bound to a name by a define record)
+//     8  i32  node id
+//    12  i32  insert index
+//    16  u32  payload length
+//    20  u32  reserved
+//    24  ...  payload: 40 bytes here, then the whole of each following slot.
+//             define: UTF-8 structure name; add/update: MessagePack
+//             [value, metadata]; remove/drop: empty.
+//
+// The client publishes a record by advancing the write index after the
+// slots are written, and never writes past the read index, so nothing is
+// overwritten before it has been applied.
+
+export const SHM_MAGIC = 0x31525a56;
+export const SHM_LAYOUT_VERSION = 1;
+export const SHM_HEADER_SIZE = 4096;
+export const SHM_SLOT_SIZE = 64;
+
+const WRITE_INDEX_OFFSET = 64;
+const READ_INDEX_OFFSET = 128;
+const DROPPED_OFFSET = 192;
+const RECORD_HEADER_SIZE = 24;
+const MAX_SLOTS_PER_POLL = 16384;
+
+const KIND_DEFINE = 1;
+const KIND_ADD = 2;
+const KIND_REMOVE = 3;
+const KIND_UPDATE = 4;
+const KIND_DROP = 5;
+
+export interface ShmRingStats {
+  name: string;
+  capacity: number;
+  applied: number;
+  errors: number;
+  dropped: number;
+  lag: number;
+}
+
+class ShmRingReader {
+  readonly capacity: number;
+  applied = 0;
+  errors = 0;
+
+  private fd: number;
+  private header = Buffer.alloc(256);
+  private slots: Buffer;
+  private indexBuf = Buffer.alloc(8);
+  private structures = new Map<number, string>();
+  private readIndex: bigint;
+  private timer: NodeJS.Timeout | null = null;
+  private immediate: NodeJS.Immediate | null = null;
+  private polling: Promise<number> | null = null;
+  private closed = false;
+
+  constructor(readonly name: string) {
+    this.fd = fs.openSync(path.join("/dev/shm", name), "r+");
+    fs.readSync(this.fd, this.header, 0, this.header.length, 0);
+    this.capacity = this.header.readUInt32LE(12);
+
+    let problem: string | null = null;
+    if (this.header.readUInt32LE(0) !== SHM_MAGIC) {
+      problem = "Not a visualizer op ring";
+    } else if (this.header.readUInt32LE(4) !== SHM_LAYOUT_VERSION || this.header.readUInt32LE(8) !== SHM_SLOT_SIZE) {
+      problem = "Unsupported op ring layout";
+    } else if (this.capacity === 0 || (this.capacity & (this.capacity - 1)) !== 0) {
+      problem = "Op ring capacity must be a power of two";
+    }
+    if (problem) {
+      fs.closeSync(this.fd);
+      throw new LiveOpError(400, problem);
+    }
+
+    this.readIndex = this.header.readBigUInt64LE(READ_INDEX_OFFSET);
+    this.slots = Buffer.alloc(Math.min(this.capacity, MAX_SLOTS_PER_POLL) * SHM_SLOT_SIZE);
+  }
+
+  start() {
+    const tick = async () => {
+      this.timer = null;
+      this.immediate = null;
+      if (this.closed) return;
+      let consumed = 0;
+      try {
+        consumed = await this.poll();
+      } catch (error) {
+        console.error(`Op ring ${this.name} stopped:`, error);
+        void detachShmRing(this.name, false);
+        return;
+      }
+      if (this.closed) return;
+      // Stay hot while the client is writing, back off to a 1ms tail when idle
+      if (consumed > 0) {
+        this.immediate = setImmediate(tick);
+      } else if (fs.fstatSync(this.fd).nlink === 0) {
+        // The client unlinked the segment without detaching
+        void detachShmRing(this.name, false);
+      } else {
+        this.timer = setTimeout(tick, 1);
+      }
+    };
+    this.timer = setTimeout(tick, 0);
+  }
+
+  // Serialised so a drain from detach never overlaps the tailing loop
+  poll(): Promise<number> {
+    const run = (this.polling ?? Promise.resolve(0)).then(() => this.pollOnce());
+    this.polling = run.catch(() => 0);
+    return run;
+  }
+
+  stats(): ShmRingStats {
+    fs.readSync(this.fd, this.header, 0, this.header.length, 0);
+    return {
+      name: this.name,
+      capacity: this.capacity,
+      applied: this.applied,
+      errors: this.errors,
+      dropped: Number(this.header.readBigUInt64LE(DROPPED_OFFSET)),
+      lag: Number(this.header.readBigUInt64LE(WRITE_INDEX_OFFSET) - this.readIndex),
+    };
+  }
+
+  close() {
+    this.closed = true;
+    if (this.timer) clearTimeout(this.timer);
+    if (this.immediate) clearImmediate(this.immediate);
+    fs.closeSync(this.fd);
+  }
+
+  private async pollOnce(): Promise<number> {
+    if (this.closed) return 0;
+    fs.readSync(this.fd, this.header, 0, 8, WRITE_INDEX_OFFSET);
+    const writeIndex = this.header.readBigUInt64LE(0);
+    const available = Number(writeIndex - this.readIndex);
+    if (available <= 0) return 0;
+
+    const count = Math.min(available, this.slots.length / SHM_SLOT_SIZE);
+    this.readSlots(count);
+
+    // Apply everything read, touching each structure once at the end
+    const touched = new Map<string, { structure: LiveStructure; relink: Relink; ops: number }>();
+    const now = new Date().toISOString();
+    let consumed = 0;
+    let applied = 0;
+
+    try {
+      while (consumed < count) {
+        const base = consumed * SHM_SLOT_SIZE;
+        const kind = this.slots.readUInt8(base);
+        const flags = this.slots.readUInt8(base + 1);
+        const slots = Math.max(1, this.slots.readUInt16LE(base + 2));
+        if (consumed + slots > count) {
+          // Record straddles this read; pick it up whole on the next poll
+          if (consumed === 0) throw new Error(`Record of ${slots} slots exceeds the read window`);
+          break;
+        }
+        const structureNo = this.slots.readUInt32LE(base + 4);
+        const nodeId = this.slots.readInt32LE(base + 8);
+        const index = this.slots.readInt32LE(base + 12);
+        const payloadLength = this.slots.readUInt32LE(base + 16);
+        consumed += slots;
+        if (payloadLength > slots * SHM_SLOT_SIZE - RECORD_HEADER_SIZE) {
+          // The payload would run on into the records after this one
+          this.errors++;
+          continue;
+        }
+        const payload = this.slots.subarray(base + RECORD_HEADER_SIZE, base + RECORD_HEADER_SIZE + payloadLength);
+
+        if (kind === KIND_DEFINE) {
+          this.structures.set(structureNo, payload.toString("utf8"));
+          continue;
+        }
+
+        try {
+          const name = this.structures.get(structureNo);
+          if (name === undefined) {
+            throw new LiveOpError(400, `Unknown structure number ${structureNo}`);
+          }
+          let entry = touched.get(name);
+          if (!entry) {
+            const structure = await storage.getLiveStructureByName(name);
+            if (!structure) throw new LiveOpError(404, `Structure ${name} not found`);
+            entry = { structure, relink: "none", ops: 0 };
+            touched.set(name, entry);
+          }
+
+          const [value, metadata] = payloadLength > 0 ? decodePayload(payload) : [undefined, undefined];
+          let relink: Relink = "none";
+          switch (kind) {
+            case KIND_ADD:
+              relink = addNode(entry.structure, {
+                id: nodeId,
+                value,
+                index: flags & 1 ? index : undefined,
+                metadata: metadata ?? {},
+              }).relink;
+              break;
+            case KIND_REMOVE:
+              relink = removeNode(entry.structure, nodeId, now).relink;
+              break;
+            case KIND_DROP:
+              if (nodeIdInUse(entry.structure, nodeId)) {
+                relink = removeNode(entry.structure, nodeId, now).relink;
+              }
+              break;
+            case KIND_UPDATE:
+              updateNode(entry.structure, nodeId, { value, metadata }, now);
+              break;
+            default:
+              throw new LiveOpError(400, `Unknown record kind ${kind}`);
+          }
+          if (relink === "all" || (relink === "active" && entry.relink === "none")) {
+            entry.relink = relink;
+          }
+          entry.ops++;
+          applied++;
+        } catch (error) {
+          if (!(error instanceof LiveOpError)) throw error;
+          this.errors++;
+        }
+      }
+    } finally {
+      // Ops already applied get their relink and version even if a later
+      // record stopped the reader
+      for (const { structure, relink, ops } of Array.from(touched.values())) {
+        if (ops === 0) continue;
+        relinkNodes(structure, relink);
+        structure.version += ops;
+        structure.last_modified = now;
+        await storage.updateLiveStructure(structure.id, structure);
+        publishChange(structure.name);
+      }
+    }
+
+    // Hand the slots back to the client only once their ops are applied
+    this.readIndex += BigInt(consumed);
+    this.indexBuf.writeBigUInt64LE(this.readIndex);
+    fs.writeSync(this.fd, this.indexBuf, 0, 8, READ_INDEX_OFFSET);
+    this.applied += applied;
+    return consumed;
+  }
+
+  private readSlots(count: number) {
+    const mask = this.capacity - 1;
+    const first = Number(this.readIndex & BigInt(mask));
+    const head = Math.min(count, this.capacity - first);
+    fs.readSync(this.fd, this.slots, 0, head * SHM_SLOT_SIZE, SHM_HEADER_SIZE + first * SHM_SLOT_SIZE);
+    if (head < count) {
+      fs.readSync(this.fd, this.slots, head * SHM_SLOT_SIZE, (count - head) * SHM_SLOT_SIZE, SHM_HEADER_SIZE);
+    }
+  }
+}
+
+/**
+ * A record's [value, metadata] payload. A writer's bad record is its own
+ * error, counted like a refused op, never one that stops the reader.
+ */
+function decodePayload(payload: Buffer): [any, Record<string, any> | undefined] {
+  let decoded: unknown;
+  try {
+    decoded = decode("msgpack", payload);
+  } catch (error: any) {
+    throw new LiveOpError(400, `Malformed record payload: ${error?.message ?? error}`);
+  }
+  if (!Array.isArray(decoded) || decoded.length !== 2) {
+    throw new LiveOpError(400, "Record payload must be a [value, metadata] array");
+  }
+  const [value, metadata] = decoded;
+  if (metadata !== null && metadata !== undefined && (typeof metadata !== "object" || Array.isArray(metadata))) {
+    throw new LiveOpError(400, "Record metadata must be a map");
+  }
+  return [value, metadata ?? undefined];
+}
+
+const readers = new Map<string, ShmRingReader>();
+
+/**
+ * Start tailing the op ring in /dev/shm/<name>. Attaching a ring that is
+ * already attached is a no-op.
+ */
+export function attachShmRing(name: string): { name: string; capacity: number; slot_size: number } {
+  if (!/^[A-Za-z0-9._-]+$/.test(name) || name.startsWith(".")) {
+    throw new LiveOpError(400, "Invalid shared memory segment name");
+  }
+
+  let reader = readers.get(name);
+  if (!reader) {
+    try {
+      reader = new ShmRingReader(name);
+    } catch (error: any) {
+      if (error?.code === "ENOENT") {
+        throw new LiveOpError(404, "Shared memory segment not found");
+      }
+      throw error;
+    }
+    readers.set(name, reader);
+    reader.start();
+  }
+  return { name, capacity: reader.capacity, slot_size: SHM_SLOT_SIZE };
+}
+
+/**
+ * Stop tailing a ring, by default after applying whatever is still in it
+ */
+export async function detachShmRing(name: string, drain = true): Promise<boolean> {
+  const reader = readers.get(name);
+  if (!reader) return false;
+  readers.delete(name);
+  if (drain) {
+    while ((await reader.poll()) > 0);
+  }
+  reader.close();
+  return true;
+}
+
+export function shmRingStats(): ShmRingStats[] {
+  return Array.from(readers.values()).map(reader => reader.stats());
+}
@@ -0,0 +1,90 @@
+import { test } from "node:test";
+import assert from "node:assert/strict";
+import type { LiveStructure } from "./storage";
+import { addNode, removeNode, LiveOpError } from "./liveOps";
+import { NodeColumns, parseSchema } from "./columnar";
+import { diffStages, getStage, markStage, maskBytes, maskIds, stageSummaries } from "./stages";
+
+function structure(columnar = false): LiveStructure {
+  return {
+    id: 1,
+    name: "test",
+    type: "array",
+    depth: 1,
+    nodes: [],
+    next_node_id: 0,
+    version: 0,
+    created_at: "",
+    last_modified: "",
+    columns: columnar ? new NodeColumns(parseSchema({ x: "float64" })) : undefined,
+  };
+}
+
+function rejects(status: number, fn: () => unknown) {
+  assert.throws(fn, (error: unknown) => error instanceof LiveOpError && error.status === status);
+}
+
+for (const columnar of [false, true]) {
+  const layout = columnar ? "columns" : "nodes";
+
+  test(`markStage snapshots the active nodes (${layout})`, () => {
+    const s = structure(columnar);
+    for (let i = 0; i < 40; i++) addNode(s, { value: { x: i } });
+    for (const id of [0, 5, 31, 32, 39]) removeNode(s, id, "");
+
+    const stage = markStage(s, "filtered", "t1");
+    assert.equal(stage.mask.length, 2);
+    assert.equal(stage.active, 35);
+    const ids = maskIds(stage.mask);
+    assert.equal(ids.length, 35);
+    assert.ok(!ids.includes(31) && !ids.includes(32) && ids.includes(33));
+    assert.deepEqual(ids, [...ids].sort((a, b) => a - b));
+    assert.equal(getStage(s, "filtered"), stage);
+  });
+}
+
+test("marking a stage again replaces it", () => {
+  const s = structure();
+  for (let i = 0; i < 3; i++) addNode(s, { value: i });
+  markStage(s, "a", "t1");
+  markStage(s, "b", "t2");
+  removeNode(s, 1, "");
+  s.version = 4;
+  const again = markStage(s, "a", "t3");
+
+  assert.deepEqual(maskIds(getStage(s, "a").mask), [0, 2]);
+  assert.equal(getStage(s, "a"), again);
+  assert.deepEqual(stageSummaries(s), [
+    { name: "b", version: 0, marked_at: "t2", active: 3 },
+    { name: "a", version: 4, marked_at: "t3", active: 2 },
+  ]);
+  rejects(404, () => getStage(s, "c"));
+});
+
+test("diffStages compares masks of different lengths", () => {
+  const s = structure();
+  for (let i = 0; i < 10; i++) addNode(s, { value: i });
+  const before = markStage(s, "before", "t1");
+  removeNode(s, 3, "");
+  removeNode(s, 9, "");
+  for (let i = 10; i < 70; i++) addNode(s, { value: i });
+  const after = markStage(s, "after", "t2");
+  assert.equal(before.mask.length, 1);
+  assert.equal(after.mask.length, 3);
+
+  const forward = diffStages(before, after);
+  assert.deepEqual(maskIds(forward.dropped), [3, 9]);
+  assert.deepEqual(maskIds(forward.added), Array.from({ length: 60 }, (_, i) => i + 10));
+
+  // The other way round, the same IDs swap sides
+  const back = diffStages(after, before);
+  assert.deepEqual(maskIds(back.dropped), maskIds(forward.added));
+  assert.deepEqual(maskIds(back.added), maskIds(forward.dropped));
+});
+
+test("maskIds and maskBytes read bits least significant first", () => {
+  const mask = new Uint32Array([0x80000001, 0, 0x6]);
+  assert.deepEqual(maskIds(mask), [0, 31, 65, 66]);
+  assert.deepEqual([...maskBytes(mask)], [0x01, 0, 0, 0x80, 0, 0, 0, 0, 0x06, 0, 0, 0]);
+  assert.deepEqual(maskIds(new Uint32Array(0)), []);
+});
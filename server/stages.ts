@@ -0,0 +1,110 @@
+import type { LiveStructure } from "./storage";
+import { LiveOpError } from "./liveOps";
+
+// Processing-stage epochs. Marking a stage snapshots which nodes are active
+// as a bitset indexed by node ID, so the active set at any stage, or what
+// changed between two stages, is a pass over 32-bit words rather than over
+// node objects.
+
+export interface StageSnapshot {
+  name: string;
+  version: number;
+  marked_at: string;
+  active: number;
+  mask: Uint32Array;
+}
+
+export interface StageSummary {
+  name: string;
+  version: number;
+  marked_at: string;
+  active: number;
+}
+
+/**
+ * Close the current epoch under a stage name. Marking a name again replaces
+ * its earlier snapshot.
+ */
+export function markStage(structure: LiveStructure, name: string, markedAt: string): StageSnapshot {
+  const mask = new Uint32Array(Math.ceil(structure.next_node_id / 32));
+  const set = (id: number) => {
+    mask[id >>> 5] |= 1 << (id & 31);
+  };
+
+  const columns = structure.columns;
+  if (columns) {
+    for (let row = 0; row < columns.length; row++) {
+      if (columns.active[row]) set(columns.ids[row]);
+    }
+  } else {
+    for (const node of structure.nodes) {
+      if (node.active) set(node.id);
+    }
+  }
+
+  const snapshot: StageSnapshot = { name, version: structure.version, marked_at: markedAt, active: popcount(mask), mask };
+  structure.stages = [...(structure.stages ?? []).filter(stage => stage.name !== name), snapshot];
+  return snapshot;
+}
+
+export function getStage(structure: LiveStructure, name: string): StageSnapshot {
+  const stage = structure.stages?.find(s => s.name === name);
+  if (!stage) {
+    throw new LiveOpError(404, `Stage "${name}" not found`);
+  }
+  return stage;
+}
+
+export function stageSummaries(structure: LiveStructure): StageSummary[] {
+  return (structure.stages ?? []).map(({ name, version, marked_at, active }) => ({ name, version, marked_at, active }));
+}
+
+/**
+ * Nodes active at `from` but not at `to` (dropped), and the reverse (added)
+ */
+export function diffStages(from: StageSnapshot, to: StageSnapshot): { dropped: Uint32Array; added: Uint32Array } {
+  const words = Math.max(from.mask.length, to.mask.length);
+  const dropped = new Uint32Array(words);
+  const added = new Uint32Array(words);
+  for (let i = 0; i < words; i++) {
+    const a = from.mask[i] ?? 0;
+    const b = to.mask[i] ?? 0;
+    dropped[i] = a & ~b;
+    added[i] = b & ~a;
+  }
+  return { dropped, added };
+}
+
+export function maskIds(mask: Uint32Array): number[] {
+  const ids: number[] = [];
+  for (let i = 0; i < mask.length; i++) {
+    let word = mask[i];
+    while (word !== 0) {
+      const bit = 31 - Math.clz32(word & -word);
+      ids.push(i * 32 + bit);
+      word &= word - 1;
+    }
+  }
+  return ids;
+}
+
+/**
+ * The mask as packed bytes, least significant bit first, the same layout
+ * the drop route takes
+ */
+export function maskBytes(mask: Uint32Array): Buffer {
+  const bytes = Buffer.alloc(mask.length * 4);
+  mask.forEach((word, i) => bytes.writeUInt32LE(word, i * 4));
+  return bytes;
+}
+
+export function popcount(mask: Uint32Array): number {
+  let count = 0;
+  for (let i = 0; i < mask.length; i++) {
+    let word = mask[i];
+    word = word - ((word >>> 1) & 0x55555555);
+    word = (word & 0x33333333) + ((word >>> 2) & 0x33333333);
+    count += (((word + (word >>> 4)) & 0x0f0f0f0f) * 0x01010101) >>> 24;
+  }
+  return count;
+}
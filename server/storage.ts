@@ -1,4 +1,6 @@
 import { cppFiles, analysisResults, type CppFile, type InsertCppFile, type AnalysisResult, type InsertAnalysisResult } from "@shared/schema";
+import type { NodeColumns, SchemaField } from "./columnar";
+import type { StageSnapshot } from "./stages";
 
 // Live structure types
 export interface LiveNode {
@@ -15,8 +17,23 @@ export interface LiveStructure {
   type: 'linked_list' | 'array' | 'tree' | 'graph';
   depth: number;
   nodes: LiveNode[];
+  next_node_id: number;
+  version: number;
   created_at: string;
   last_modified: string;
+  // Set when the structure was created with a value schema; its nodes then
+  // live in columns and `nodes` stays empty
+  schema?: SchemaField[];
+  columns?: NodeColumns;
+  // Active-node snapshots taken by markStage, oldest first
+  stages?: StageSnapshot[];
+  // Version at which each node last changed, indexed by node ID, and the
+  // last version that reordered nodes; see versions.ts
+  node_versions?: Uint32Array;
+  order_version?: number;
+  // One bit per node ID in use, so adds can reject a duplicate without a
+  // scan; see claimNodeId in liveOps.ts
+  node_ids?: Uint32Array;
 }
 
 export interface InsertLiveStructure {
@@ -24,8 +41,14 @@ export interface InsertLiveStructure {
   type: 'linked_list' | 'array' | 'tree' | 'graph';
   depth: number;
   nodes: LiveNode[];
+  next_node_id: number;
+  version: number;
   created_at: string;
   last_modified: string;
+  // Set when the structure was created with a value schema; its nodes then
+  // live in columns and `nodes` stays empty
+  schema?: SchemaField[];
+  columns?: NodeColumns;
 }
 
 export interface IStorage {
@@ -125,6 +148,9 @@ export class MemStorage implements IStorage {
   async createLiveStructure(insertStructure: InsertLiveStructure): Promise<LiveStructure> {
     const id = this.currentLiveStructureId++;
     const structure: LiveStructure = { ...insertStructure, id };
+    // Recreating a name replaces the old structure, so its ID stops resolving
+    const replaced = this.liveStructuresByName.get(structure.name);
+    if (replaced) this.liveStructures.delete(replaced.id);
     this.liveStructures.set(id, structure);
     this.liveStructuresByName.set(structure.name, structure);
     return structure;
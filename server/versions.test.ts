@@ -0,0 +1,103 @@
+import { test } from "node:test";
+import assert from "node:assert/strict";
+import type { LiveStructure } from "./storage";
+import { addNode, removeNode, updateNode } from "./liveOps";
+import { NodeColumns, parseSchema } from "./columnar";
+import { canDelta, nodesSince, stampNode, stampRows } from "./versions";
+
+function structure(columnar = false, type = "array"): LiveStructure {
+  return {
+    id: 1,
+    name: "test",
+    type,
+    depth: 1,
+    nodes: [],
+    next_node_id: 0,
+    version: 0,
+    created_at: "",
+    last_modified: "",
+    columns: columnar ? new NodeColumns(parseSchema({ x: "float64" })) : undefined,
+  };
+}
+
+// What a route does around a helper: the helper stamps version + 1, then
+// the route moves the structure to it
+function mutate(s: LiveStructure, fn: () => unknown) {
+  fn();
+  s.version++;
+}
+
+const ids = (nodes: { id: number }[]) => nodes.map(node => node.id);
+
+test("stampNode stamps the next version and grows past its capacity", () => {
+  const s = structure();
+  assert.deepEqual(nodesSince(s, 0), []);
+  s.version = 7;
+  stampNode(s, 3);
+  stampNode(s, 1000);
+  assert.equal(s.node_versions?.[3], 8);
+  assert.equal(s.node_versions?.[1000], 8);
+  assert.ok((s.node_versions?.length ?? 0) > 1000);
+
+  // Growing keeps the stamps already made
+  stampNode(s, 5000);
+  assert.equal(s.node_versions?.[3], 8);
+  assert.equal(s.node_versions?.[1000], 8);
+});
+
+for (const columnar of [false, true]) {
+  const layout = columnar ? "columns" : "nodes";
+
+  test(`nodesSince returns only nodes changed after a version (${layout})`, () => {
+    const s = structure(columnar);
+    for (let i = 0; i < 5; i++) mutate(s, () => addNode(s, { value: { x: i } }));
+    assert.equal(s.version, 5);
+    assert.deepEqual(ids(nodesSince(s, 0)), [0, 1, 2, 3, 4]);
+    assert.deepEqual(ids(nodesSince(s, 3)), [3, 4]);
+    assert.deepEqual(nodesSince(s, 5), []);
+
+    mutate(s, () => updateNode(s, 1, { value: { x: 10 } }, ""));
+    mutate(s, () => removeNode(s, 3, ""));
+    const changed = nodesSince(s, 5);
+    assert.deepEqual(ids(changed), [1, 3]);
+    assert.deepEqual(changed[0].value, { x: 10 });
+    assert.equal(changed[1].active, false);
+    assert.deepEqual(ids(nodesSince(s, 6)), [3]);
+  });
+
+  test(`an indexed insert rules out deltas from before it (${layout})`, () => {
+    const s = structure(columnar);
+    for (let i = 0; i < 3; i++) mutate(s, () => addNode(s, { value: { x: i } }));
+    assert.ok(canDelta(s, 0));
+
+    // An append keeps deltas possible, an insert in the middle does not
+    mutate(s, () => addNode(s, { value: { x: 3 } }));
+    assert.ok(canDelta(s, 2));
+    mutate(s, () => addNode(s, { value: { x: 4 }, index: 1 }));
+    assert.equal(s.version, 5);
+    assert.ok(!canDelta(s, 0));
+    assert.ok(!canDelta(s, 4));
+    assert.ok(canDelta(s, 5));
+  });
+}
+
+test("appending to a linked list stamps the node that now points at it", () => {
+  const s = structure(false, "linked_list");
+  mutate(s, () => addNode(s, { value: 0 }));
+  mutate(s, () => addNode(s, { value: 1 }));
+  mutate(s, () => addNode(s, { value: 2 }));
+  const changed = nodesSince(s, 2);
+  assert.deepEqual(ids(changed), [1, 2]);
+  assert.equal(changed[0].next, 2);
+});
+
+test("stampRows stamps every row from the first appended one", () => {
+  const s = structure(true);
+  for (let i = 0; i < 4; i++) mutate(s, () => addNode(s, { value: { x: i } }));
+  stampRows(s, 2);
+  s.version++;
+  assert.deepEqual(ids(nodesSince(s, 4)), [2, 3]);
+  stampRows(s, -1);
+  s.version++;
+  assert.deepEqual(ids(nodesSince(s, 5)), [0, 1, 2, 3]);
+});
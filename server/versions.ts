@@ -0,0 +1,75 @@
+import type { LiveNode, LiveStructure } from "./storage";
+
+// Per-node change versions, so a client holding version V of a structure can
+// fetch just the nodes changed after V instead of the whole snapshot. Every
+// mutation helper stamps the nodes it touches with the version the structure
+// is about to move to; nodes never stamped date from creation.
+
+const MIN_CAPACITY = 64;
+
+/**
+ * Record that a node changes in the next version. Routes bump
+ * structure.version after the helpers run, so the stamp is version + 1.
+ */
+export function stampNode(structure: LiveStructure, id: number) {
+  let versions = structure.node_versions;
+  if (!versions || id >= versions.length) {
+    let capacity = Math.max(versions?.length ?? 0, MIN_CAPACITY);
+    while (capacity <= id) capacity *= 2;
+    const grown = new Uint32Array(capacity);
+    if (versions) grown.set(versions);
+    structure.node_versions = versions = grown;
+  }
+  versions[id] = structure.version + 1;
+}
+
+/** Stamp every columnar row from `from` to the end, e.g. after appendRows */
+export function stampRows(structure: LiveStructure, from: number) {
+  const columns = structure.columns;
+  if (!columns) return;
+  for (let row = Math.max(from, 0); row < columns.length; row++) {
+    stampNode(structure, columns.ids[row]);
+  }
+}
+
+/**
+ * Record that node order changed in the next version (an indexed insert).
+ * Deltas cannot express a move, so fetches from before it get a full
+ * snapshot.
+ */
+export function stampOrder(structure: LiveStructure) {
+  structure.order_version = structure.version + 1;
+}
+
+/** Whether a delta since `since` is possible, i.e. no reorder came after it */
+export function canDelta(structure: LiveStructure, since: number): boolean {
+  return since >= (structure.order_version ?? 0);
+}
+
+/** The nodes changed after version `since`, in node order */
+export function nodesSince(structure: LiveStructure, since: number): LiveNode[] {
+  const versions = structure.node_versions;
+  if (!versions) return [];
+  const changed = (id: number) => id < versions.length && versions[id] > since;
+
+  const columns = structure.columns;
+  if (columns) {
+    const nodes: LiveNode[] = [];
+    for (let row = 0; row < columns.length; row++) {
+      if (changed(columns.ids[row])) nodes.push(columns.node(row));
+    }
+    return nodes;
+  }
+  return structure.nodes.filter(node => changed(node.id));
+}
+
+/**
+ * Weak validator for a structure's current state in one wire format. The
+ * structure ID is part of it so a deleted and recreated structure never
+ * matches an old tag, and the format so a JSON client never revalidates a
+ * cached MessagePack or CBOR body.
+ */
+export function structureTag(structure: LiveStructure, format = "json"): string {
+  const suffix = format === "json" ? "" : `-${format}`;
+  return `W/"${structure.id}-${structure.version}${suffix}"`;
+}
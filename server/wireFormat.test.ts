@@ -0,0 +1,42 @@
+import { test } from "node:test";
+import assert from "node:assert/strict";
+import express from "express";
+import type { AddressInfo } from "net";
+import type { LiveStructure } from "./storage";
+import { wireFormatMiddleware, replyFormat } from "./wireFormat";
+import { structureTag } from "./versions";
+
+const structure = { id: 3, version: 7 } as LiveStructure;
+
+test("structure replies vary by Accept and carry a tag per format", async () => {
+  const app = express();
+  app.use(...wireFormatMiddleware());
+  app.get("/structure", (req, res) => {
+    res.set("ETag", structureTag(structure, replyFormat(res)));
+    if (req.fresh) return res.status(304).end();
+    res.json({ id: structure.id, version: structure.version });
+  });
+  const server = app.listen(0);
+  const url = `http://127.0.0.1:${(server.address() as AddressInfo).port}/structure`;
+
+  try {
+    const json = await fetch(url, { headers: { Accept: "application/json" } });
+    const packed = await fetch(url, { headers: { Accept: "application/msgpack" } });
+    assert.match(json.headers.get("vary") ?? "", /\bAccept\b/);
+    assert.match(packed.headers.get("vary") ?? "", /\bAccept\b/);
+    const jsonTag = json.headers.get("etag")!;
+    const packedTag = packed.headers.get("etag")!;
+    assert.notEqual(jsonTag, packedTag);
+
+    // A JSON client holding the MessagePack tag must get a JSON body back
+    const mixed = await fetch(url, { headers: { Accept: "application/json", "If-None-Match": packedTag } });
+    assert.equal(mixed.status, 200);
+    assert.match(mixed.headers.get("content-type") ?? "", /json/);
+    assert.deepEqual(await mixed.json(), { id: 3, version: 7 });
+
+    const fresh = await fetch(url, { headers: { Accept: "application/json", "If-None-Match": jsonTag } });
+    assert.equal(fresh.status, 304);
+  } finally {
+    server.close();
+  }
+});
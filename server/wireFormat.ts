@@ -0,0 +1,398 @@
+import express, { type Request, type Response, type NextFunction } from "express";
+
+// Binary wire formats for the live API. Clients that send or accept
+// MessagePack or CBOR skip JSON text encoding on both ends; everything else
+// keeps getting JSON. Values map the same way JSON.stringify would: toJSON()
+// is honoured and undefined object properties are dropped.
+
+export const MSGPACK_TYPES = ["application/msgpack", "application/x-msgpack", "application/vnd.msgpack"];
+export const CBOR_TYPES = ["application/cbor"];
+
+type WireFormat = "msgpack" | "cbor";
+
+class ByteWriter {
+  private buf = Buffer.allocUnsafe(256);
+  private pos = 0;
+
+  private ensure(n: number) {
+    if (this.pos + n <= this.buf.length) return;
+    let size = this.buf.length * 2;
+    while (size < this.pos + n) size *= 2;
+    const next = Buffer.allocUnsafe(size);
+    this.buf.copy(next, 0, 0, this.pos);
+    this.buf = next;
+  }
+
+  u8(v: number) { this.ensure(1); this.buf[this.pos++] = v; }
+  u16(v: number) { this.ensure(2); this.buf.writeUInt16BE(v, this.pos); this.pos += 2; }
+  u32(v: number) { this.ensure(4); this.buf.writeUInt32BE(v, this.pos); this.pos += 4; }
+  u64(v: number) { this.ensure(8); this.buf.writeBigUInt64BE(BigInt(v), this.pos); this.pos += 8; }
+  i64(v: number) { this.ensure(8); this.buf.writeBigInt64BE(BigInt(v), this.pos); this.pos += 8; }
+  f64(v: number) { this.ensure(8); this.buf.writeDoubleBE(v, this.pos); this.pos += 8; }
+  bytes(b: Uint8Array) { this.ensure(b.length); this.buf.set(b, this.pos); this.pos += b.length; }
+  utf8(s: string) {
+    const len = Buffer.byteLength(s);
+    this.ensure(len);
+    this.buf.write(s, this.pos, "utf8");
+    this.pos += len;
+  }
+  finish(): Buffer { return this.buf.subarray(0, this.pos); }
+}
+
+class ByteReader {
+  pos = 0;
+  constructor(private buf: Buffer) {}
+
+  private need(n: number) {
+    if (this.pos + n > this.buf.length) throw new Error("Unexpected end of input");
+  }
+  u8() { this.need(1); return this.buf[this.pos++]; }
+  u16() { this.need(2); const v = this.buf.readUInt16BE(this.pos); this.pos += 2; return v; }
+  u32() { this.need(4); const v = this.buf.readUInt32BE(this.pos); this.pos += 4; return v; }
+  u64() { this.need(8); const v = Number(this.buf.readBigUInt64BE(this.pos)); this.pos += 8; return v; }
+  i8() { this.need(1); return this.buf.readInt8(this.pos++); }
+  i16() { this.need(2); const v = this.buf.readInt16BE(this.pos); this.pos += 2; return v; }
+  i32() { this.need(4); const v = this.buf.readInt32BE(this.pos); this.pos += 4; return v; }
+  i64() { this.need(8); const v = Number(this.buf.readBigInt64BE(this.pos)); this.pos += 8; return v; }
+  f16() {
+    const h = this.u16();
+    const exp = (h >> 10) & 0x1f;
+    const mant = h & 0x3ff;
+    const sign = h & 0x8000 ? -1 : 1;
+    if (exp === 0) return sign * mant * 2 ** -24;
+    if (exp === 31) return mant ? NaN : sign * Infinity;
+    return sign * (1 + mant / 1024) * 2 ** (exp - 15);
+  }
+  f32() { this.need(4); const v = this.buf.readFloatBE(this.pos); this.pos += 4; return v; }
+  f64() { this.need(8); const v = this.buf.readDoubleBE(this.pos); this.pos += 8; return v; }
+  bytes(n: number) { this.need(n); const v = this.buf.subarray(this.pos, this.pos + n); this.pos += n; return v; }
+  utf8(n: number) { this.need(n); const v = this.buf.toString("utf8", this.pos, this.pos + n); this.pos += n; return v; }
+}
+
+// Normalise a value the way JSON.stringify would before encoding it
+function toPlain(value: any): any {
+  if (value !== null && typeof value === "object" && typeof value.toJSON === "function" && !(value instanceof Uint8Array)) {
+    return value.toJSON();
+  }
+  return value;
+}
+
+// MessagePack
+
+function writeMsgpack(w: ByteWriter, raw: any) {
+  const value = toPlain(raw);
+  if (value === null || value === undefined || typeof value === "function" || typeof value === "symbol") {
+    // JSON turns these into null inside arrays; object properties are skipped by the caller
+    w.u8(0xc0);
+  } else if (typeof value === "boolean") {
+    w.u8(value ? 0xc3 : 0xc2);
+  } else if (typeof value === "number") {
+    if (Number.isInteger(value) && Number.isSafeInteger(value)) {
+      if (value >= 0) {
+        if (value < 0x80) w.u8(value);
+        else if (value < 0x100) { w.u8(0xcc); w.u8(value); }
+        else if (value < 0x10000) { w.u8(0xcd); w.u16(value); }
+        else if (value < 0x100000000) { w.u8(0xce); w.u32(value); }
+        else { w.u8(0xcf); w.u64(value); }
+      } else {
+        if (value >= -32) w.u8(value & 0xff);
+        else if (value >= -0x80) { w.u8(0xd0); w.u8(value & 0xff); }
+        else if (value >= -0x8000) { w.u8(0xd1); w.u16(value & 0xffff); }
+        else if (value >= -0x80000000) { w.u8(0xd2); w.u32(value >>> 0); }
+        else { w.u8(0xd3); w.i64(value); }
+      }
+    } else if (Number.isFinite(value)) {
+      w.u8(0xcb); w.f64(value);
+    } else {
+      w.u8(0xc0);
+    }
+  } else if (typeof value === "bigint") {
+    w.u8(0xd3); w.i64(Number(value));
+  } else if (typeof value === "string") {
+    const len = Buffer.byteLength(value);
+    if (len < 32) w.u8(0xa0 | len);
+    else if (len < 0x100) { w.u8(0xd9); w.u8(len); }
+    else if (len < 0x10000) { w.u8(0xda); w.u16(len); }
+    else { w.u8(0xdb); w.u32(len); }
+    w.utf8(value);
+  } else if (value instanceof Uint8Array) {
+    const len = value.length;
+    if (len < 0x100) { w.u8(0xc4); w.u8(len); }
+    else if (len < 0x10000) { w.u8(0xc5); w.u16(len); }
+    else { w.u8(0xc6); w.u32(len); }
+    w.bytes(value);
+  } else if (Array.isArray(value)) {
+    const len = value.length;
+    if (len < 16) w.u8(0x90 | len);
+    else if (len < 0x10000) { w.u8(0xdc); w.u16(len); }
+    else { w.u8(0xdd); w.u32(len); }
+    for (const item of value) writeMsgpack(w, item);
+  } else {
+    const keys = Object.keys(value).filter(k => isEncodable(value[k]));
+    const len = keys.length;
+    if (len < 16) w.u8(0x80 | len);
+    else if (len < 0x10000) { w.u8(0xde); w.u16(len); }
+    else { w.u8(0xdf); w.u32(len); }
+    for (const key of keys) {
+      writeMsgpack(w, key);
+      writeMsgpack(w, value[key]);
+    }
+  }
+}
+
+function isEncodable(value: any) {
+  return value !== undefined && typeof value !== "function" && typeof value !== "symbol";
+}
+
+function readMsgpack(r: ByteReader): any {
+  const b = r.u8();
+  if (b < 0x80) return b;
+  if (b >= 0xe0) return b - 0x100;
+  if ((b & 0xf0) === 0x80) return readMsgpackMap(r, b & 0x0f);
+  if ((b & 0xf0) === 0x90) return readMsgpackArray(r, b & 0x0f);
+  if ((b & 0xe0) === 0xa0) return r.utf8(b & 0x1f);
+  switch (b) {
+    case 0xc0: return null;
+    case 0xc2: return false;
+    case 0xc3: return true;
+    case 0xc4: return Buffer.from(r.bytes(r.u8()));
+    case 0xc5: return Buffer.from(r.bytes(r.u16()));
+    case 0xc6: return Buffer.from(r.bytes(r.u32()));
+    case 0xca: return r.f32();
+    case 0xcb: return r.f64();
+    case 0xcc: return r.u8();
+    case 0xcd: return r.u16();
+    case 0xce: return r.u32();
+    case 0xcf: return r.u64();
+    case 0xd0: return r.i8();
+    case 0xd1: return r.i16();
+    case 0xd2: return r.i32();
+    case 0xd3: return r.i64();
+    case 0xd9: return r.utf8(r.u8());
+    case 0xda: return r.utf8(r.u16());
+    case 0xdb: return r.utf8(r.u32());
+    case 0xdc: return readMsgpackArray(r, r.u16());
+    case 0xdd: return readMsgpackArray(r, r.u32());
+    case 0xde: return readMsgpackMap(r, r.u16());
+    case 0xdf: return readMsgpackMap(r, r.u32());
+    default:
+      throw new Error(`Unsupported MessagePack type 0x${b.toString(16)}`);
+  }
+}
+
+function readMsgpackArray(r: ByteReader, len: number) {
+  const out = new Array(len);
+  for (let i = 0; i < len; i++) out[i] = readMsgpack(r);
+  return out;
+}
+
+function readMsgpackMap(r: ByteReader, len: number) {
+  const out: Record<string, any> = {};
+  for (let i = 0; i < len; i++) {
+    const key = readMsgpack(r);
+    out[String(key)] = readMsgpack(r);
+  }
+  return out;
+}
+
+// CBOR (RFC 8949)
+
+function writeCborHead(w: ByteWriter, major: number, n: number) {
+  const m = major << 5;
+  if (n < 24) w.u8(m | n);
+  else if (n < 0x100) { w.u8(m | 24); w.u8(n); }
+  else if (n < 0x10000) { w.u8(m | 25); w.u16(n); }
+  else if (n < 0x100000000) { w.u8(m | 26); w.u32(n); }
+  else { w.u8(m | 27); w.u64(n); }
+}
+
+function writeCbor(w: ByteWriter, raw: any) {
+  const value = toPlain(raw);
+  if (value === null || value === undefined || typeof value === "function" || typeof value === "symbol") {
+    w.u8(0xf6);
+  } else if (typeof value === "boolean") {
+    w.u8(value ? 0xf5 : 0xf4);
+  } else if (typeof value === "number") {
+    if (Number.isInteger(value) && Number.isSafeInteger(value)) {
+      if (value >= 0) writeCborHead(w, 0, value);
+      else writeCborHead(w, 1, -1 - value);
+    } else if (Number.isFinite(value)) {
+      w.u8(0xfb); w.f64(value);
+    } else {
+      w.u8(0xf6);
+    }
+  } else if (typeof value === "bigint") {
+    const n = Number(value);
+    if (n >= 0) writeCborHead(w, 0, n);
+    else writeCborHead(w, 1, -1 - n);
+  } else if (typeof value === "string") {
+    writeCborHead(w, 3, Buffer.byteLength(value));
+    w.utf8(value);
+  } else if (value instanceof Uint8Array) {
+    writeCborHead(w, 2, value.length);
+    w.bytes(value);
+  } else if (Array.isArray(value)) {
+    writeCborHead(w, 4, value.length);
+    for (const item of value) writeCbor(w, item);
+  } else {
+    const keys = Object.keys(value).filter(k => isEncodable(value[k]));
+    writeCborHead(w, 5, keys.length);
+    for (const key of keys) {
+      writeCborHead(w, 3, Buffer.byteLength(key));
+      w.utf8(key);
+      writeCbor(w, value[key]);
+    }
+  }
+}
+
+const CBOR_BREAK = Symbol("break");
+
+function readCborLength(r: ByteReader, info: number): number {
+  if (info < 24) return info;
+  switch (info) {
+    case 24: return r.u8();
+    case 25: return r.u16();
+    case 26: return r.u32();
+    case 27: return r.u64();
+    case 31: return -1; // indefinite length
+    default:
+      throw new Error(`Invalid CBOR length encoding ${info}`);
+  }
+}
+
+function readCbor(r: ByteReader): any {
+  const b = r.u8();
+  const major = b >> 5;
+  const info = b & 0x1f;
+
+  switch (major) {
+    case 0: return readCborLength(r, info);
+    case 1: return -1 - readCborLength(r, info);
+    case 2:
+    case 3: {
+      const len = readCborLength(r, info);
+      if (len >= 0) {
+        return major === 2 ? Buffer.from(r.bytes(len)) : r.utf8(len);
+      }
+      // Indefinite-length string: concatenate definite chunks until break
+      const chunks: Buffer[] = [];
+      for (;;) {
+        const chunk = readCbor(r);
+        if (chunk === CBOR_BREAK) break;
+        chunks.push(Buffer.isBuffer(chunk) ? chunk : Buffer.from(String(chunk)));
+      }
+      const joined = Buffer.concat(chunks);
+      return major === 2 ? joined : joined.toString("utf8");
+    }
+    case 4: {
+      const len = readCborLength(r, info);
+      const out: any[] = [];
+      if (len >= 0) {
+        for (let i = 0; i < len; i++) out.push(readCbor(r));
+      } else {
+        for (;;) {
+          const item = readCbor(r);
+          if (item === CBOR_BREAK) break;
+          out.push(item);
+        }
+      }
+      return out;
+    }
+    case 5: {
+      const len = readCborLength(r, info);
+      const out: Record<string, any> = {};
+      for (let i = 0; len < 0 || i < len; i++) {
+        const key = readCbor(r);
+        if (key === CBOR_BREAK) break;
+        out[String(key)] = readCbor(r);
+      }
+      return out;
+    }
+    case 6:
+      // Tags carry no meaning for the live API; decode the tagged item
+      readCborLength(r, info);
+      return readCbor(r);
+    default:
+      switch (info) {
+        case 20: return false;
+        case 21: return true;
+        case 22: return null;
+        case 23: return null;
+        case 25: return r.f16();
+        case 26: return r.f32();
+        case 27: return r.f64();
+        case 31: return CBOR_BREAK;
+        default:
+          if (info < 24) return null;
+          if (info === 24) { r.u8(); return null; }
+          throw new Error(`Unsupported CBOR simple value ${info}`);
+      }
+  }
+}
+
+export function encode(format: WireFormat, value: any): Buffer {
+  const w = new ByteWriter();
+  if (format === "msgpack") writeMsgpack(w, value);
+  else writeCbor(w, value);
+  return w.finish();
+}
+
+export function decode(format: WireFormat, buf: Buffer): any {
+  const r = new ByteReader(buf);
+  const value = format === "msgpack" ? readMsgpack(r) : readCbor(r);
+  if (r.pos !== buf.length) {
+    throw new Error("Trailing bytes after encoded value");
+  }
+  return value;
+}
+
+function formatOf(contentType: string | undefined): WireFormat | undefined {
+  if (!contentType) return undefined;
+  const type = contentType.split(";")[0].trim().toLowerCase();
+  if (MSGPACK_TYPES.includes(type)) return "msgpack";
+  if (CBOR_TYPES.includes(type)) return "cbor";
+  return undefined;
+}
+
+/** The format res.json() replies in, as negotiated by wireFormatMiddleware */
+export function replyFormat(res: Response): WireFormat | "json" {
+  return res.locals.wireFormat ?? "json";
+}
+
+/**
+ * Content negotiation for the live API. Decodes MessagePack/CBOR request
+ * bodies into req.body, and encodes res.json() replies in the format the
+ * client asked for via Accept. JSON stays the default both ways.
+ */
+export function wireFormatMiddleware() {
+  const raw = express.raw({ type: [...MSGPACK_TYPES, ...CBOR_TYPES], limit: "50mb" });
+
+  return [
+    raw,
+    (req: Request, res: Response, next: NextFunction) => {
+      const requestFormat = formatOf(req.headers["content-type"]);
+      if (requestFormat && Buffer.isBuffer(req.body)) {
+        try {
+          req.body = req.body.length > 0 ? decode(requestFormat, req.body) : {};
+        } catch (error) {
+          return res.status(400).json({ message: `Invalid ${requestFormat} body`, error: String(error) });
+        }
+      }
+
+      const accepted = req.accepts(["application/json", ...MSGPACK_TYPES, ...CBOR_TYPES]);
+      const responseFormat = formatOf(accepted || undefined);
+      // Replies differ by Accept, so caches have to key on it as well
+      res.vary("Accept");
+      res.locals.wireFormat = responseFormat ?? "json";
+      if (responseFormat) {
+        const contentType = responseFormat === "msgpack" ? "application/msgpack" : "application/cbor";
+        res.json = ((body: any) => {
+          res.type(contentType);
+          return res.send(encode(responseFormat, body));
+        }) as Response["json"];
+      }
+
+      next();
+    },
+  ];
+}